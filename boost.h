@@ -1,5 +1,7 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/regex.hpp>
 #include <boost/lexical_cast.hpp>
 
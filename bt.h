@@ -5,22 +5,43 @@
 
 namespace bt {
 
-    static const int BLOCK_SIZE = 256;
+    // the block size of a file is chosen when it is created and recorded
+    // in its header.  it must be a power of two between MIN_BLOCK_SIZE and
+    // MAX_BLOCK_SIZE.
+    static const int DEFAULT_BLOCK_SIZE = 4096;
+    static const int MIN_BLOCK_SIZE = 256;
+    static const int MAX_BLOCK_SIZE = 64*1024;
+
     static const int FRAG_SIZE = 32;
     
-    typedef long BLOCKNO;
+    // block numbers are 64-bit on every platform, so that the byte offset
+    // of a block never overflows, even where long is only 32 bits wide
+    typedef int64_t BLOCKNO;
     typedef long FRAGNO;
     
     static const BLOCKNO INVALID_BLOCK_NUMBER = -1;
     static const FRAGNO  INVALID_FRAG_NUMBER  = -1;
     
+    inline os::File::POS blockOffset( BLOCKNO bn, int blockSize ) {
+	return bn * (os::File::POS) blockSize;
+    }
+
+    inline bool isValidBlockSize( int blockSize ) {
+	return blockSize >= MIN_BLOCK_SIZE && blockSize <= MAX_BLOCK_SIZE && (blockSize & (blockSize-1)) == 0;
+    }
+    
     static const int NODE_MAGIC_VALUE = 0x76F3D90A;
     static const int HEADER_MAGIC_VALUE = 0x823A9BE4;
     static const int FRAGMENT_MAGIC_VALUE = 0x2301AD98;
+    static const int FREE_BLOCK_MAGIC_VALUE = 0x5EE0B10C;
+    static const int FREE_EXTENT_MAGIC_VALUE = 0x5EE0E87E;
+    static const int LOG_MAGIC_VALUE = 0x10C5EC0D;
+
+    // version of the file layout, bumped whenever it changes
+    static const int FILE_FORMAT_VERSION = 12;
     
     static const int NODE_DATA_LEN = 32;
     static const int OVERFLOW_ENTRY_DATA_LEN = NODE_DATA_LEN - (sizeof(BLOCKNO) + sizeof(FRAGNO));
-    static const int MAX_FRAGS_PER_BLOCK = (BLOCK_SIZE-sizeof(long)) / FRAG_SIZE;
 
     class FileCorruptedException : public std::exception {
     public:
@@ -44,18 +65,288 @@ namespace bt {
 	    return "Cannot retrieve requested count of fragments.";
 	}
     };
+
+    class BufferPoolExhaustedException : public std::exception {
+    public:
+	virtual const char* what() const throw() {
+	    return "All buffer pool frames are pinned.";
+	}
+    };
+
+    class KeyOrderException : public std::exception {
+    public:
+	virtual const char* what() const throw() {
+	    return "Keys must be added in ascending order.";
+	}
+    };
+
+    class TreeNotEmptyException : public std::exception {
+    public:
+	virtual const char* what() const throw() {
+	    return "The tree must be empty.";
+	}
+    };
+
+    class InvalidBlockSizeException : public std::exception {
+    public:
+	virtual const char* what() const throw() {
+	    return "Block size must be a power of two between MIN_BLOCK_SIZE and MAX_BLOCK_SIZE.";
+	}
+    };
+
+    class InvalidKeyFormatException : public std::exception {
+    public:
+	virtual const char* what() const throw() {
+	    return "Keys must be ints, int64s, or byte strings of at most MAX_KEY_LEN bytes, and fit at least three to a node.";
+	}
+    };
+
+    class KeyTypeException : public std::exception {
+    public:
+	virtual const char* what() const throw() {
+	    return "Key does not match the key format of the tree.";
+	}
+    };
+
+    class RecoveryNeededException : public std::exception {
+    public:
+	virtual const char* what() const throw() {
+	    return "The log holds changes that must be recovered by opening the tree for writing.";
+	}
+    };
+
+
+    //
+    // the keys of a tree are all of one type, chosen when it is created:
+    // 32 or 64-bit signed integers, or byte strings of up to a given
+    // length.  byte strings are ordered as memcmp orders them, with a key
+    // before any longer key it is a prefix of.
+    //
+
+    static const int MAX_KEY_LEN = 64;
+
+    enum KEYTYPE {
+	ktInt,
+	ktInt64,
+	ktBytes
+    };
+
+    //
+    // a Key holds a key of any type as the bytes it sorts by.  a byte
+    // string is its own bytes, and an integer is stored big-endian with
+    // its sign bit flipped, so two keys of one type always compare as
+    // their bytes do.  the type is only kept to print the key by.
+    //
+    class Key {
+    protected:
+	KEYTYPE		_type;
+	int		_len;
+	unsigned char	_bytes[MAX_KEY_LEN];
+
+    public:
+	Key() : _type(ktBytes), _len(0) {}
+	Key( int k );
+	Key( int64_t k );
+	Key( const char* sz ) throw(KeyTypeException);
+	Key( const std::string& s ) throw(KeyTypeException);
+	Key( const void* data, int len ) throw(KeyTypeException);
+
+	KEYTYPE getType() const { return _type; }
+	int getLength() const { return _len; }
+	const unsigned char* getBytes() const { return _bytes; }
+
+	int toInt() const;
+	int64_t toInt64() const;
+	std::string toString() const;
+
+	// < 0, 0 or > 0 as this key sorts before, with or after k
+	int compare( const Key& k ) const;
+
+	// the count of leading bytes this key has in common with k
+	int getCommonPrefix( const Key& k ) const;
+
+	bool operator == ( const Key& k ) const { return compare(k) == 0; }
+	bool operator != ( const Key& k ) const { return compare(k) != 0; }
+	bool operator < ( const Key& k ) const { return compare(k) < 0; }
+	bool operator <= ( const Key& k ) const { return compare(k) <= 0; }
+	bool operator > ( const Key& k ) const { return compare(k) > 0; }
+	bool operator >= ( const Key& k ) const { return compare(k) >= 0; }
+    };
+
+    std::ostream& operator << ( std::ostream& os, const Key& k );
+
+    //
+    // a fence is one end of the range of keys a node covers.  the nodes
+    // at the left and right ends of each level are unbounded on that side.
+    //
+    class Fence {
+    public:
+	Key	_key;
+	bool	_bounded;
+
+	Fence() : _bounded(false) {}
+	Fence( const Key& key ) : _key(key), _bounded(true) {}
+    };
+
+    //
+    // KeyFormat is the type of the keys of a tree, and how long they can
+    // be.  nodes keep their keys in slots of a fixed width: integers as
+    // native ints or int64s, so that searching a node compares machine
+    // words just as it did before there were other key types, and byte
+    // strings as a length byte followed by the bytes.  a node of byte
+    // strings leaves out the prefix all its keys share, so its slots
+    // are only as wide as the rest of a key can be.
+    //
+    // a node of integers whose range is narrow enough keeps each key as
+    // its offset from the low end of the range, in slots of 1, 2 or 4
+    // bytes: the high bytes of the offset, which are 0, are its prefix.
+    // dense keys, such as ids handed out in order, then take a byte or
+    // two each, and are searched in the narrow slots without widening
+    // them.
+    //
+    class KeyFormat {
+    protected:
+	KEYTYPE	_type;
+	int	_len;
+
+    public:
+	// len is only needed for byte strings
+	KeyFormat( KEYTYPE kt = ktInt, int len = 0 );
+
+	KEYTYPE getType() const { return _type; }
+	int getLength() const { return _len; }
+
+	// a byte string slot is its length in one byte, then the bytes
+	// after the prefix, and is rounded up to a whole int so the columns
+	// after it stay aligned.  an integer slot is what is left of the key.
+	int getWidth( int prefixLen = 0 ) const {
+	    if( _type == ktBytes )
+		return (1 + _len - prefixLen + sizeof(int)-1) & ~(sizeof(int)-1);
+	    return _len - prefixLen;
+	}
+
+	bool isValid() const;
+	bool fits( const Key& k ) const;
+
+	// the width of a slot holding a fence: a length byte and a whole
+	// key, rounded up as a byte string slot is
+	int getFenceWidth() const { return (1 + _len + sizeof(int)-1) & ~(sizeof(int)-1); }
+
+	// whether a node can leave out a prefix of this many bytes from
+	// its keys.  the offsets of integers are only cut to slots of 1, 2,
+	// 4 or 8 bytes.
+	bool allowsPrefix( int prefixLen ) const;
+
+	// the length of the prefix every key from lo up to hi starts with,
+	// which a node between the two fences leaves out of its keys: the
+	// bytes the fences share for a byte string, or the high bytes of an
+	// integer's offset from lo that are 0 for every key up to hi.  a
+	// node whose fences are equal holds only keys equal to them, when a
+	// run of equal keys is split, and keeps as long a prefix as any,
+	// so a node's prefix never gets shorter when its range narrows.
+	int getPrefixLength( const Fence& lo, const Fence& hi ) const;
+
+	// the key a node whose last key is a and the node after it, whose
+	// first key is b, are separated by in their parent: the shortest
+	// key s with a < s <= b.  integers all have one length, so their
+	// separator is b.
+	Key getSeparator( const Key& a, const Key& b ) const;
+    };
     
     
+    //
+    // the tree makes a Node or a FragmentBlock, and a reference count for
+    // it, for every block it visits.  Slab hands out the memory for them
+    // in chunks of a few fixed sizes, and each thread keeps the chunks it
+    // frees on lists of its own, to reuse for the next chunks of the same
+    // size it needs.  so in steady state, visiting a block neither calls
+    // the heap nor takes a lock shared with other threads.  a chunk can be
+    // freed by a thread other than the one that allocated it.
+    //
+
+    static const int SLAB_GRAIN = 16;		// chunk sizes are multiples of this
+    static const int SLAB_CLASSES = 16;		// larger sizes come straight from the heap
+    static const int SLAB_CACHED = 256;		// free chunks a thread keeps of each size
+
+    class Slab {
+    public:
+	static void* allocate( size_t size ) throw(std::bad_alloc);
+	static void release( void* p, size_t size );
+    };
+
+    // a standard allocator over Slab, for boost::allocate_shared
+    template<class T>
+    class SlabAllocator {
+    public:
+	typedef T		value_type;
+	typedef T*		pointer;
+	typedef const T*	const_pointer;
+	typedef T&		reference;
+	typedef const T&	const_reference;
+	typedef size_t		size_type;
+	typedef ptrdiff_t	difference_type;
+
+	template<class U> struct rebind { typedef SlabAllocator<U> other; };
+
+	SlabAllocator() {}
+	template<class U> SlabAllocator( const SlabAllocator<U>& ) {}
+
+	pointer address( reference r ) const { return &r; }
+	const_pointer address( const_reference r ) const { return &r; }
+	size_type max_size() const { return size_t(-1) / sizeof(T); }
+
+	pointer allocate( size_type n, const void* = 0 ) { return static_cast<pointer>( Slab::allocate( n * sizeof(T) ) ); }
+	void deallocate( pointer p, size_type n ) { Slab::release( p, n * sizeof(T) ); }
+
+	void construct( pointer p, const T& t ) { new(p) T(t); }
+	void destroy( pointer p ) { p->~T(); }
+
+	bool operator == ( const SlabAllocator& ) const { return true; }
+	bool operator != ( const SlabAllocator& ) const { return false; }
+    };
+
+
+    class BlockStore;
+    
     enum NODETYPE {
 	ntInternalNode,
 	ntLeafNode
     };
 
+    // how a node is latched by the thread using it
+    enum LATCHMODE {
+	lmNone,
+	lmShared,
+	lmExclusive
+    };
+
     enum ENTRYTYPE {
-	etComplete,
-	etOverflow
+	etComplete,	// the data is in the entry
+	etOverflow,	// the data continues in a chain of fragment clusters
+	etExtent	// the data is in a run of whole blocks
     };
     
+    //
+    // the tree is a B+tree: every entry lives in a leaf, and internal
+    // nodes hold only the separator keys and child pointers needed to
+    // route a search, so their fanout is as high as the block allows.
+    // the subtree at child i of an internal node holds the keys k with
+    // key[i-1] <= k < key[i].
+    //
+    // the capacity of a node depends on the block size of its file, so the
+    // entries (or keys and children) of a node follow the fixed node header
+    // in the block rather than being declared in it.  each node records its
+    // capacity in _max, so a node can be used without knowing the
+    // geometry of the file it came from.
+    //
+    // a node also keeps its fences, the keys its range starts at and
+    // ends before.  every byte string key in the node, and every one that
+    // can be put in it, starts with the bytes the two fences have in
+    // common, so that prefix is stored once, in the low fence, and left
+    // out of the key slots.  an integer key is stored as its offset from
+    // the low fence, without the high bytes the fences leave 0.  the
+    // capacity of a node grows with its prefix.
+    //
     class Node {
     public:
 	class Data {
@@ -66,39 +357,71 @@ namespace bt {
 	    
 	    NODETYPE	_type;
 	    int		_n;
+	    int		_max;
+
+	    // the capacity the node would have with no prefix
+	    int		_base;
+
+	    // the format of the keys, which are a column of _keyWidth byte
+	    // slots holding all but the first _prefixLen bytes of each key.
+	    // see KeyFormat.
+	    KEYTYPE	_keyType;
+	    int		_keyLen;
+	    int		_prefixLen;
+	    int		_keyWidth;
+
+	    // the fences are two slots as wide as a whole key, after the
+	    // header of the node.  the prefix is the start of the low fence.
+	    // the offsets of integers are from the whole low fence.
+	    int getFenceWidth() const { return getKeyFormat().getFenceWidth(); }
+	    int getFenceSize() const { return 2*getFenceWidth(); }
+
+	    // the bytes at the start of the low fence that the key slots are
+	    // stored relative to.  two nodes whose low fences agree in them
+	    // store a key the same way.
+	    int getFrameLength() const { return _keyType == ktBytes || _prefixLen == 0 ? _prefixLen : _keyLen; }
+	    Fence loadFence( const char* slot ) const ;
+	    void storeFence( char* slot, const Fence& f ) const ;
+	    Key loadKey( const char* prefix, const char* slot ) const ;
+	    void storeKey( const char* prefix, char* slot, const Key& k ) const ;
 	    
 	public:
 	    Data();
-	    Data( BLOCKNO bn );
+	    Data( BLOCKNO bn, int max, const KeyFormat& kf );
 
 	    int getMagic() const { return _magic; }
 	    BLOCKNO getBlockNumber() const { return _blockno; }
 	    NODETYPE getType() const { return _type; }
 	    int getKeyCount() const { return _n; }
 	    void setKeyCount( int n ) { _n = n; }
+	    int getMaxKeyCount() const { return _max; }
+	    int getBaseKeyCount() const { return _base; }
+	    int getPrefixLength() const { return _prefixLen; }
+	    KeyFormat getKeyFormat() const { return KeyFormat( _keyType, _keyLen ); }
+	    bool hasKeyFormat( const KeyFormat& kf ) const {
+		return _keyType == kf.getType() && _keyLen == kf.getLength()
+		    && kf.allowsPrefix( _prefixLen ) && _keyWidth == kf.getWidth( _prefixLen );
+	    }
 
-	    void* operator new( unsigned int len );
-	    void* operator new( unsigned int len, char* buf );
-
-	    void operator delete( void* );
-	    void operator delete( void*, char* buf );
+	    // the bytes the fences take up after the header of a node
+	    static int getFenceSize( const KeyFormat& kf ) { return 2*kf.getFenceWidth(); }
 	};
 
 	
 	class Entry {
 	public:
-	    int		_key;
+	    Key		_key;
 	    ENTRYTYPE	_et;
 	    int		_len;
 	    char	_data[NODE_DATA_LEN];
 
 	    Entry();
 	    Entry( const Entry& e );
-	    Entry( int key, ENTRYTYPE et, const char* data, int len );
+	    Entry( const Key& key, ENTRYTYPE et, const char* data, int len );
 
 	    Entry& operator = ( const Entry& e );
 	    
-	    void set( int key, ENTRYTYPE et, const char* data, int len );
+	    void set( const Key& key, ENTRYTYPE et, const char* data, int len );
 	};
 
 	class OverflowEntryData {
@@ -107,144 +430,333 @@ namespace bt {
 	    FRAGNO	_frag;
 	    char	_data[OVERFLOW_ENTRY_DATA_LEN];
 	};
+
+	class ExtentEntryData {
+	public:
+	    BLOCKNO	_block;
+	    int		_blocks;
+	};
 	
     protected:
-	boost::shared_ptr<Data>	_data;
+	Data*			_data;
+	BlockStore*		_store;
+	BLOCKNO			_pinned;
+	os::RWLock*		_latch;
+	LATCHMODE		_latchMode;
+	bool			_changed;
+
+	Node( const Node& );
+	Node& operator = ( const Node& );
 	
     public:
-	Node();
+	// the node takes over the pin on block bn, which pData is in, and
+	// unpins it when it is destroyed
+	Node( BlockStore* store, BLOCKNO bn, Data* pData );
+	virtual ~Node();
 
 	BLOCKNO getBlockNumber() const { return _data->getBlockNumber(); }
+
+	// the latch is the block's, from the block store.  a node holds it
+	// in at most one mode at a time, and lets go of it when the node
+	// is destroyed, before the block is unpinned.
+	void setLatch( os::RWLock* latch ) { _latch = latch; }
+	void latch( LATCHMODE lm ) ;
+	bool tryLatch( LATCHMODE lm ) ;
+	void unlatch() ;
+	LATCHMODE getLatchMode() const { return _latchMode; }
+
+	// set by write(), so a writer knows which nodes it must keep latched
+	// until its changes are committed
+	bool isChanged() const { return _changed; }
+
+	// check the block in buf for a search that has not latched it, and
+	// so may find it half changed.  true if it holds node bn, laid out
+	// for blocks of this size and keys of format kf, with its type, key
+	// count and prefix length in nt, n and plen, which are safe to index
+	// the node with.
+	static bool peekHeader( const char* buf, BLOCKNO bn, int blockSize, const KeyFormat& kf, NODETYPE& nt, int& n, int& plen ) ;
 	
 	NODETYPE getNodeType() const { return _data->getType() ; }
 	virtual std::string getNodeTypeName() const = 0;
 	    
-	virtual void write( os::File f ) throw(os::IoException) ;
+	void write( BlockStore& store ) ;
 	    
 	bool isLeaf() { return _data->getType() == ntLeafNode; }
-	
-	virtual BLOCKNO getChild( int n ) = 0;
+
+	// these are not virtual.  they look at the type recorded in the
+	// block, and call the InternalNode or LeafNode function of the same
+	// name, which is inline, so code that knows which kind of node it
+	// has compiles to plain accesses to the block.
+	inline BLOCKNO getChild( int n ) ;
 	void setChild( int n, boost::shared_ptr<Node> c ) ;
-	virtual void setChild( int n, BLOCKNO c ) = 0;
+	inline void setChild( int n, BLOCKNO c ) ;
 	
-	virtual void setEntry( int n, const Entry& e ) = 0;
-	virtual const Entry& getEntry( int n ) = 0;
+	inline Key getKey( int n ) ;
+
+	// the range of keys the node covers.  a node of byte string keys
+	// leaves out the prefix its fences share, and one of integer keys
+	// stores them as offsets from its low fence, when its range is
+	// narrow enough.  setting the fences stores the keys again under the
+	// new prefix if it changes, which changes the node's capacity: the
+	// node's keys must still fit, and must all be in the new range.
+	Fence getLowFence() ;
+	Fence getHighFence() ;
+	void setFences( const Fence& lo, const Fence& hi, int blockSize ) ;
 
-	virtual bool isFull() = 0;
+	bool isFull() { return getKeyCount() == getMaxKeyCount(); }
 	
 	int getKeyCount() { return _data->getKeyCount(); }
-	virtual void setKeyCount( int n ) ;
+	void setKeyCount( int n ) {
+	    assert( n >= 0 && n <= getMaxKeyCount() );
+	    _data->setKeyCount( n );
+	}
+
+	//
+	// CLR defines a btree node as having degree t, maximum key count
+	// of 2t-1 and maximum child count for an internal node as 2t.
+	//
+	// additionally, the minimum count of keys in any node is
+	// t-1 and the minimum count of children in an internal node is t.
+	//
+	// if we let m be the maximum count of keys in a node, then the
+	// minimum count of keys, t-1 above is computed as:
+	//
+	//   2t - 1 = m
+	//
+	//       2t = m + 1
+	//
+	//        t = (m + 1) / 2
+	//
+	// :. t - 1 = ((m + 1) / 2 ) - 1
+	//
+	// m is the capacity of the node without a prefix, which is the
+	// least any node of the tree has.  so two nodes that are merged fit
+	// in one whatever prefix it has, and so does a node that takes a key
+	// from a sibling and loses some of its prefix.
+	//
+	int getMaxKeyCount() { return _data->getMaxKeyCount(); }
+	int getMinKeyCount() { return ((_data->getBaseKeyCount()+1)/2)-1; }
 
-	virtual void merge( const Node::Entry& e, boost::shared_ptr<Node> z ) = 0;
+	// append the contents of z, the right sibling of this node.  key is
+	// the separator between the two nodes in their parent.
+	void merge( const Key& key, boost::shared_ptr<Node> z ) ;
     };
 
     std::ostream& operator << ( std::ostream& os, const Node& n );
 
-    static const int INTERNAL_ENTRIES = (BLOCK_SIZE - sizeof(Node::Data) - sizeof(BLOCKNO)) / (sizeof(Node::Entry) + sizeof(BLOCKNO));
-    static const int INTERNAL_NODE_PADDING = BLOCK_SIZE - sizeof(Node::Data) - (sizeof(Node::Entry) * INTERNAL_ENTRIES) - (sizeof(BLOCKNO) * (INTERNAL_ENTRIES+1));
-    
     class InternalNode : public Node {
     protected:
+	// the block holds the fences, then _max+1 children, then _max keys
 	class Data : public Node::Data {
 	protected:
-	    Entry		_entries[ INTERNAL_ENTRIES ];
-	    BLOCKNO		_children[ INTERNAL_ENTRIES + 1 ];
-	    char		_padding[INTERNAL_NODE_PADDING];
+	    char* fences() { return reinterpret_cast<char*>( this + 1 ); }
+	    const char* prefix() { return fences() + 1; }
+	    BLOCKNO* children() { return reinterpret_cast<BLOCKNO*>( fences() + getFenceSize() ); }
+	    char* keys() { return reinterpret_cast<char*>( children() + (_max+1) ); }
 	    
 	public:
-	    Data( BLOCKNO bn );
+	    Data( BLOCKNO bn, int max, const KeyFormat& kf );
 
-	    void setChild( int n, BLOCKNO c ) { _children[n] = c; }
-	    BLOCKNO getChild( int n ) { return _children[n]; }
-	    void setEntry( int n, const Entry& e ) { _entries[n] = e; }
-	    const Entry& getEntry( int n ) { return _entries[n]; }
-	    std::pair<Entry,BLOCKNO> removeEntryAndRightChild( int n ) ;
+	    void setChild( int n, BLOCKNO c ) { children()[n] = c; }
+	    BLOCKNO getChild( int n ) { return children()[n]; }
+	    void setKey( int n, const Key& k ) { storeKey( prefix(), keys() + n*_keyWidth, k ); }
+	    Key getKey( int n ) { return loadKey( prefix(), keys() + n*_keyWidth ); }
+	    Fence getFence( int i ) { return loadFence( fences() + i*getFenceWidth() ); }
+	    void setFences( const Fence& lo, const Fence& hi, int blockSize ) ;
+	    int findChild( const Key& k ) ;
+	    int findLastChild( const Key& k ) ;
+	    static BLOCKNO peekChild( const char* buf, const KeyFormat& kf, int max, int plen, int n, const Key& k ) ;
+	    std::pair<Key,BLOCKNO> removeKeyAndRightChild( int n ) ;
+	    std::pair<Key,BLOCKNO> removeKeyAndLeftChild( int n ) ;
+	    void insertKeyAndLeftChild( int n, const Key& k, BLOCKNO c ) ;
+	    void insertKeyAndRightChild( int n, const Key& k, BLOCKNO c ) ;
+	    void copyTo( int from, int count, Data& to, int at ) ;
 	};
 
-	Data* getData() { return static_cast<Data*>( _data.get() ); }
+	Data* getData() { return static_cast<Data*>( _data ); }
 	
     public:
-	InternalNode( BLOCKNO bn );
-	InternalNode( BLOCKNO bn, boost::shared_ptr<Node::Data> pData );
+	InternalNode( BlockStore* store, BLOCKNO bn, Node::Data* pData );
+
+	static int getCapacity( int blockSize, const KeyFormat& kf = KeyFormat(), int prefixLen = 0 );
+	static Node::Data* format( char* buf, BLOCKNO bn, int blockSize, const KeyFormat& kf = KeyFormat() );
 
 	virtual std::string getNodeTypeName() const ;
 	
-	virtual BLOCKNO getChild( int n ) ;
-	void setChild( int n, boost::shared_ptr<Node> c ) ;
-	virtual void setChild( int n, BLOCKNO c ) ;
+	BLOCKNO getChild( int n ) {
+	    assert( n >= 0 && n < getMaxKeyCount() + 1 );
+	    return getData()->getChild(n);
+	}
+	void setChild( int n, boost::shared_ptr<Node> c ) { setChild( n, c->getBlockNumber() ); }
+	void setChild( int n, BLOCKNO c ) {
+	    assert( n >= 0 && n < getMaxKeyCount() + 1 );
+	    getData()->setChild(n,c);
+	}
 	
-	virtual void setEntry( int n, const Entry& e ) ;
-	virtual const Entry& getEntry( int n ) ;
-	std::pair<Entry,BLOCKNO> removeEntryAndRightChild( int n ) ;
+	void setKey( int n, const Key& k ) {
+	    assert( n >= 0 && n < getMaxKeyCount() );
+	    getData()->setKey(n,k);
+	}
+	Key getKey( int n ) {
+	    assert( n >= 0 && n < getMaxKeyCount() );
+	    return getData()->getKey(n);
+	}
+	std::pair<Key,BLOCKNO> removeKeyAndRightChild( int n ) ;
+	std::pair<Key,BLOCKNO> removeKeyAndLeftChild( int n ) ;
+	void insertKeyAndLeftChild( int n, const Key& k, BLOCKNO c ) ;
+	void insertKeyAndRightChild( int n, const Key& k, BLOCKNO c ) ;
 
-	virtual bool isFull() ;
-	virtual void setKeyCount( int n ) ;
-	virtual void merge( const Node::Entry& e, boost::shared_ptr<Node> z ) ;
+	// copy count keys from index from, and the count+1 children from the
+	// same index, into node to at index at.  neither key count changes.
+	void copyTo( int from, int count, InternalNode& to, int at ) ;
+
+	// index of the first and the last child whose subtree covers key k.
+	// entries with a key equal to a separator can be on both sides of
+	// it, when a run of them was split, so the first entry with key k is
+	// under the first child, or if that has none, at the start of the
+	// next leaf.  a new entry goes under the last child, after the
+	// entries with an equal key.
+	int findChild( const Key& k ) { return getData()->findChild(k); }
+	int findLastChild( const Key& k ) { return getData()->findLastChild(k); }
+
+	Fence getLowFence() { return getData()->getFence(0); }
+	Fence getHighFence() { return getData()->getFence(1); }
+	void setFences( const Fence& lo, const Fence& hi, int blockSize ) { getData()->setFences( lo, hi, blockSize ); }
+
+	// the child covering k of the unlatched node in buf, which has n
+	// keys and a prefix of plen bytes.  see Node::peekHeader.
+	static BLOCKNO peekChild( const char* buf, int blockSize, const KeyFormat& kf, int plen, int n, const Key& k ) {
+	    return Data::peekChild( buf, kf, getCapacity(blockSize,kf,plen), plen, n, k );
+	}
+
+	void merge( const Key& key, boost::shared_ptr<Node> z ) ;
     };
 
-    static const int LEAF_ENTRIES = (BLOCK_SIZE - sizeof(Node::Data)) / sizeof(Node::Entry);
-    static const int LEAF_NODE_PADDING = BLOCK_SIZE - sizeof(Node::Data) - (sizeof(Node::Entry) * LEAF_ENTRIES) ;
-    
+    //
+    // the leaves are linked to their left and right siblings, so a range
+    // scan can move from leaf to leaf without going back through the
+    // internal nodes.
+    //
     class LeafNode : public Node {
     protected:
+	// the entries are stored column-wise, so a search only touches the
+	// keys: after the fences, the block holds _max key slots, padded to
+	// a whole int, then the type and length of each entry, then the
+	// NODE_DATA_LEN bytes of data of each entry.
 	class Data : public Node::Data {
 	protected:
-	    Entry		_entries[LEAF_ENTRIES];
-	    char		_padding[LEAF_NODE_PADDING];
+	    struct EntryInfo {
+		ENTRYTYPE	_et;
+		int		_len;
+	    };
+
+	    BLOCKNO	_prev;
+	    BLOCKNO	_next;
+
+	    char* fences() { return reinterpret_cast<char*>( this + 1 ); }
+	    const char* prefix() { return fences() + 1; }
+	    char* keys() { return fences() + getFenceSize(); }
+	    EntryInfo* infos() { return reinterpret_cast<EntryInfo*>( keys() + getKeyColumnSize( _max, _keyWidth ) ); }
+	    char* payloads() { return reinterpret_cast<char*>( infos() + _max ); }
+
+	    void moveEntries( int to, int from, int count ) ;
 	    
 	public:
-	    Data( BLOCKNO bn );
-	    void setEntry( int n, const Entry& e ) { _entries[n] = e; }
-	    const Entry& getEntry( int n ) { return _entries[n]; }
+	    Data( BLOCKNO bn, int max, const KeyFormat& kf );
+
+	    // the bytes one entry takes up across the three columns, and the
+	    // bytes max key slots of the given width take up
+	    static int getEntrySize( const KeyFormat& kf, int prefixLen ) { return kf.getWidth(prefixLen) + sizeof(EntryInfo) + NODE_DATA_LEN; }
+	    static int getKeyColumnSize( int max, int width ) { return (max*width + sizeof(int)-1) & ~(sizeof(int)-1); }
+
+	    void setEntry( int n, const Entry& e ) ;
+	    Entry getEntry( int n ) ;
+	    Key getKey( int n ) { return loadKey( prefix(), keys() + n*_keyWidth ); }
+	    Fence getFence( int i ) { return loadFence( fences() + i*getFenceWidth() ); }
+	    void setFences( const Fence& lo, const Fence& hi, int blockSize ) ;
+	    ENTRYTYPE getEntryType( int n ) { return infos()[n]._et; }
+	    int getLength( int n ) { return infos()[n]._len; }
+	    const char* getEntryData( int n ) { return payloads() + n*NODE_DATA_LEN; }
+	    void insertEntry( int n, const Entry& e ) ;
 	    Entry removeEntry( int n ) ;
+	    void copyTo( int from, int count, Data& to, int at ) ;
+	    int lowerBound( const Key& k ) ;
+	    int upperBound( const Key& k ) ;
+	    static bool peekEntry( const char* buf, const KeyFormat& kf, int max, int plen, int n, const Key& k, Entry& e, BLOCKNO& next ) ;
+
+	    BLOCKNO getPrev() const { return _prev; }
+	    void setPrev( BLOCKNO bn ) { _prev = bn; }
+	    BLOCKNO getNext() const { return _next; }
+	    void setNext( BLOCKNO bn ) { _next = bn; }
 	};
 	
-	Data* getData() { return static_cast<Data*>( _data.get() ); }
+	Data* getData() { return static_cast<Data*>( _data ); }
 	
     public:
-	LeafNode( BLOCKNO bn );
-	LeafNode( BLOCKNO bn, boost::shared_ptr<Node::Data> pData );
+	LeafNode( BlockStore* store, BLOCKNO bn, Node::Data* pData );
+
+	static int getCapacity( int blockSize, const KeyFormat& kf = KeyFormat(), int prefixLen = 0 );
+	static Node::Data* format( char* buf, BLOCKNO bn, int blockSize, const KeyFormat& kf = KeyFormat() );
 
 	virtual std::string getNodeTypeName() const ;
 	
-	virtual BLOCKNO getChild( int n ) ;
-	void setChild( int n, boost::shared_ptr<Node> c ) ;
-	virtual void setChild( int n, BLOCKNO c ) ;
-	
-	virtual void setEntry( int n, const Entry& e ) ;
-	virtual const Entry& getEntry( int n ) ;
+	void setEntry( int n, const Entry& e ) ;
+	Entry getEntry( int n ) ;
+	Key getKey( int n ) {
+	    assert( n >= 0 && n < getMaxKeyCount() );
+	    return getData()->getKey(n);
+	}
+	ENTRYTYPE getEntryType( int n ) ;
+	int getLength( int n ) ;
+	const char* getEntryData( int n ) ;
+	void insertEntry( int n, const Entry& e ) ;
 	Entry removeEntry( int n ) ;
+
+	// copy count entries from index from into leaf to at index at.
+	// neither key count changes.
+	void copyTo( int from, int count, LeafNode& to, int at ) ;
+
+	// index of the first entry with a key >= k, or > k
+	int lowerBound( const Key& k ) { return getData()->lowerBound(k); }
+	int upperBound( const Key& k ) { return getData()->upperBound(k); }
+
+	Fence getLowFence() { return getData()->getFence(0); }
+	Fence getHighFence() { return getData()->getFence(1); }
+	void setFences( const Fence& lo, const Fence& hi, int blockSize ) { getData()->setFences( lo, hi, blockSize ); }
+
+	// copy the first entry with key k of the unlatched leaf in buf,
+	// which has n entries and a prefix of plen bytes, to e.  if it is not
+	// there, next is the leaf it may start instead, when k is the leaf's
+	// high fence, or else INVALID_BLOCK_NUMBER.  see Node::peekHeader.
+	static bool peekEntry( const char* buf, int blockSize, const KeyFormat& kf, int plen, int n, const Key& k, Entry& e, BLOCKNO& next ) {
+	    return Data::peekEntry( buf, kf, getCapacity(blockSize,kf,plen), plen, n, k, e, next );
+	}
+
+	BLOCKNO getPrev() { return getData()->getPrev(); }
+	void setPrev( BLOCKNO bn ) { getData()->setPrev(bn); }
+	BLOCKNO getNext() { return getData()->getNext(); }
+	void setNext( BLOCKNO bn ) { getData()->setNext(bn); }
 	
-	virtual bool isFull() ;
-	virtual void setKeyCount( int n ) ;
-	virtual void merge( const Node::Entry& e, boost::shared_ptr<Node> z ) ;
+	void merge( const Key& key, boost::shared_ptr<Node> z ) ;
     };
 
+    BLOCKNO Node::getChild( int n ) {
+	assert( !isLeaf() );
+	return static_cast<InternalNode*>( this )->getChild( n );
+    }
+
+    void Node::setChild( int n, BLOCKNO c ) {
+	assert( !isLeaf() );
+	static_cast<InternalNode*>( this )->setChild( n, c );
+    }
+
+    Key Node::getKey( int n ) {
+	if( isLeaf() )
+	    return static_cast<LeafNode*>( this )->getKey( n );
+	return static_cast<InternalNode*>( this )->getKey( n );
+    }
 
-    //
-    // compute minimum number of entries in nodes
-    //  CLR defines a btree node as having degree t, maximum key count 
-    //  of 2t-1 and maximum child count for an internal node as 2t.
-    //
-    //  additionally, the minimum count of keys in any node is
-    //  t-1 and the minimum count of children in an internal node is t.
-    //
-    // if we let m be the maximum count of keys in a node, then the
-    //  minimum count of keys, t-1 above is computed as:
-    //
-    //   2t - 1 = m
-    //
-    //       2t = m + 1
-    //
-    //        t = (m + 1) / 2
-    //
-    // :. t - 1 = ((m + 1) / 2 ) - 1
-    //
 
-    static const int MIN_LEAF_ENTRIES     = ((LEAF_ENTRIES+1)/2)-1;
-    static const int MIN_INTERNAL_ENTRIES = ((INTERNAL_ENTRIES+1)/2)-1;
-    
-    
     class OverflowDataHeader {
     public:
 	int     _len;
@@ -253,8 +765,34 @@ namespace bt {
     };
 
 
-    static const int FRAGMENT_HEADER_PADDING = FRAG_SIZE - sizeof(long) - (2*sizeof(BLOCKNO)) - (MAX_FRAGS_PER_BLOCK*sizeof(bool));
+    //
+    // a block on the free block chain.  only the start of the block is
+    // used, to link it to the next free block.
+    //
+    struct FreeBlock {
+	long	_magic;
+	BLOCKNO	_blockno;
+	BLOCKNO	_next_block;
+    };
+
+    //
+    // the first block of a free extent, a run of blocks that held a value
+    // too large for fragments.  the rest of the run is not used.
+    //
+    struct FreeExtent {
+	long	_magic;
+	BLOCKNO	_blockno;
+	BLOCKNO	_next_block;
+	int	_blocks;
+    };
+
 
+    //
+    // a fragment block is divided into FRAG_SIZE fragments.  the first few
+    // hold the block header, which is followed by a bitmap of which of
+    // the _frags data fragments that make up the rest of the block are
+    // used, one bit per fragment.
+    //
     class FragmentBlock {
     public:
 	struct Fragment {
@@ -271,65 +809,439 @@ namespace bt {
 	    long	_magic;
 	    BLOCKNO	_blockno;
 	    BLOCKNO	_next_block;
-	    bool	_used[MAX_FRAGS_PER_BLOCK];
-	    char	_padding[FRAGMENT_HEADER_PADDING];
-	    Fragment	_frag[MAX_FRAGS_PER_BLOCK];
+	    int		_frags;
+
+	    unsigned int* usedMap() { return reinterpret_cast<unsigned int*>( this + 1 ); }
+	    Fragment* frags() { return reinterpret_cast<Fragment*>( this ) + getHeaderFragments( _frags ); }
 
 	public:
 	    Data();
-	    Data( BLOCKNO bn );
-	    
-	    void* operator new( unsigned int len );
-	    void* operator new( unsigned int len, char* buf );
-
-	    void operator delete( void* );
-	    void operator delete( void*, char* buf );
+	    Data( BLOCKNO bn, int frags );
 	    
 	    int getMagic() const { return _magic; }
 	    BLOCKNO getBlockNumber() const { return _blockno; }
+	    int getFragmentCount() const { return _frags; }
 
 	    BLOCKNO getNextBlock() const { return _next_block; }
 	    void setNextBlock(BLOCKNO bn) { _next_block = bn; }
 	
 	    Fragment& getFragment( int n ) {
-		assert( n >= 0 && n < MAX_FRAGS_PER_BLOCK );
-		return _frag[n];
+		assert( n >= 0 && n < _frags );
+		return frags()[n];
 	    }
 
 	    FRAGNO reserveFragments( int count );
+	    void releaseFragments( FRAGNO fn, int count );
 	    std::pair<FRAGNO,int> getMaxFragmentCluster();
 	};
 	
     protected:
-	boost::shared_ptr<Data>	_data;
+	Data*		_data;
+	BlockStore*	_store;
+	BLOCKNO		_pinned;
+
+	FragmentBlock( const FragmentBlock& );
+	FragmentBlock& operator = ( const FragmentBlock& );
 
     public:
-	FragmentBlock( BLOCKNO bn );
-	FragmentBlock( boost::shared_ptr<Data> pData );
+	// takes over the pin on the block, like a Node
+	FragmentBlock( BlockStore* store, BLOCKNO bn, Data* pData );
+	~FragmentBlock();
+
+	static int getHeaderFragments( int frags );
+	static int getCapacity( int blockSize );
+	static Data* format( char* buf, BLOCKNO bn, int blockSize );
+
 	Fragment& getFragment( int n ) {
 	    assert( _data );
 	    return _data->getFragment(n);
 	}
 	int getMagic() const { return _data->getMagic(); }
 	BLOCKNO getBlockNumber() const { return _data->getBlockNumber(); }
+	int getFragmentCount() const { return _data->getFragmentCount(); }
 
 	BLOCKNO getNextBlock() const { return _data->getNextBlock(); }
 	void setNextBlock(BLOCKNO bn) { _data->setNextBlock(bn); }
 
 	FRAGNO reserveFragments( int count );
+	void releaseFragments( FRAGNO fn, int count );
 	std::pair<FRAGNO,int> getMaxFragmentCluster();
 	FRAGNO getMaxFragmentClusterStart();
 	int getMaxFragmentClusterLength();
 	
-	void write( os::File file ) throw(os::IoException);
+	void write( BlockStore& store );
     };
 
     std::ostream& operator << ( std::ostream& os, const FragmentBlock& n );
 
     
-    static const int HEADER_PADDING_LEN = BLOCK_SIZE - sizeof(long) - ((3+MAX_FRAGS_PER_BLOCK)*sizeof(BLOCKNO));
 
+    //
+    // Log is the redo log kept next to a btree file, in the same file name
+    // with LOG_SUFFIX appended.  Each operation appends the new contents of
+    // every part of the file it changed as one group of records, ending
+    // with a commit record, and the operation is durable once the log has
+    // been forced to the end of that group.  The tree file itself is only
+    // brought up to date at a checkpoint, so an operation costs one
+    // sequential write and one sync of the log however many blocks it
+    // changed.
+    //
+    // Forcing the log is a group commit.  The first thread to ask becomes
+    // the leader and syncs everything written so far; threads that commit
+    // while it waits on the disk are covered by the next sync, which one
+    // of them leads.  However many threads are committing, there is at
+    // most one sync in progress and one waiting to start.
+    //
+    // The records written since a checkpoint all carry the epoch in the
+    // start record at the head of the log.  Recovery replays every group
+    // up to the last complete commit record, and stops at the first record
+    // that is torn, fails its checksum, or belongs to an earlier epoch.
+    //
+
+    static const char LOG_SUFFIX[] = ".wal";
+    static const int LOG_CHECKPOINT_SIZE = 4*1024*1024;
+
+    class Log {
+    public:
+	typedef os::File::POS LSN;
+
+    protected:
+	enum RECORDTYPE {
+	    lrStart,	// the first record in the log
+	    lrWrite,	// new contents for _len bytes of the tree file at _pos
+	    lrCommit	// the end of a group
+	};
+
+	struct Record {
+	    long		_magic;
+	    unsigned int	_epoch;
+	    RECORDTYPE		_type;
+	    os::File::POS	_pos;
+	    int			_len;
+	    unsigned int	_sum;
+	};
+
+	os::File		_file;
+	unsigned int		_epoch;
+	std::vector<char>	_group;		// the records of the group being built
+	LSN			_base;		// the LSN of the start of the file
+	LSN			_end;		// end of the records written to the file
+	LSN			_synced;	// end of the records known to be on disk
+	bool			_syncing;
+	os::Mutex		_mutex;
+	os::Condition		_synced_cond;
+
+	void addRecord( RECORDTYPE type, os::File::POS pos, const void* data, int len );
+	void start( unsigned int epoch ) throw(os::IoException);
+	static bool readRecord( os::File f, LSN at, LSN size, unsigned int epoch, Record& r, std::vector<char>& data ) throw(os::IoException);
+	static unsigned int checksum( const Record& r, const char* data );
+
+    public:
+	Log();
+
+	// create an empty log, or empty an existing one
+	void create( std::string fname ) throw(os::IoException);
+
+	// replay the committed groups in the log of the tree file fname, if
+	// it has one, and empty the log.  returns the number of groups
+	// replayed.  if replay is false, neither file is written, and the
+	// groups that would be replayed are only counted.
+	static int recover( std::string fname, bool replay = true ) throw(os::IoException);
+
+	// add new contents for part of the tree file to the current group
+	void append( os::File::POS pos, const void* data, int len );
+	bool isGroupEmpty() const { return _group.empty(); }
+
+	// write the current group to the log, and return the LSN that must
+	// be forced for it to be durable.  LSNs keep growing when the log is
+	// emptied, so an LSN from before a checkpoint is already forced.
+	LSN commit() throw(os::IoException);
+	void force( LSN lsn ) throw(os::IoException);
+	LSN getEnd() ;
+	LSN getSize() ;
+	bool isEmpty() { return getSize() == (LSN) sizeof(Record); }
+
+	// start a new epoch, once everything in the log is in the tree file
+	void reset() throw(os::IoException);
+    };
+
+
+    //
+    // BlockStore is the btree's access path to the blocks of its file.
+    //
+    // A block is pinned for as long as any Node or FragmentBlock refers to
+    // it: the wrapper takes over the pin when it is made, and unpins the
+    // block when the last shared_ptr to it goes.
+    // Writes only mark a block dirty; dirty blocks reach the file no later
+    // than the next flush().
+    //
+    // Any number of threads can pin and unpin blocks at once.  Each block
+    // has a latch that stays with it for as long as it is pinned, which
+    // the tree uses to keep threads from seeing a node half changed.  The
+    // store itself never takes a latch.
+    //
+    class BlockStore {
+    public:
+	struct Stats {
+	    unsigned long	_hits;
+	    unsigned long	_misses;
+	    unsigned long	_evictions;
+	    unsigned long	_writes;
+	};
+
+    protected:
+	Stats				_stats;
+	int				_blockSize;
+
+    public:
+	BlockStore();
+	virtual ~BlockStore();
+
+	// attach the store to a file made of blockSize byte blocks.  a store
+	// can only be attached once, before any block is pinned.
+	virtual void attach( os::File file, bool writable, int blockSize ) throw(os::IoException) = 0;
+
+	int getBlockSize() const { return _blockSize; }
+
+	// pin a block and return its buffer.  if read is false the block is
+	// being newly allocated, so the buffer is zero-filled rather than read
+	// from the file.  if latch is given, it is set to the block's latch.
+	virtual char* pin( BLOCKNO bn, bool read = true, os::RWLock** latch = NULL ) throw(os::IoException,BufferPoolExhaustedException) = 0;
+	virtual void unpin( BLOCKNO bn ) = 0;
+	virtual void markDirty( BLOCKNO bn ) = 0;
+
+	// find block bn in memory without pinning it, for a reader that
+	// checks the version of its latch before and after using the buffer.
+	// the block can be replaced at any time, which moves the version on.
+	// returns NULL if the block must be pinned instead.
+	virtual char* peek( BLOCKNO bn, os::RWLock** latch ) { return NULL; }
+
+	virtual void flush() throw(os::IoException) = 0;
+
+	// keep the file consistent with log.  a store that writes blocks in
+	// place cannot, and returns false.
+	virtual bool setLog( Log* log ) { return false; }
+
+	// append the blocks changed since the last call to the log's group
+	// and commit the group.  returns the LSN to force, or 0 if the group
+	// was empty and nothing was committed.
+	virtual Log::LSN commitChanges() throw(os::IoException) { return 0; }
+
+	const Stats& getStats() const { return _stats; }
+    };
+
+    std::ostream& operator << ( std::ostream& os, const BlockStore::Stats& s );
+
+    
+    //
+    // BufferPool keeps recently used blocks of the btree file in memory
+    // frames.  Dirty frames are written back when they are evicted or when
+    // the pool is flushed.
+    //
+    // Victims are chosen with the CLOCK algorithm.  Every hit sets a frame's
+    // reference bit, and the hand clears the bit instead of evicting on its
+    // first pass, so a frame must go unreferenced for a full revolution
+    // before it is replaced.  A one-time scan therefore cannot push out
+    // the upper levels of the tree that every operation touches.
+    //
+    // With a log, a changed block is not written to the file until its
+    // new contents are in the log and the log has been forced.  A frame
+    // changed by the operation in progress cannot be evicted at all, and
+    // if no other frame can be, the pool grows.
+    //
+    // A single mutex covers the frame table.  It is not held while a
+    // pinned frame is used, nor while a block is read in or written back:
+    // the frame is marked busy and its latch locked exclusive until the
+    // I/O is done, and a thread pinning that block waits on the latch.
+    // Readers that only peek at a block go through the slots, a table that
+    // maps each block number to the frame that last held a block in its
+    // slot, and that is read without the mutex.  A frame's latch is locked exclusive
+    // while the frame is given a new block, so a peeking reader sees its
+    // version move.
+    //
+
+    static const int DEFAULT_POOL_FRAMES = 1024;
+
+    class BufferPool : public BlockStore {
+    protected:
+	struct Frame {
+	    BLOCKNO	_blockno;
+	    char*	_buf;
+	    os::RWLock*	_latch;
+	    int		_pins;
+	    bool	_dirty;
+	    bool	_referenced;
+	    bool	_io;		// being read in or written back
+	};
+
+	os::Mutex			_mutex;
+	os::File			_file;
+	std::vector<Frame>		_frames;
+	std::map<BLOCKNO,int>		_map;
+	std::set<BLOCKNO>		_dirty;
+	std::set<BLOCKNO>		_unlogged;
+	Log*				_log;
+	int				_used;
+	int				_hand;
+
+	struct Slot {
+	    os::Version		_version;
+	    BLOCKNO		_blockno;
+	    char*		_buf;
+	    os::RWLock*		_latch;
+	};
+
+	boost::scoped_array<Slot>	_slots;
+	BLOCKNO				_slotMask;
+
+	Slot& getSlot( BLOCKNO bn ) { return _slots[bn & _slotMask]; }
+	void setSlot( Frame& f ) ;
+	int findVictim() throw(BufferPoolExhaustedException);
+	char* load( int i, BLOCKNO bn, bool read, os::RWLock** latch ) throw(os::IoException);
+	void writeBack( int i ) throw(os::IoException);
+	void waitForFrame( int i ) ;
+
+    public:
+	BufferPool( int frames = DEFAULT_POOL_FRAMES );
+	virtual ~BufferPool();
+
+	virtual void attach( os::File file, bool writable, int blockSize ) throw(os::IoException);
+
+	virtual char* pin( BLOCKNO bn, bool read = true, os::RWLock** latch = NULL ) throw(os::IoException,BufferPoolExhaustedException);
+	virtual void unpin( BLOCKNO bn );
+	virtual void markDirty( BLOCKNO bn );
+	virtual char* peek( BLOCKNO bn, os::RWLock** latch );
+
+	virtual void flush() throw(os::IoException);
+
+	virtual bool setLog( Log* log );
+	virtual Log::LSN commitChanges() throw(os::IoException);
+
+	int getFrameCount() const { return _frames.size(); }
+    };
+
+
+    //
+    // MappedStore maps the btree file into memory, so a pinned block is
+    // a pointer straight into the mapping and reading a block costs
+    // neither a copy nor a system call.
+    //
+    // The file is mapped in fixed size segments that stay mapped until the
+    // store is destroyed, so the mapping can grow along with the file
+    // without moving blocks that are already pinned.  Writable stores
+    // extend the file in MAP_GROW_SIZE steps as new blocks are allocated.
+    // flush() starts write-back of the dirty blocks with msync.
+    //
+    // The mapping has no frames to keep a latch in, so the latch of a
+    // block is made when it is first pinned and dropped when the last
+    // pin on it is released.
+    //
+
+    static const int MAP_SEGMENT_SIZE = 64*1024*1024;
+    static const int MAP_GROW_SIZE = 1024*1024;
+
+    class MappedStore : public BlockStore {
+    protected:
+	os::File			_file;
+	bool				_writable;
+	os::File::POS			_size;
+	std::vector<os::FileMapping>	_segments;
+	std::set<BLOCKNO>		_dirty;
+
+	struct Latch {
+	    os::RWLock*	_latch;
+	    int		_pins;
+	};
+
+	os::Mutex			_mutex;
+	std::map<BLOCKNO,Latch>		_latches;
+
+	char* getBlock( BLOCKNO bn ) throw(os::IoException);
+
+    public:
+	MappedStore();
+	virtual ~MappedStore();
+
+	virtual void attach( os::File file, bool writable, int blockSize ) throw(os::IoException);
+
+	virtual char* pin( BLOCKNO bn, bool read = true, os::RWLock** latch = NULL ) throw(os::IoException,BufferPoolExhaustedException);
+	virtual void unpin( BLOCKNO bn );
+	virtual void markDirty( BLOCKNO bn );
+
+	virtual void flush() throw(os::IoException);
+    };
+
+    
+    class BTree;
+
+    //
+    // a Cursor walks the entries of a tree in key order.  it keeps the
+    // leaf it is positioned on pinned and latched shared, and follows the
+    // sibling links to move between leaves.  other threads can modify the
+    // tree while a cursor is open, but not the leaf it is on, so the
+    // thread that owns a valid cursor must not use the tree any other way
+    // until the cursor is done with, or it could wait for itself.
+    //
+    class Cursor {
+    protected:
+	BTree&				_tree;
+	boost::shared_ptr<LeafNode>	_leaf;
+	int				_pos;
+
+	boost::shared_ptr<LeafNode> readLeaf( BLOCKNO bn, bool wait = true ) throw(os::IoException,FileCorruptedException);
+	void descend( const Key& key ) throw(os::IoException,FileCorruptedException);
+	bool skipForward() throw(os::IoException,FileCorruptedException);
+	bool skipBackward() throw(os::IoException,FileCorruptedException);
+
+    public:
+	Cursor( BTree& tree );
+
+	// each positioning method returns false, and leaves the cursor
+	// invalid, if there is no entry to position on.
+	bool first() throw(os::IoException,FileCorruptedException);
+	bool last() throw(os::IoException,FileCorruptedException);
+	bool seek( const Key& key ) throw(os::IoException,FileCorruptedException,KeyTypeException);	// first entry with a key >= key
+	bool next() throw(os::IoException,FileCorruptedException);
+
+	// if another thread holds the leaf to the left, prev() finds the
+	// previous entry from the root instead, as the last one with a
+	// smaller key.  entries with equal keys may be skipped then.
+	bool prev() throw(os::IoException,FileCorruptedException);
+
+	bool isValid() const { return _leaf.get() != NULL; }
+	Key getKey();
+	int getLength();
+	int getData( char* data ) throw(os::IoException,FileCorruptedException);
+    };
+
+    //
+    // callback for BTree::scan.  returning false ends the scan.  it is
+    // called with a leaf of the tree latched, so it must not use the tree.
+    //
+    class ScanCallback {
+    public:
+	virtual ~ScanCallback() {}
+	virtual bool operator () ( const Key& key, const char* data, int len ) = 0;
+    };
+
+    
+    enum STORAGEMODE {
+	smBuffered,	// blocks are read into a BufferPool
+	smMapped	// the file is memory mapped with a MappedStore
+    };
+    
     class BTree {
+	friend class Cursor;
+	friend class BulkLoader;
+
+    public:
+	// how often a search found a writer in its way: each time it had
+	// to start over, and each time it gave up and latched its way down
+	// instead
+	struct SearchStats {
+	    unsigned long	_retries;
+	    unsigned long	_fallbacks;
+	};
 	
     protected:
 	
@@ -341,6 +1253,18 @@ namespace bt {
 		long		_magic;
 		BLOCKNO		_blockno;
 
+		// the layout and geometry of the file.  the compiled-in
+		// sizes are recorded so a file is never opened by a build
+		// that lays out nodes or fragments differently.
+		int		_version;
+		int		_block_size;
+		int		_frag_size;
+		int		_node_data_len;
+
+		// the KeyFormat of the keys
+		int		_key_type;
+		int		_key_len;
+
 		// count of blocks allocated in the file
 		BLOCKNO		_blocks;
 
@@ -348,39 +1272,67 @@ namespace bt {
 		// are chained off of it.
 		BLOCKNO		_free_block;
 
-		// a list of chains that track fragment blocks with
-		// free fragments in them.
-		//   _frag_list[0] is unused
-		//   _frag_list[1] is the first block with 1 free fragment
+		// location of the first free extent.  additional free
+		// extents are chained off of it.
+		BLOCKNO		_free_extent;
+
+		// location of the root node
+		BLOCKNO		_root;
+
+		// the rest of the block is a list of chains that track
+		// fragment blocks with free fragments in them, one for each
+		// fragment a block of this size holds.
+		//   frag_list[0] is unused
+		//   frag_list[1] is the first block with 1 free fragment
 		//   ...
-		//   _frag_list[MAX_FRAGS_PER_BLOCK-1] is the first block with
-		//      (MAX_FRAGS_PER_BLOCK-1) free fragments
-		// no block can have MAX_FRAGS_PER_BLOCK free and still be a
+		//   frag_list[n-1] is the first block with (n-1) free fragments
+		// no block can have all n fragments free and still be a
 		// partially-full fragment block.  If it has no fragments allocated,
 		// then it is an entirely free block, and is put on the free
 		// block list
 		//
-		BLOCKNO		_frag_list[MAX_FRAGS_PER_BLOCK];
+		BLOCKNO* fragList() { return reinterpret_cast<BLOCKNO*>( this + 1 ); }
 
-		// pad the structure out to be a multiple of BLOCK_SIZE
-		char		_padding[HEADER_PADDING_LEN];
-
-		Data();
+		Data( int blockSize, const KeyFormat& kf );
 	    };
 
-	    boost::shared_ptr<Data>	_data;
+	    std::vector<char>	_block;
+	    int			_frags;
+	    KeyFormat		_keyFormat;
+
+	    // set by every change, so the header is written at most once
+	    // per flush, however many times an operation changes it
+	    bool		_dirty;
+
+	    Data* getData() { return reinterpret_cast<Data*>( &_block[0] ); }
+	    const Data* getData() const { return reinterpret_cast<const Data*>( &_block[0] ); }
 
 	public:
 	    Header();
+	    void format( int blockSize, const KeyFormat& kf ) throw(InvalidBlockSizeException,InvalidKeyFormatException);
+	    void read( os::File file ) throw(os::IoException,FileCorruptedException);
 	    void write( os::File file ) throw(os::IoException);
+	    void log( Log& log );
+	    bool isDirty() const { return _dirty; }
 	    BLOCKNO allocateBlockNumber();
-	    BLOCKNO getFragListHead( int n ) const {
-		assert( n > 0 && n < MAX_FRAGS_PER_BLOCK );
-		return _data->_frag_list[n];
+	    int getBlockSize() const { return getData()->_block_size; }
+	    int getFragsPerBlock() const { return _frags; }
+	    const KeyFormat& getKeyFormat() const { return _keyFormat; }
+	    BLOCKNO getBlockCount() const { return getData()->_blocks; }
+	    BLOCKNO getRoot() const { return getData()->_root; }
+	    void setRoot( BLOCKNO bn ) { getData()->_root = bn; _dirty = true; }
+	    BLOCKNO getFreeBlock() const { return getData()->_free_block; }
+	    void setFreeBlock( BLOCKNO bn ) { getData()->_free_block = bn; _dirty = true; }
+	    BLOCKNO getFreeExtent() const { return getData()->_free_extent; }
+	    void setFreeExtent( BLOCKNO bn ) { getData()->_free_extent = bn; _dirty = true; }
+	    BLOCKNO getFragListHead( int n ) {
+		assert( n > 0 && n < _frags );
+		return getData()->fragList()[n];
 	    }
-	    void setFragListHead( int n, BLOCKNO bn ) const {
-		assert( n > 0 && n < MAX_FRAGS_PER_BLOCK );
-		_data->_frag_list[n] = bn;
+	    void setFragListHead( int n, BLOCKNO bn ) {
+		assert( n > 0 && n < _frags );
+		getData()->fragList()[n] = bn;
+		_dirty = true;
 	    }
 	};
 
@@ -389,44 +1341,190 @@ namespace bt {
 	//
 	
 	os::File			_file;
-	boost::shared_ptr<Node>		_root;
+	bool				_readOnly;
+	boost::scoped_ptr<BlockStore>	_store;
 	Header				_header;
 
+	// a thread must hold _rootLatch to learn which node is the root,
+	// and keeps it until it holds the root's own latch.  only one
+	// operation changes the tree at a time, under _writeMutex, and
+	// _latched and _rootLatched belong to it.
+	os::RWLock			_rootLatch;
+	os::Mutex			_writeMutex;
+	std::vector< boost::shared_ptr<Node> >	_latched;
+	bool				_rootLatched;
+
+	// counted only when a search is held up by a writer, so the
+	// searches that are not never touch the mutex
+	os::Mutex			_searchMutex;
+	SearchStats			_searchStats;
+
+	// in-memory index of the fragment lists, mapping each block on a
+	// list to the block before it (INVALID_BLOCK_NUMBER for the head).
+	// it is loaded the first time fragments are allocated or freed.
+	std::map<BLOCKNO,BLOCKNO>	_fragPrev;
+	bool				_fragIndexLoaded;
+
+	// the redo log, in buffered mode.  writes to the file that bypass
+	// the store are held here until the log is forced past the group
+	// that holds them, _lsn, which is 0 until the group is committed.
+	struct PendingWrite {
+	    os::File::POS	_pos;
+	    std::vector<char>	_data;
+	    Log::LSN		_lsn;
+	};
+
+	boost::scoped_ptr<Log>		_log;
+	std::deque<PendingWrite>	_pending;
+	os::RWLock			_pendingLatch;
+
+	// holds the write mutex for one operation, and releases the
+	// latches the operation still holds when it ends
+	class Writer {
+	protected:
+	    BTree&	_tree;
+	    os::Lock	_lock;
+	public:
+	    Writer( BTree& tree ) : _tree(tree), _lock(tree._writeMutex) {}
+	    ~Writer() { _tree.releaseLatches(); }
+	};
+	friend class Writer;
+
 
 	// internal methods
+	BLOCKNO allocateBlock() throw(os::IoException,FileCorruptedException);
+	void freeBlock( BLOCKNO bn ) throw(os::IoException);
 	boost::shared_ptr<Node> allocateNode( NODETYPE nt, BLOCKNO bn );
-	boost::shared_ptr<Node> readNode( BLOCKNO bn ) throw(os::IoException,FileCorruptedException);
+	boost::shared_ptr<Node> makeNode( BLOCKNO bn, Node::Data* pData );
+	boost::shared_ptr<FragmentBlock> makeFragmentBlock( BLOCKNO bn, FragmentBlock::Data* pData );
+	boost::shared_ptr<Node> readNode( BLOCKNO bn, LATCHMODE lm, bool wait = true ) throw(os::IoException,FileCorruptedException);
+
+	boost::shared_ptr<Node> latchRoot( LATCHMODE lm ) throw(os::IoException,FileCorruptedException);
+	boost::shared_ptr<Node> latchNode( BLOCKNO bn ) throw(os::IoException,FileCorruptedException);
+	boost::shared_ptr<Node> latchNewNode( NODETYPE nt ) throw(os::IoException,FileCorruptedException);
+	void releaseUnchanged( boost::shared_ptr<Node> keep );
+	void releaseLatches();
+	Log::LSN commitChanges() throw(os::IoException);
+	void completeChanges( Log::LSN lsn, bool locked = false ) throw(os::IoException);
+	void applyPending( Log::LSN lsn ) throw(os::IoException);
+	void writeCheckpoint() throw(os::IoException);
 
-	boost::shared_ptr<FragmentBlock> allocateFragments( int& frags, BLOCKNO& bn, FRAGNO& fn ) throw(os::IoException) ;
+	boost::shared_ptr<FragmentBlock> allocateFragments( int& frags, BLOCKNO& bn, FRAGNO& fn ) throw(os::IoException,FileCorruptedException) ;
+	void freeFragments( BLOCKNO bn, FRAGNO fn, int frags ) throw(os::IoException,FileCorruptedException) ;
+	void loadFragmentIndex() throw(os::IoException,FileCorruptedException) ;
+	void pushFragmentBlock( boost::shared_ptr<FragmentBlock> fb, int list ) ;
+	void unlinkFragmentBlock( boost::shared_ptr<FragmentBlock> fb, int list ) throw(os::IoException,FileCorruptedException) ;
 	boost::shared_ptr<FragmentBlock> readFragmentBlock( BLOCKNO bn ) throw(os::IoException,FileCorruptedException) ;
 	
-	void splitChild( boost::shared_ptr<InternalNode> x, int i, boost::shared_ptr<Node> y ) throw(os::IoException) ;
+	void splitChild( boost::shared_ptr<InternalNode> x, int i, boost::shared_ptr<Node> y ) throw(os::IoException,FileCorruptedException) ;
 	void insertNonFull( boost::shared_ptr<Node> x, Node::Entry& e ) throw(os::IoException,FileCorruptedException) ;
-	bool search( boost::shared_ptr<Node> x, int k, char* d ) throw(os::IoException,FileCorruptedException);
+	bool search( boost::shared_ptr<Node> x, const Key& k, char* d ) throw(os::IoException,FileCorruptedException);
+	bool searchOptimistic( const Key& k, char* d, bool& found ) throw(os::IoException,FileCorruptedException);
+	int findChild( boost::shared_ptr<Node> x, const Key& k );
+	int findLastChild( boost::shared_ptr<Node> x, const Key& k );
+	const Key& checkKey( const Key& k, Key& wide ) throw(KeyTypeException);
 
-	bool remove( boost::shared_ptr<Node> x, int key ) throw( os::IoException,FileCorruptedException,NotImplementedException );
+	bool remove( boost::shared_ptr<Node> x, const Key& key ) throw( os::IoException,FileCorruptedException );
+	bool endsWith( BLOCKNO bn, const Key& k ) throw(os::IoException,FileCorruptedException);
+	boost::shared_ptr<Node> fillChild( boost::shared_ptr<InternalNode> x, int i, boost::shared_ptr<Node> ci ) throw(os::IoException,FileCorruptedException);
+	void borrowFromLeft( boost::shared_ptr<InternalNode> x, int i, boost::shared_ptr<Node> y, boost::shared_ptr<Node> ci ) ;
+	void borrowFromRight( boost::shared_ptr<InternalNode> x, int i, boost::shared_ptr<Node> ci, boost::shared_ptr<Node> z ) ;
+	void mergeChildren( boost::shared_ptr<InternalNode> x, int i, boost::shared_ptr<Node> y, boost::shared_ptr<Node> z ) throw(os::IoException,FileCorruptedException);
 	
-	Node::Entry removeMinimumEntry( boost::shared_ptr<Node> x ) throw( os::IoException,FileCorruptedException,NotImplementedException );
-	Node::Entry removeMaximumEntry( boost::shared_ptr<Node> x ) throw( os::IoException,FileCorruptedException,NotImplementedException );
-	
-	void dump( boost::shared_ptr<Node> x );
+	void logGeometry();
+
+	void writeFile( os::File::POS pos, const os::File::IoVec* iov, int count ) throw(os::IoException) ;
+	void readFile( os::File::POS pos, void* data, int len ) throw(os::IoException) ;
 
-	void writeOverflowEntry( Node::Entry& e, int key, const char* data, int len ) ;
+	void writeOverflowEntry( Node::Entry& e, const Key& key, const char* data, int len ) ;
 	int writeOverflowData( BLOCKNO& bn, FRAGNO& fn, const char* data, int len ) ;
 	
 	void readOverflowEntry( const Node::Entry& e, char* d ) ;
+	void freeOverflowEntry( const Node::Entry& e ) throw(os::IoException,FileCorruptedException) ;
+
+	int getExtentThreshold() const ;
+	BLOCKNO allocateExtent( int blocks ) throw(os::IoException,FileCorruptedException) ;
+	void freeExtent( BLOCKNO bn, int blocks ) throw(os::IoException,FileCorruptedException) ;
+	void writeExtentEntry( Node::Entry& e, const Key& key, const char* data, int len ) throw(os::IoException,FileCorruptedException) ;
+	void readExtentEntry( const Node::Entry& e, char* d ) throw(os::IoException,FileCorruptedException) ;
+	void freeExtentEntry( const Node::Entry& e ) throw(os::IoException,FileCorruptedException) ;
+	void readFreeExtent( BLOCKNO bn, FreeExtent& fe ) throw(os::IoException,FileCorruptedException) ;
+	void writeFreeExtent( const FreeExtent& fe ) throw(os::IoException) ;
 	
     public:
-	BTree();
+	BTree( STORAGEMODE sm = smBuffered, int poolFrames = DEFAULT_POOL_FRAMES );
+	~BTree();
 	
-	void create( std::string fname ) throw(os::IoException) ;
-	void insert( int key, const char* data, int len ) throw(os::IoException,FileCorruptedException) ;
-	bool search( int key, char* data ) throw(os::IoException,FileCorruptedException) ;
-	bool remove( int key ) throw( os::IoException,FileCorruptedException,NotImplementedException );
+	void create( std::string fname, int blockSize = DEFAULT_BLOCK_SIZE, const KeyFormat& kf = KeyFormat() ) throw(os::IoException,InvalidBlockSizeException,InvalidKeyFormatException) ;
+	// a tree opened read-only never writes to its file or its log, so
+	// it cannot be opened while its log holds committed changes
+	void open( std::string fname, bool readOnly = false ) throw(os::IoException,FileCorruptedException,RecoveryNeededException) ;
+	// keys must be of the tree's key format, or KeyTypeException is
+	// thrown.  a tree of int64 keys also takes plain int keys.
+	void insert( const Key& key, const char* data, int len ) throw(os::IoException,FileCorruptedException,KeyTypeException) ;
+	bool search( const Key& key, char* data ) throw(os::IoException,FileCorruptedException,KeyTypeException) ;
+	int scan( const Key& lo, const Key& hi, ScanCallback& cb ) throw(os::IoException,FileCorruptedException,KeyTypeException) ;
+	bool remove( const Key& key ) throw( os::IoException,FileCorruptedException,KeyTypeException );
+
+	void flush() throw(os::IoException) ;
+	void checkpoint() throw(os::IoException) ;
+	const BlockStore::Stats& getStoreStats() const { return _store->getStats(); }
+	SearchStats getSearchStats() ;
+	BLOCKNO getBlockCount() const { return _header.getBlockCount(); }
+	const KeyFormat& getKeyFormat() const { return _header.getKeyFormat(); }
 	
 	void dump();
     };
 
+    std::ostream& operator << ( std::ostream& os, const BTree::SearchStats& s );
 
-}
 
+    //
+    // BulkLoader builds a tree bottom-up from entries added in ascending
+    // key order.  leaves are filled to fillPercent of their capacity and
+    // written one after another, and each level of internal nodes is
+    // built as the level below it grows, so only the rightmost node of
+    // each level is ever held open.  the nodes on the right edge of each
+    // level may be less full than the rest.
+    //
+    // a node's prefix is only known once the next node on its level is
+    // started.  a leaf is filled to a share of the capacity it has with
+    // the prefix its keys share so far, and when the separator after it
+    // leaves it a shorter one, the entries it no longer has room for move
+    // on to the next leaf.  internal nodes are few, and are filled to a
+    // share of the capacity they have without a prefix.
+    //
+    // the tree must be empty.  the loaded tree is built in new blocks,
+    // and replaces its root when finish() is called, or when the loader
+    // is destroyed.  until then, the loader is the tree's only writer,
+    // and other threads using the tree wait for it.  the blocks it commits
+    // along the way are not reachable from the root, so a crash before
+    // the load finishes leaves the tree empty.
+    //
+
+    static const int BULK_FLUSH_BLOCKS = 256;
+
+    class BulkLoader {
+    protected:
+	BTree&						_tree;
+	BLOCKNO						_root;
+	int						_fillPercent;
+	int						_internalTarget;
+	boost::shared_ptr<LeafNode>			_leaf;
+	std::vector< boost::shared_ptr<InternalNode> >	_levels;
+	bool						_empty;
+	Key						_lastKey;
+	BLOCKNO						_flushed;
+
+	int getLeafTarget( int prefixLen ) const;
+	void nextLeaf( const Fence& hi ) throw(os::IoException);
+	void addChild( int level, const Key& key, BLOCKNO bn, BLOCKNO left ) throw(os::IoException);
+
+    public:
+	BulkLoader( BTree& tree, int fillPercent = 100 ) throw(os::IoException,FileCorruptedException,TreeNotEmptyException);
+	~BulkLoader();
+
+	void add( const Key& key, const char* data, int len ) throw(os::IoException,FileCorruptedException,KeyOrderException,KeyTypeException);
+	void finish() throw(os::IoException);
+    };
+}
@@ -4,62 +4,108 @@
 #include "bt.h"
 
 namespace bt {
+    // allocate a block, reusing one from the free block chain if there is
+    // one, and only extending the file when the chain is empty
+    BLOCKNO BTree::allocateBlock() throw(os::IoException,FileCorruptedException) {
+	BLOCKNO bn = _header.getFreeBlock();
+	if( bn == INVALID_BLOCK_NUMBER )
+	    return _header.allocateBlockNumber();
+
+	// take the block off the head of the chain
+	char* buf = _store->pin( bn );
+	const FreeBlock* fb = reinterpret_cast<const FreeBlock*>( buf );
+	bool valid = fb->_magic == FREE_BLOCK_MAGIC_VALUE && fb->_blockno == bn;
+	BLOCKNO next = fb->_next_block;
+	_store->unpin( bn );
+
+	if( !valid || next == bn || (next != INVALID_BLOCK_NUMBER && (next <= 0 || next >= _header.getBlockCount())) )
+	    throw FileCorruptedException();
+
+	DBG( dout("bt.alloc",2) << "Reusing free block " << bn << std::endl );
+	_header.setFreeBlock( next );
+	return bn;
+    }
+
+    // put a block that is no longer used on the head of the free block
+    // chain.  the caller must not use any node or fragment block still
+    // referring to it.
+    void BTree::freeBlock( BLOCKNO bn ) throw(os::IoException) {
+	assert( bn > 0 && bn < _header.getBlockCount() );
+	DBG( dout("bt.alloc",2) << "Freeing block " << bn << std::endl );
+
+	char* buf = _store->pin( bn, false );
+	FreeBlock* fb = reinterpret_cast<FreeBlock*>( buf );
+	fb->_magic = FREE_BLOCK_MAGIC_VALUE;
+	fb->_blockno = bn;
+	fb->_next_block = _header.getFreeBlock();
+	_store->markDirty( bn );
+	_store->unpin( bn );
+
+	_header.setFreeBlock( bn );
+    }
+
+    // the new node is latched exclusive.  nothing refers to it yet, so
+    // the latch is always free.
     boost::shared_ptr<Node> BTree::allocateNode( NODETYPE nt, BLOCKNO bn ) {
-	if( nt == ntInternalNode ) {
-	    return boost::shared_ptr<Node>( new InternalNode(bn) );
-	} else {
-	    return boost::shared_ptr<Node>( new LeafNode(bn) );
-	}
+	// a new block does not need to be read, just pinned and formatted
+	os::RWLock* latch;
+	char* buf = _store->pin( bn, false, &latch );
+
+	int blockSize = _header.getBlockSize();
+	const KeyFormat& kf = _header.getKeyFormat();
+	Node::Data* pData;
+	if( nt == ntInternalNode )
+	    pData = InternalNode::format( buf, bn, blockSize, kf );
+	else
+	    pData = LeafNode::format( buf, bn, blockSize, kf );
+	boost::shared_ptr<Node> x = makeNode( bn, pData );
+
+	x->setLatch( latch );
+	x->latch( lmExclusive );
+	return x;
     }
 
 
-    boost::shared_ptr<FragmentBlock> BTree::allocateFragments( int& frags, BLOCKNO& bn, FRAGNO& fn ) throw(os::IoException) {
+    boost::shared_ptr<FragmentBlock> BTree::allocateFragments( int& frags, BLOCKNO& bn, FRAGNO& fn ) throw(os::IoException,FileCorruptedException) {
 	boost::shared_ptr<FragmentBlock> fb;
+	int fragsPerBlock = _header.getFragsPerBlock();
 	
 	// we cannot allocate more than 1 block of fragments at a time
-	if( frags > MAX_FRAGS_PER_BLOCK )
-	    frags = MAX_FRAGS_PER_BLOCK;
+	if( frags > fragsPerBlock )
+	    frags = fragsPerBlock;
 
 	// set the FRAGNO to invalid first, it will be set later once we find a
 	// fragment cluster
 	fn = INVALID_FRAG_NUMBER;
 	bn = INVALID_BLOCK_NUMBER;
+
+	loadFragmentIndex();
 	
 	// if the request is for a whole block of fragments, just
 	// skip to where a new block is allocated, becase the request
 	// cannot be accomodated by a partially full block.
 
-	if( frags < MAX_FRAGS_PER_BLOCK ) {
-	    // see if there is an existing partially full fragment
-	    // block with enough consecutive fragments to fit the
-	    // request
-
-	    // try to get a perfect fit first, the progressively try to fit the data
-	    // into a bucket with more empty space (best fit first algorithm)
-	    for( int b = frags; fn == INVALID_FRAG_NUMBER && b < MAX_FRAGS_PER_BLOCK; b++ ) {
-
-		// see if there are any blocks with b free fragments
+	if( frags < fragsPerBlock ) {
+	    // every block is on the list for the length of its largest free
+	    // cluster, so the first block on the shortest list that is long
+	    // enough is certain to fit the request (best fit first), and
+	    // it is the only block that needs to be read.
+	    for( int b = frags; b < fragsPerBlock; b++ ) {
 		if( _header.getFragListHead(b) != INVALID_BLOCK_NUMBER ) {
-		    // read in the block that has the free fragments
 		    fb = readFragmentBlock( _header.getFragListHead(b) );
-		    assert(fb);
-
 		    bn = fb->getBlockNumber();
-		    
-		    // reserve that group of fragments
+
+		    // take this block off the list it was on, since it will
+		    // now have a shorter largest cluster
+		    unlinkFragmentBlock( fb, b );
+
+		    // a block that does not fit is on the wrong list
 		    try {
 			fn = fb->reserveFragments( frags );
 		    } catch( FragmentReservationException& ) {
-			// it is possible that it failed to reserve a large enough block, which
-			// would happen if the block somehow ended up on the wrong freelist.
-			// in this case, the logic below will take care of moving the block
-			// to the right free list, and we just contine the search.
+			throw FileCorruptedException();
 		    }
-		    
-		    // take this block off of the head of the list we found it on, since
-		    // it will likely now have fewer blocks (though it could have the same,
-		    // in which case it will be re-added below).
-		    _header.setFragListHead(b, fb->getNextBlock() );
+		    break;
 		}
 	    }
 	}
@@ -71,34 +117,18 @@ namespace bt {
 	//
 
 	if( fn == INVALID_FRAG_NUMBER ) {
-	    bn = _header.allocateBlockNumber();
-	    fb = boost::shared_ptr<FragmentBlock>( new FragmentBlock(bn) );
+	    bn = allocateBlock();
+	    char* buf = _store->pin( bn, false );
+	    fb = makeFragmentBlock( bn, FragmentBlock::format(buf,bn,_header.getBlockSize()) );
 	    fn = fb->reserveFragments( frags );
 	}
 
 
-	// compute X = size of the largest contiguous cluster of
-	// fragments left in the block, and add the block to the head
-	// of the list with X free fragments
+	// put the block on the list for the largest contiguous cluster
+	// of fragments left in it, if it has any free fragments left
 	int cluster_len = fb->getMaxFragmentClusterLength();
-	if( cluster_len == 0 ) {
-	    // no free fragments left.
-	    fb->setNextBlock( INVALID_BLOCK_NUMBER );
-	} else {
-	    // block has some free fragments available.  put it in the
-	    // head of the appropriate list...
-			
-	    // ... but, if it is already the head of the chain, don't
-	    // set the next pointer, or you end up with a circular
-	    // reference here
-	    if( _header.getFragListHead(cluster_len) != fb->getBlockNumber() )
-		fb->setNextBlock( _header.getFragListHead(cluster_len) );
-			
-	    // put this block on the front of the header
-	    _header.setFragListHead(cluster_len, fb->getBlockNumber() );
-	}
-		    
-	_header.write( _file );
+	if( cluster_len > 0 )
+	    pushFragmentBlock( fb, cluster_len );
 
 	assert( bn != INVALID_BLOCK_NUMBER );
 	assert( fn != INVALID_FRAG_NUMBER );
@@ -106,6 +136,107 @@ namespace bt {
 	
 	return fb;
     }
-    
 
+
+    // release a cluster of fragments, and move their block to the list
+    // for its new largest cluster, or to the free block chain once none
+    // of its fragments are used
+    void BTree::freeFragments( BLOCKNO bn, FRAGNO fn, int frags ) throw(os::IoException,FileCorruptedException) {
+	DBG( dout("bt.alloc",2) << "Freeing " << frags << " fragments at " << bn << ":" << fn << std::endl );
+
+	loadFragmentIndex();
+
+	boost::shared_ptr<FragmentBlock> fb = readFragmentBlock( bn );
+	int before = fb->getMaxFragmentClusterLength();
+	fb->releaseFragments( fn, frags );
+	int after = fb->getMaxFragmentClusterLength();
+
+	if( after == before ) {
+	    // the largest cluster did not grow, so the block is already on
+	    // the right list
+	    fb->write(*_store);
+	    return;
+	}
+
+	if( before > 0 )
+	    unlinkFragmentBlock( fb, before );
+
+	if( after == _header.getFragsPerBlock() ) {
+	    fb.reset();
+	    freeBlock( bn );
+	} else {
+	    pushFragmentBlock( fb, after );
+	    fb->write(*_store);
+	}
+    }
+
+    // build the index of the fragment lists by walking each of them once.
+    // a list can never be longer than the file, so a longer walk means
+    // the list is broken.
+    void BTree::loadFragmentIndex() throw(os::IoException,FileCorruptedException) {
+	if( _fragIndexLoaded )
+	    return;
+
+	DBG( dout("bt.alloc",2) << "Loading the fragment list index" << std::endl );
+
+	_fragPrev.clear();
+	for( int b = 1; b < _header.getFragsPerBlock(); b++ ) {
+	    BLOCKNO prev = INVALID_BLOCK_NUMBER;
+	    BLOCKNO bn = _header.getFragListHead(b);
+	    while( bn != INVALID_BLOCK_NUMBER ) {
+		if( !_fragPrev.insert( std::make_pair( bn, prev ) ).second )
+		    throw FileCorruptedException();
+		if( (BLOCKNO) _fragPrev.size() >= _header.getBlockCount() )
+		    throw FileCorruptedException();
+
+		prev = bn;
+		bn = readFragmentBlock( bn )->getNextBlock();
+	    }
+	}
+
+	_fragIndexLoaded = true;
+    }
+
+    // put a fragment block on the head of the list of blocks whose largest
+    // free cluster is list fragments long
+    void BTree::pushFragmentBlock( boost::shared_ptr<FragmentBlock> fb, int list ) {
+	BLOCKNO bn = fb->getBlockNumber();
+	BLOCKNO head = _header.getFragListHead(list);
+	assert( head != bn && _fragPrev.find(bn) == _fragPrev.end() );
+
+	fb->setNextBlock( head );
+	if( head != INVALID_BLOCK_NUMBER )
+	    _fragPrev[head] = bn;
+	_fragPrev[bn] = INVALID_BLOCK_NUMBER;
+	_header.setFragListHead( list, bn );
+    }
+
+    // take a fragment block off the list of blocks whose largest free
+    // cluster is list fragments long.  the index gives the block before
+    // it, so at most that one other block is read.
+    void BTree::unlinkFragmentBlock( boost::shared_ptr<FragmentBlock> fb, int list ) throw(os::IoException,FileCorruptedException) {
+	BLOCKNO bn = fb->getBlockNumber();
+	BLOCKNO next = fb->getNextBlock();
+
+	std::map<BLOCKNO,BLOCKNO>::iterator pos = _fragPrev.find( bn );
+	if( pos == _fragPrev.end() )
+	    throw FileCorruptedException();
+	BLOCKNO prev = pos->second;
+	_fragPrev.erase( pos );
+
+	if( prev == INVALID_BLOCK_NUMBER ) {
+	    if( _header.getFragListHead(list) != bn )
+		throw FileCorruptedException();
+	    _header.setFragListHead( list, next );
+	} else {
+	    boost::shared_ptr<FragmentBlock> p = readFragmentBlock( prev );
+	    p->setNextBlock( next );
+	    p->write(*_store);
+	}
+
+	if( next != INVALID_BLOCK_NUMBER )
+	    _fragPrev[next] = prev;
+
+	fb->setNextBlock( INVALID_BLOCK_NUMBER );
+    }
 }
@@ -0,0 +1,388 @@
+#include "stdinc.h"
+#include <ctime>
+#include <cstdlib>
+#include "os.h"
+#include "dbg.h"
+#include "bt.h"
+
+//
+// measures the cpu time the tree spends per operation, first on nodes in
+// memory, where nothing but the node code runs, then on a whole tree.
+// the tree's file should be on a memory file system, or the syncs at
+// each commit swamp everything else.  with readers, the searches are
+// also run from that many threads at once, alone and alongside a writer,
+// and timed by the clock on the wall.
+//
+//   btbench [file [count [readers]]]
+//
+
+static const int BLOCK_SIZE = bt::DEFAULT_BLOCK_SIZE;
+static const int NODE_ROUNDS = 20000;
+
+//
+// a block store that keeps every block in memory and never writes any.
+// each block is allocated on its own, so the blocks already pinned stay
+// where they are when the table of them grows.
+//
+class MemoryStore : public bt::BlockStore {
+protected:
+    std::vector<char*>	_blocks;
+
+public:
+    virtual ~MemoryStore() {
+	for( int i = 0; i < (int) _blocks.size(); i++ )
+	    delete[] _blocks[i];
+    }
+
+    virtual void attach( os::File file, bool writable, int blockSize ) throw(os::IoException) {
+	_blockSize = blockSize;
+    }
+
+    virtual char* pin( bt::BLOCKNO bn, bool read = true, os::RWLock** latch = NULL ) throw(os::IoException,bt::BufferPoolExhaustedException) {
+	if( bn >= _blocks.size() )
+	    _blocks.resize( bn+1, NULL );
+	if( _blocks[bn] == NULL ) {
+	    _blocks[bn] = new char[_blockSize];
+	    os::mem::clear( _blocks[bn], _blockSize );
+	}
+	return _blocks[bn];
+    }
+
+    virtual void unpin( bt::BLOCKNO bn ) {}
+    virtual void markDirty( bt::BLOCKNO bn ) {}
+    virtual void flush() throw(os::IoException) {}
+};
+
+class Timer {
+protected:
+    std::clock_t	_start;
+    const char*		_name;
+    double		_ops;
+
+public:
+    Timer( const char* name, double ops ) : _start(std::clock()), _name(name), _ops(ops) {}
+    ~Timer() {
+	double secs = double( std::clock() - _start ) / CLOCKS_PER_SEC;
+	std::cout << std::setw(24) << std::left << _name
+		  << std::setw(10) << std::right << std::fixed << std::setprecision(1)
+		  << secs * 1e9 / _ops << " ns/op" << std::endl;
+    }
+};
+
+class WallTimer {
+protected:
+    unsigned int	_start;
+    const char*		_name;
+    double		_ops;
+
+public:
+    WallTimer( const char* name, double ops ) : _start(os::getTicks()), _name(name), _ops(ops) {}
+    ~WallTimer() {
+	double secs = ( os::getTicks() - _start ) / 1000.0;
+	std::cout << std::setw(24) << std::left << _name
+		  << std::setw(10) << std::right << std::fixed << std::setprecision(1)
+		  << secs * 1e9 / _ops << " ns/op, wall" << std::endl;
+    }
+};
+
+// keep the compiler from dropping work whose result is not used
+static volatile int sink;
+
+template <class T>
+boost::shared_ptr<bt::Node> makeNode( MemoryStore& store, bt::BLOCKNO bn ) {
+    bt::Node::Data* pData = T::format( store.pin( bn, false ), bn, BLOCK_SIZE );
+    return boost::shared_ptr<bt::Node>( new T( &store, bn, pData ) );
+}
+
+//
+// the calls made on every node the tree passes through, made through
+// the Node interface as the tree makes them
+//
+void benchNodes() {
+    MemoryStore store;
+    store.attach( os::File(), true, BLOCK_SIZE );
+
+    boost::shared_ptr<bt::Node> leaf = makeNode<bt::LeafNode>( store, 1 );
+    boost::shared_ptr<bt::Node> right = makeNode<bt::LeafNode>( store, 2 );
+    boost::shared_ptr<bt::Node> internal = makeNode<bt::InternalNode>( store, 3 );
+    boost::shared_ptr<bt::Node> sibling = makeNode<bt::InternalNode>( store, 4 );
+
+    bt::LeafNode& l = static_cast<bt::LeafNode&>( *leaf );
+    bt::InternalNode& in = static_cast<bt::InternalNode&>( *internal );
+
+    int leafMax = leaf->getMaxKeyCount();
+    int internalMax = internal->getMaxKeyCount();
+
+    int i, j, sum;
+
+    for( i = 0; i < leafMax; i++ )
+	l.setEntry( i, bt::Node::Entry( i*2, bt::etComplete, "x", 2 ) );
+    leaf->setKeyCount( leafMax );
+    for( i = 0; i < internalMax; i++ ) {
+	in.setKey( i, i*2 );
+	in.setChild( i, i+100 );
+    }
+    in.setChild( internalMax, internalMax+100 );
+    internal->setKeyCount( internalMax );
+
+    std::cout << "nodes: " << leafMax << " entries per leaf, "
+	      << internalMax << " keys per internal node" << std::endl;
+
+    {
+	Timer t( "getKey", double(NODE_ROUNDS) * (leafMax + internalMax) );
+	for( sum = 0, j = 0; j < NODE_ROUNDS; j++ ) {
+	    for( i = 0; i < leaf->getKeyCount(); i++ )
+		sum += leaf->getKey( i ).toInt();
+	    for( i = 0; i < internal->getKeyCount(); i++ )
+		sum += internal->getKey( i ).toInt();
+	}
+	sink = sum;
+    }
+
+    {
+	Timer t( "getChild", double(NODE_ROUNDS) * (internalMax+1) );
+	for( sum = 0, j = 0; j < NODE_ROUNDS; j++ ) {
+	    for( i = 0; i <= internal->getKeyCount(); i++ )
+		sum += internal->getChild( i );
+	}
+	sink = sum;
+    }
+
+    {
+	Timer t( "setKeyCount/isFull", double(NODE_ROUNDS) * leafMax );
+	for( sum = 0, j = 0; j < NODE_ROUNDS; j++ ) {
+	    for( i = 0; i <= leafMax; i++ ) {
+		leaf->setKeyCount( i );
+		sum += leaf->isFull();
+	    }
+	}
+	sink = sum;
+    }
+
+    // split a full leaf and a full internal node in half, and merge the
+    // halves back together, as insert and remove do
+    {
+	Timer t( "split+merge leaf", NODE_ROUNDS );
+	bt::LeafNode& r = static_cast<bt::LeafNode&>( *right );
+	for( j = 0; j < NODE_ROUNDS; j++ ) {
+	    int n = leafMax / 2;
+	    for( i = n; i < leafMax; i++ )
+		r.setEntry( i-n, l.getEntry( i ) );
+	    right->setKeyCount( leafMax - n );
+	    leaf->setKeyCount( n );
+	    leaf->merge( right->getKey( 0 ), right );
+	}
+	sink = leaf->getKeyCount();
+    }
+
+    {
+	Timer t( "split+merge internal", NODE_ROUNDS );
+	bt::InternalNode& s = static_cast<bt::InternalNode&>( *sibling );
+	for( j = 0; j < NODE_ROUNDS; j++ ) {
+	    int n = internalMax / 2;
+	    for( i = n+1; i < internalMax; i++ )
+		s.setKey( i-n-1, in.getKey( i ) );
+	    for( i = n+1; i <= internalMax; i++ )
+		s.setChild( i-n-1, in.getChild( i ) );
+	    sibling->setKeyCount( internalMax - n - 1 );
+	    internal->setKeyCount( n );
+	    internal->merge( in.getKey( n ), sibling );
+	}
+	sink = internal->getKeyCount();
+    }
+}
+
+//
+// a thread searching for every key
+//
+class Reader {
+public:
+    bt::BTree*			_tree;
+    const std::vector<int>*	_keys;
+    int				_found;
+
+    static void run( void* p ) {
+	Reader& r = *static_cast<Reader*>( p );
+	char data[bt::NODE_DATA_LEN];
+	r._found = 0;
+	try {
+	    for( int i = 0; i < (int) r._keys->size(); i++ )
+		r._found += r._tree->search( (*r._keys)[i], data );
+	} catch( std::exception& x ) {
+	    std::cout << "exception: " << x.what() << std::endl;
+	}
+    }
+};
+
+//
+// a thread that changes the tree under the readers until it is stopped.
+// a second entry under each of a run of keys splits the leaves they are
+// in, and removing the first of them merges the leaves again, so each
+// key has an entry throughout.
+//
+class Writer {
+protected:
+    os::Mutex		_mutex;
+    bool		_stopped;
+
+public:
+    static const int RUN = 200;
+
+    bt::BTree*			_tree;
+    const std::vector<int>*	_keys;
+    int				_changes;
+
+    Writer() : _stopped(false), _changes(0) {}
+
+    void stop() {
+	os::Lock lock( _mutex );
+	_stopped = true;
+    }
+
+    bool isStopped() {
+	os::Lock lock( _mutex );
+	return _stopped;
+    }
+
+    static void run( void* p ) {
+	Writer& w = *static_cast<Writer*>( p );
+	const std::vector<int>& keys = *w._keys;
+	std::string value( 20, 'v' );
+	try {
+	    for( int i = 0; !w.isStopped(); i = (i + RUN) % keys.size() ) {
+		int j;
+		for( j = i; j < i + RUN && j < (int) keys.size(); j++ )
+		    w._tree->insert( keys[j], value.c_str(), value.length()+1 );
+		for( j = i; j < i + RUN && j < (int) keys.size(); j++ )
+		    w._tree->remove( keys[j] );
+		w._changes += 2*(j - i);
+	    }
+	} catch( std::exception& x ) {
+	    std::cout << "exception: " << x.what() << std::endl;
+	}
+    }
+};
+
+//
+// search for keys from readers threads at once, alongside a writer if
+// write is set.  false if a reader did not find every key.
+//
+bool benchReaders( bt::BTree& tree, const std::vector<int>& keys, int readers, bool write ) {
+    int count = keys.size();
+    std::vector<Reader> r( readers );
+    Writer w;
+    boost::shared_ptr<os::Thread> writer;
+    std::vector< boost::shared_ptr<os::Thread> > threads;
+    int i;
+
+    {
+	if( write ) {
+	    w._tree = &tree;
+	    w._keys = &keys;
+	    writer.reset( new os::Thread( Writer::run, &w ) );
+	}
+
+	WallTimer t( write ? "search, with a writer" : "search, threads", double(readers) * count );
+	for( i = 0; i < readers; i++ ) {
+	    r[i]._tree = &tree;
+	    r[i]._keys = &keys;
+	    threads.push_back( boost::shared_ptr<os::Thread>( new os::Thread( Reader::run, &r[i] ) ) );
+	}
+
+	for( i = 0; i < readers; i++ )
+	    threads[i]->join();
+    }
+
+    if( write ) {
+	w.stop();
+	writer->join();
+	std::cout << "writer made " << w._changes << " changes meanwhile, searches: "
+		  << tree.getSearchStats() << std::endl;
+    }
+
+    for( i = 0; i < readers; i++ ) {
+	if( r[i]._found != count ) {
+	    std::cout << "reader found " << r[i]._found << " of " << count << " keys!" << std::endl;
+	    return false;
+	}
+    }
+    return true;
+}
+
+//
+// whole operations on a tree of count keys.  false if the tree did not
+// find every key it was given.
+//
+bool benchTree( std::string fname, int count, int readers ) {
+    std::vector<int> keys( count );
+    for( int i = 0; i < count; i++ )
+	keys[i] = i;
+    std::srand( 1 );
+    std::random_shuffle( keys.begin(), keys.end() );
+
+    std::string value( 20, 'v' );
+    static char data[bt::NODE_DATA_LEN];
+
+    bt::BTree tree;
+    tree.create( fname );
+
+    std::cout << "tree: " << count << " keys in " << fname << std::endl;
+
+    int i, found;
+
+    {
+	Timer t( "insert", count );
+	for( i = 0; i < count; i++ )
+	    tree.insert( keys[i], value.c_str(), value.length()+1 );
+    }
+
+    {
+	Timer t( "search", count );
+	for( found = 0, i = 0; i < count; i++ )
+	    found += tree.search( keys[i], data );
+	if( found != count ) {
+	    std::cout << "search found " << found << " of " << count << " keys!" << std::endl;
+	    return false;
+	}
+    }
+
+    {
+	Timer t( "cursor", count );
+	bt::Cursor c( tree );
+	found = 0;
+	for( bool ok = c.first(); ok; ok = c.next() )
+	    found++;
+	sink = found;
+    }
+
+    if( readers > 0 ) {
+	std::cout << readers << " readers" << std::endl;
+	if( !benchReaders( tree, keys, readers, false ) || !benchReaders( tree, keys, readers, true ) )
+	    return false;
+    }
+
+    {
+	Timer t( "remove", count );
+	for( i = 0; i < count; i++ )
+	    tree.remove( keys[i] );
+    }
+
+    return true;
+}
+
+int main( int argc, char** argv ) {
+    std::string fname = argc > 1 ? argv[1] : "bench.dat";
+    int count = argc > 2 ? std::atoi( argv[2] ) : 100000;
+    int readers = argc > 3 ? std::atoi( argv[3] ) : 0;
+
+    try {
+	benchNodes();
+	if( !benchTree( fname, count, readers ) )
+	    return 1;
+    } catch( std::exception& x ) {
+	std::cout << "exception: " << x.what() << std::endl;
+	return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include "stdinc.h"
+#include "os.h"
+#include "dbg.h"
+#include "bt.h"
+
+class TestException : public std::exception {
+protected:
+    std::string _error;
+public:
+    TestException( std::string error ) : _error(error) {}
+    virtual ~TestException() throw() {}
+    virtual const char* what() const throw() {
+	return _error.c_str();
+    }
+};
+
+static const int BLOCK_SIZE = bt::DEFAULT_BLOCK_SIZE;
+
+// the first block number whose offset does not fit in 32 bits, plus a
+// bit more so the blocks straddle no particular boundary
+static const bt::BLOCKNO FIRST_BIG_BLOCK = ((((os::File::POS) 1) << 32) / BLOCK_SIZE) + 1000;
+static const int BIG_BLOCKS = 16;
+
+
+//
+// write BIG_BLOCKS leaf nodes past the 4GB mark of a sparse file through
+// the given block store, then read them back through a fresh store
+//
+void testStore( bt::BlockStore& writer, bt::BlockStore& reader, os::File f ) {
+    int i;
+
+    writer.attach( f, true, BLOCK_SIZE );
+    for( i = 0; i < BIG_BLOCKS; i++ ) {
+	bt::BLOCKNO bn = FIRST_BIG_BLOCK + i*7;
+	char* buf = writer.pin( bn, false );
+	bt::LeafNode::format( buf, bn, BLOCK_SIZE );
+	writer.markDirty( bn );
+	writer.unpin( bn );
+    }
+    writer.flush();
+
+    if( f.getSize() < bt::blockOffset( FIRST_BIG_BLOCK + (BIG_BLOCKS-1)*7 + 1, BLOCK_SIZE ) )
+	throw TestException( "file was not extended past 4GB" );
+
+    reader.attach( f, false, BLOCK_SIZE );
+    for( i = 0; i < BIG_BLOCKS; i++ ) {
+	bt::BLOCKNO bn = FIRST_BIG_BLOCK + i*7;
+	char* buf = reader.pin( bn );
+	bt::Node::Data* pData = reinterpret_cast<bt::Node::Data*>( buf );
+	if( pData->getMagic() != bt::NODE_MAGIC_VALUE )
+	    throw TestException( "block past 4GB has the wrong magic value" );
+	if( pData->getBlockNumber() != bn )
+	    throw TestException( "block past 4GB was written at the wrong offset" );
+	reader.unpin( bn );
+    }
+}
+
+int main( void ) {
+    try {
+	std::cout << "Opening big.dat" << std::endl;
+	os::File f( std::string( "big.dat" ),
+		    os::File::CreateOrTruncate,
+		    os::File::ReadWrite,
+		    os::File::ShareNone,
+		    os::File::Random );
+
+	//
+	// test the file layer
+	//
+
+	std::cout << "testing positional I/O past 4GB." << std::endl;
+
+	char out[BLOCK_SIZE], in[BLOCK_SIZE];
+	for( int i = 0; i < BLOCK_SIZE; i++ )
+	    out[i] = (char) i;
+
+	os::File::POS big = (((os::File::POS) 5) << 30) + 12345;
+	f.writeAt( big, out, sizeof(out) );
+	f.readAt( big, in, sizeof(in) );
+	if( !std::equal( in, in+sizeof(in), out ) )
+	    throw TestException( "positional read past 4GB returned the wrong data" );
+
+	if( f.getSize() != big + (os::File::POS) sizeof(out) )
+	    throw TestException( "file size past 4GB is wrong" );
+
+	if( f.seek( big, os::File::SeekAbsolute ) != big || f.tell() != big )
+	    throw TestException( "seek past 4GB landed at the wrong position" );
+
+	f.read( in, sizeof(in) );
+	if( !std::equal( in, in+sizeof(in), out ) )
+	    throw TestException( "read after seek past 4GB returned the wrong data" );
+
+	//
+	// test the block layer
+	//
+
+	std::cout << "testing buffer pool blocks past 4GB." << std::endl;
+	{
+	    bt::BufferPool writer, reader;
+	    f.setSize( 0 );
+	    testStore( writer, reader, f );
+	}
+
+	std::cout << "testing mapped blocks past 4GB." << std::endl;
+	{
+	    bt::MappedStore writer, reader;
+	    f.setSize( 0 );
+	    testStore( writer, reader, f );
+	}
+
+	f.setSize( 0 );
+	std::cout << "done." << std::endl;
+
+    } catch( std::exception& x ) {
+	std::cout << "Error: " << x.what() << std::endl;
+	return -1;
+    }
+
+    return 0;
+}
@@ -6,48 +6,281 @@
 
 namespace bt {
 
-    BTree::BTree() {
-	// validate some assumptions about the node sizes
+    BTree::BTree( STORAGEMODE sm, int poolFrames ) {
+	_readOnly = false;
+	_fragIndexLoaded = false;
+	_rootLatched = false;
+	_searchStats._retries = 0;
+	_searchStats._fallbacks = 0;
 
-	// MIN entries must be defined such that 2 nodes with t-1 keys can be combined, plus an
-	// additional key, to produce a node of 2t-1 keys, which is defined as the maximum
-	// entries in a node.
+	// emit info about compiled-in settings:
+	DBG( dout("bt",5) << "fragsize=" << FRAG_SIZE
+			  << ", entrydatalen=" << NODE_DATA_LEN
+			  << ", oventrydatalen=" << OVERFLOW_ENTRY_DATA_LEN << std::endl );
 
-	assert( 2*MIN_LEAF_ENTRIES + 1 <= LEAF_ENTRIES );
-	assert( 2*MIN_INTERNAL_ENTRIES + 1 <= INTERNAL_ENTRIES );
+	switch( sm ) {
+	case smBuffered:
+	    DBG( dout("bt",5) << "BufferPool: frames=" << poolFrames << std::endl );
+	    _store.reset( new BufferPool(poolFrames) );
+	    break;
 
-	// emit info about compiled-in settings:
-	DBG( dout("bt",5) << "blocksize=" << BLOCK_SIZE
-			  << ", fragsize=" << FRAG_SIZE
-			  << ", entrydatalen=" << NODE_DATA_LEN << std::endl );
-	DBG( dout("bt",5) << "oventrydatalen=" << OVERFLOW_ENTRY_DATA_LEN
-			  << ", frags/block=" << MAX_FRAGS_PER_BLOCK << std::endl );
-	     
-	DBG( dout("bt",5) << "InternalNode: max_entries=" << INTERNAL_ENTRIES << ", min_entries=" << MIN_INTERNAL_ENTRIES << std::endl );
-	DBG( dout("bt",5) << "LeafNode: max_entries=" << LEAF_ENTRIES << ", min_entries=" << MIN_LEAF_ENTRIES << std::endl );
+	case smMapped:
+	    DBG( dout("bt",5) << "MappedStore: segment=" << MAP_SEGMENT_SIZE << std::endl );
+	    _store.reset( new MappedStore() );
+	    break;
+	}
+    }
+
+    BTree::~BTree() {
+	try {
+	    // a tree that is closed cleanly leaves an empty log
+	    checkpoint();
+	} catch( std::exception& x ) {
+	    DBG( dout("bt",1) << "Error flushing btree: " << x.what() << std::endl );
+	} catch( ... ) {
+	    DBG( dout("bt",1) << "Error flushing btree" << std::endl );
+	}
+	DBG( dout("bt",5) << "BlockStore: " << _store->getStats() << std::endl );
     }
 
-    void BTree::create( std::string fname ) throw(os::IoException) {
+    void BTree::create( std::string fname, int blockSize, const KeyFormat& kf ) throw(os::IoException,InvalidBlockSizeException,InvalidKeyFormatException) {
+	// validate the block size and key format before touching the file
+	_header.format( blockSize, kf );
+	logGeometry();
+
+	// empty any log left by a file of the same name before the file
+	// itself, so it can never be replayed over the new one
+	_log.reset( new Log );
+	_log->create( fname + LOG_SUFFIX );
+	_pending.clear();
+
 	_file.open( fname,
 		    os::File::CreateOrTruncate,
 		    os::File::ReadWrite,
 		    os::File::ShareNone,
 		    os::File::Random );
+	_readOnly = false;
+	_store->attach( _file, true, blockSize );
+	if( !_store->setLog( _log.get() ) )
+	    _log.reset();
+
+	// a new file has no fragment blocks to index
+	_fragPrev.clear();
+	_fragIndexLoaded = true;
 
 	// allocate a block for the header
 	_header.allocateBlockNumber();
 
 	// allocate a node
 	boost::shared_ptr<Node> x = allocateNode( ntLeafNode, _header.allocateBlockNumber() );
-
-	// write the header
-	_header.write(_file);
+	_header.setRoot( x->getBlockNumber() );
 
 	// write the root node
-	x->write(_file);
+	x->write(*_store);
+	x.reset();
+
+	// write the root node and the header, and make the new file
+	// complete without its log
+	checkpoint();
+    }
+
+    void BTree::open( std::string fname, bool readOnly ) throw(os::IoException,FileCorruptedException,RecoveryNeededException) {
+	// bring the file up to date with its log before reading any of it.
+	// a read-only tree leaves both files as they are, so it can only
+	// be opened when there is nothing to replay.
+	if( !readOnly )
+	    Log::recover( fname );
+	else if( Log::recover( fname, false ) > 0 )
+	    throw RecoveryNeededException();
+
+	_file.open( fname,
+		    os::File::Open,
+		    readOnly ? os::File::ReadOnly : os::File::ReadWrite,
+		    readOnly ? os::File::ShareRead : os::File::ShareNone,
+		    os::File::Random );
+	_readOnly = readOnly;
+	_fragPrev.clear();
+	_fragIndexLoaded = false;
+
+	// everything needed to serve requests is in the header, so startup
+	// costs one read for the header and one for the root, regardless
+	// of the size of the tree
+	_header.read( _file );
+	logGeometry();
+
+	// every allocated block must be present in the file
+	if( _file.getSize() < blockOffset( _header.getBlockCount(), _header.getBlockSize() ) )
+	    throw FileCorruptedException();
+
+	_store->attach( _file, !readOnly, _header.getBlockSize() );
+	_pending.clear();
+	if( !readOnly ) {
+	    _log.reset( new Log );
+	    if( _store->setLog( _log.get() ) )
+		_log->create( fname + LOG_SUFFIX );
+	    else
+		_log.reset();
+	}
+
+	boost::shared_ptr<Node> root = readNode( _header.getRoot(), lmShared );
+
+	DBG( dout("bt",2) << "Opened " << fname << ": blocks=" << _header.getBlockCount()
+			  << ", root=" << *root << std::endl );
+    }
+
+#ifdef DEBUG
+    static void logCapacity( const char* name, int max ) {
+	dout("bt",5) << name << ": max_entries=" << max << ", min_entries=" << ((max+1)/2)-1 << std::endl;
+    }
+#endif
+
+    // the geometry is only checked and logged by debug builds, so it is
+    // worked out inside the assert and the DBG calls
+    void BTree::logGeometry() {
+	// a full node must split into two nodes that each keep at least one key
+	assert( InternalNode::getCapacity( _header.getBlockSize(), _header.getKeyFormat() ) >= 3 );
+	assert( LeafNode::getCapacity( _header.getBlockSize(), _header.getKeyFormat() ) >= 3 );
+
+	DBG( dout("bt",5) << "blocksize=" << _header.getBlockSize()
+			  << ", frags/block=" << _header.getFragsPerBlock()
+			  << ", keytype=" << _header.getKeyFormat().getType()
+			  << ", keylen=" << _header.getKeyFormat().getLength() << std::endl );
+	DBG( logCapacity( "InternalNode", InternalNode::getCapacity( _header.getBlockSize(), _header.getKeyFormat() ) ) );
+	DBG( logCapacity( "LeafNode", LeafNode::getCapacity( _header.getBlockSize(), _header.getKeyFormat() ) ) );
+    }
+
+    void BTree::flush() throw(os::IoException) {
+	Log::LSN lsn;
+	{
+	    os::Lock lock( _writeMutex );
+	    lsn = commitChanges();
+	}
+	completeChanges( lsn );
+    }
+
+    void BTree::checkpoint() throw(os::IoException) {
+	os::Lock lock( _writeMutex );
+	writeCheckpoint();
+    }
+
+    // called at the end of each operation, under the write mutex.  without
+    // a log, the changes are written to the file.  with one, they become
+    // a group in the log, and the LSN that must be forced is returned.
+    Log::LSN BTree::commitChanges() throw(os::IoException) {
+	if( !_log ) {
+	    // the blocks go out before the header that refers to them, and
+	    // the header only if something changed it
+	    _store->flush();
+	    if( _header.isDirty() )
+		_header.write( _file );
+	    return 0;
+	}
+
+	// the writes that bypass the store are already in the group.  add
+	// the header, once, if it changed, and every block changed since the
+	// last commit.
+	if( _header.isDirty() )
+	    _header.log( *_log );
+	Log::LSN lsn = _store->commitChanges();
+	if( lsn == 0 )
+	    return 0;
+
+	os::ExclusiveLock lock( _pendingLatch );
+	for( std::deque<PendingWrite>::reverse_iterator w = _pending.rbegin(); w != _pending.rend() && w->_lsn == 0; ++w )
+	    w->_lsn = lsn;
+	return lsn;
+    }
+
+    // wait for the changes committed at lsn to be durable.  this is done
+    // once the write mutex has been released, so other writers can go on
+    // meanwhile, unless the caller still holds it, as locked says.
+    void BTree::completeChanges( Log::LSN lsn, bool locked ) throw(os::IoException) {
+	if( lsn == 0 )
+	    return;
+
+	_log->force( lsn );
+	applyPending( lsn );
+
+	if( _log->getSize() >= LOG_CHECKPOINT_SIZE ) {
+	    if( locked )
+		writeCheckpoint();
+	    else
+		checkpoint();
+	}
+    }
+
+    // the writes that bypass the store can only go to the file once the
+    // log is forced past them, since they may overwrite what an
+    // uncommitted tree no longer uses
+    void BTree::applyPending( Log::LSN lsn ) throw(os::IoException) {
+	// readers look at the file and the pending writes together, so they
+	// must not see a write in neither
+	os::ExclusiveLock lock( _pendingLatch );
+	while( !_pending.empty() && _pending.front()._lsn != 0 && _pending.front()._lsn <= lsn ) {
+	    PendingWrite& w = _pending.front();
+	    _file.writeAt( w._pos, &w._data[0], w._data.size() );
+	    _pending.pop_front();
+	}
+    }
+
+    // under the write mutex
+    void BTree::writeCheckpoint() throw(os::IoException) {
+	commitChanges();
+	if( !_log || _log->isEmpty() )
+	    return;
+
+	// bring the file up to date with the log, and only once it is safely
+	// on the disk, empty the log.  every group is forced first, since
+	// writers that have released the write mutex may not have forced
+	// their own yet.
+	DBG( dout("bt",2) << "Checkpoint at log size " << _log->getSize() << std::endl );
+	Log::LSN lsn = _log->getEnd();
+	_log->force( lsn );
+	applyPending( lsn );
+	_store->flush();
+	_header.write( _file );
+	_file.sync();
+	_log->reset();
+    }
+
+    // the parts of the file that bypass the store, the extents and the
+    // free extent records in them, are written here.  with a log, the
+    // write joins the operation's group, and is held until it commits.
+    void BTree::writeFile( os::File::POS pos, const os::File::IoVec* iov, int count ) throw(os::IoException) {
+	if( !_log ) {
+	    _file.writeAtV( pos, iov, count );
+	    return;
+	}
+
+	os::ExclusiveLock lock( _pendingLatch );
+	_pending.push_back( PendingWrite() );
+	PendingWrite& w = _pending.back();
+	w._pos = pos;
+	w._lsn = 0;
+	for( int i = 0; i < count; i++ ) {
+	    const char* p = static_cast<const char*>( iov[i]._data );
+	    w._data.insert( w._data.end(), p, p + iov[i]._len );
+	}
+	_log->append( w._pos, &w._data[0], w._data.size() );
+    }
+
+    // read part of the file that bypasses the store, as the writes still
+    // held back leave it
+    void BTree::readFile( os::File::POS pos, void* data, int len ) throw(os::IoException) {
+	os::SharedLock lock( _pendingLatch );
+
+	// a pending write may be past the end of the file
+	os::File::POS size = _pending.empty() ? pos + len : _file.getSize();
+	if( size > pos )
+	    _file.readAt( pos, data, (int) std::min( (os::File::POS) len, size - pos ) );
 
-	// store the root node
-	_root = x;
+	char* d = static_cast<char*>( data );
+	for( std::deque<PendingWrite>::iterator w = _pending.begin(); w != _pending.end(); ++w ) {
+	    os::File::POS from = std::max( pos, w->_pos );
+	    os::File::POS to = std::min( pos + len, w->_pos + (os::File::POS) w->_data.size() );
+	    if( from < to )
+		os::mem::copy( d + (from - pos), &w->_data[from - w->_pos], to - from );
+	}
     }
 
 }
@@ -0,0 +1,185 @@
+#include "stdinc.h"
+#include "os.h"
+#include "dbg.h"
+#include "bt.h"
+
+namespace bt {
+
+    Cursor::Cursor( BTree& tree ) : _tree(tree) {
+	_pos = 0;
+    }
+
+    // latch the leaf at bn shared.  if wait is false, NULL is returned
+    // when the latch is taken.
+    boost::shared_ptr<LeafNode> Cursor::readLeaf( BLOCKNO bn, bool wait ) throw(os::IoException,FileCorruptedException) {
+	boost::shared_ptr<Node> x = _tree.readNode( bn, lmShared, wait );
+	if( !x )
+	    return boost::shared_ptr<LeafNode>();
+	if( !x->isLeaf() )
+	    throw FileCorruptedException();
+	return boost::shared_static_cast<LeafNode>( x );
+    }
+
+    // move forward past the end of the current leaf, and past any empty
+    // leaves, to the next entry in the tree
+    bool Cursor::skipForward() throw(os::IoException,FileCorruptedException) {
+	while( _pos >= _leaf->getKeyCount() ) {
+	    BLOCKNO bn = _leaf->getNext();
+	    if( bn == INVALID_BLOCK_NUMBER ) {
+		_leaf.reset();
+		return false;
+	    }
+	    _leaf = readLeaf( bn );
+	    _pos = 0;
+	}
+	return true;
+    }
+
+    // move back before the start of the current leaf, and past any empty
+    // leaves, to the previous entry in the tree
+    bool Cursor::skipBackward() throw(os::IoException,FileCorruptedException) {
+	// the entry wanted is the last one before the first key of the
+	// leaves passed so far, if any have keys
+	bool bounded = false;
+	Key bound;
+
+	while( _pos < 0 ) {
+	    if( _leaf->getKeyCount() > 0 ) {
+		bounded = true;
+		bound = _leaf->getKey(0);
+	    }
+
+	    BLOCKNO bn = _leaf->getPrev();
+	    if( bn == INVALID_BLOCK_NUMBER ) {
+		_leaf.reset();
+		return false;
+	    }
+
+	    // waiting for the leaf to the left while holding this one could
+	    // deadlock with a thread latching them left to right.  if it is
+	    // taken, let go of this leaf and find the entry again from the
+	    // root.
+	    boost::shared_ptr<LeafNode> prev = readLeaf( bn, false );
+	    if( prev ) {
+		_leaf = prev;
+		_pos = _leaf->getKeyCount() - 1;
+	    } else if( bounded ) {
+		// the entry the cursor was on may have moved meanwhile, so
+		// it is found again by its key.  it cannot be told from
+		// other entries with the same key, so any before it are
+		// passed over.
+		descend( bound );
+		_pos = _leaf->lowerBound( bound ) - 1;
+	    } else {
+		return last();
+	    }
+	}
+	return true;
+    }
+
+    // latch the first leaf whose range covers key, from the root down.
+    // the cursor lets go of its leaf first, since latches are only waited
+    // for going down the tree.
+    void Cursor::descend( const Key& key ) throw(os::IoException,FileCorruptedException) {
+	_leaf.reset();
+	boost::shared_ptr<Node> x = _tree.latchRoot( lmShared );
+	while( !x->isLeaf() )
+	    x = _tree.readNode( x->getChild( _tree.findChild( x, key ) ), lmShared );
+	_leaf = boost::shared_static_cast<LeafNode>( x );
+    }
+
+    bool Cursor::first() throw(os::IoException,FileCorruptedException) {
+	_leaf.reset();
+	boost::shared_ptr<Node> x = _tree.latchRoot( lmShared );
+	while( !x->isLeaf() )
+	    x = _tree.readNode( x->getChild(0), lmShared );
+
+	_leaf = boost::shared_static_cast<LeafNode>( x );
+	_pos = 0;
+	return skipForward();
+    }
+
+    bool Cursor::last() throw(os::IoException,FileCorruptedException) {
+	_leaf.reset();
+	boost::shared_ptr<Node> x = _tree.latchRoot( lmShared );
+	while( !x->isLeaf() )
+	    x = _tree.readNode( x->getChild( x->getKeyCount() ), lmShared );
+
+	_leaf = boost::shared_static_cast<LeafNode>( x );
+	_pos = _leaf->getKeyCount() - 1;
+	return skipBackward();
+    }
+
+    bool Cursor::seek( const Key& given ) throw(os::IoException,FileCorruptedException,KeyTypeException) {
+	Key wide;
+	const Key& key = _tree.checkKey( given, wide );
+	descend( key );
+	_pos = _leaf->lowerBound( key );
+	return skipForward();
+    }
+
+    bool Cursor::next() throw(os::IoException,FileCorruptedException) {
+	assert( isValid() );
+	_pos++;
+	return skipForward();
+    }
+
+    bool Cursor::prev() throw(os::IoException,FileCorruptedException) {
+	assert( isValid() );
+	_pos--;
+	return skipBackward();
+    }
+
+    Key Cursor::getKey() {
+	assert( isValid() );
+	return _leaf->getKey(_pos);
+    }
+
+    int Cursor::getLength() {
+	assert( isValid() );
+	return _leaf->getLength(_pos);
+    }
+
+    int Cursor::getData( char* data ) throw(os::IoException,FileCorruptedException) {
+	assert( isValid() );
+	Node::Entry e = _leaf->getEntry(_pos);
+	switch( e._et ) {
+	case etComplete:
+	    os::mem::copy( data, e._data, e._len );
+	    break;
+	case etOverflow:
+	    _tree.readOverflowEntry( e, data );
+	    break;
+	case etExtent:
+	    _tree.readExtentEntry( e, data );
+	    break;
+	default:
+	    throw FileCorruptedException();
+	}
+	return e._len;
+    }
+
+
+    int BTree::scan( const Key& lo, const Key& given, ScanCallback& cb ) throw(os::IoException,FileCorruptedException,KeyTypeException) {
+	DBG( dout("bt.scan",1) << "Scanning keys " << lo << "-" << given << std::endl );
+
+	// the cursor checks lo
+	Key wide;
+	const Key& hi = checkKey( given, wide );
+
+	Cursor c( *this );
+	std::vector<char> data;
+	int count = 0;
+
+	for( bool ok = c.seek( lo ); ok && c.getKey() <= hi; ok = c.next() ) {
+	    int len = c.getLength();
+	    data.resize( len+1 );
+	    c.getData( &data[0] );
+	    count++;
+	    if( !cb( c.getKey(), &data[0], len ) )
+		break;
+	}
+
+	return count;
+    }
+}
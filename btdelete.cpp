@@ -5,221 +5,302 @@
 
 /*
 
-  Algorithm for deleting from a B-Tree, from Cormen, Leiserson and Rivest,
-  page 395.
-  
-  1. If the key k is in node x and x is a leaf, remove the key k from x
-
-  2. If the key k is in node x and x is an internal node, do the following:
-
-     a. If the child y that preceeds k in node x has at least t keys, then
-        find the predecessor k' of k in the subtree rooted at y. Recursively
-	remove k' and replace k by k' in x (Finding k' and deleting it can be
-	performed in a single downward pass.)
-
-     b. Symmetrically, if the child z that follows k in node x has at least
-        t keys, then find the successor k' of k in the subtree rooted at z.
-	Recursively remove k' and replace k by k' in x. (Finding k' and
-	deleting it can be performed in a single downward pass.)
-
-     c. Otherwise, if both y and z have only t-1 keys, merge k and all of z
-        into y, so that x loses both k and the pointer to z, and y now
-	contains 2t-1 keys.  Then free z and recursively remove k from y.
-
-  3. If the key k is not present in internal node x, determine the root c_i[x]
-     of the appropriate subtree that must contain k, if k is in the tree at
-     all. If c_i[x] has only t-1 keys, execute step 3a or 3b as necessary to
-     guarantee that we descend to a node containing at least t keys.  Then,
-     Finish by recursing on the appropriate child of x.
-
-     a. If c_i[x] has only t-1 keys, but has a sibling with t keys, give c_i[x]
-        an extra key by moving a key from x down into c_i[x], moving a key from
-	c_i[x]'s immediate left or right sibling up into x, and moving the
-	appropriate child from the sibling into c_i[x].
-
-     b. If c_i[x] and all of c_i[x]'s siblings have t-1 keys, merge c_i with one
-        sibling, which involves moving a key from x down into the new merged node
-	to become the median key for that node.
+  Algorithm for deleting from a B+Tree.
+
+  Every entry is in a leaf, and the keys in internal nodes are only
+  separators that route a search.  A separator stays correct when the
+  entry it was copied from is deleted, since it still divides the keys
+  of its two subtrees, so deletion only changes an internal node when
+  two of its children are merged.
+
+  The delete is done in a single pass down the tree.  Before the search
+  descends into a node, it makes sure the node has at least t keys, one
+  more than the minimum of t-1, so that removing an entry from a leaf,
+  or a separator from an internal node when two of its children merge,
+  never leaves a node below the minimum.
+
+  1. If x is a leaf, remove the first entry with key k from x if it is
+     there.
+
+  2. If x is an internal node, determine the child c_i[x] whose subtree
+     must contain the first entry with key k, if k is in the tree at
+     all.  Entries equal to a separator can be on both sides of it, so
+     that is the first child that covers k, unless k is the separator
+     after it and its last entry is not k.  If c_i[x] has only t-1
+     keys, do 2a or 2b as necessary to guarantee that we descend to a
+     node containing at least t keys, then recurse on it.
+
+     a. If c_i[x] has an immediate sibling with at least t keys, move
+        one entry, or one key and child, from that sibling into
+        c_i[x].  Between leaves, the separator in x becomes a copy of
+        the first key of the right leaf.  Between internal nodes, the
+        separator rotates down into c_i[x] and the sibling's end key
+        moves up into x to replace it.
+
+     b. If both immediate siblings have t-1 keys, merge c_i[x] with one
+        of them.  Merging internal nodes brings the separator down from
+        x into the merged node, while merging leaves just drops it and
+        relinks the leaf chain.  The right node of the pair is put on
+        the free block chain.
+
+  An internal node with no keys, which the bulk loader can leave at
+  the right edge of a level, has no sibling to offer its only child,
+  so the search just descends into it.
+
+  When the root is an internal node left with no keys by a merge, its
+  only child becomes the new root and the old root is freed, so the
+  tree gets one level shorter.
 
 */
-    
+
 namespace bt {
 
-    bool BTree::remove( int k ) throw( os::IoException,FileCorruptedException,NotImplementedException ) {
-	return remove( _root, k ) ;
+    bool BTree::remove( const Key& given ) throw( os::IoException,FileCorruptedException,KeyTypeException ) {
+	if( _readOnly )
+	    throw os::IoException( "btree is open read-only" );
+	Key wide;
+	const Key& k = checkKey( given, wide );
+
+	bool removed;
+	Log::LSN lsn;
+	{
+	    Writer w( *this );
+
+	    boost::shared_ptr<Node> r = latchRoot( lmExclusive );
+	    removed = remove( r, k ) ;
+
+	    // only a merge below the root can leave it empty, and then the
+	    // root is still latched
+	    while( _rootLatched && !r->isLeaf() && r->getKeyCount() == 0 ) {
+		BLOCKNO bn = r->getBlockNumber();
+		r = latchNode( r->getChild(0) );
+		_header.setRoot( r->getBlockNumber() );
+		freeBlock( bn );
+	    }
+
+	    // commit every block this remove dirtied, and the header once
+	    // if it changed
+	    lsn = commitChanges();
+	}
+	completeChanges( lsn );
+	return removed;
+    }
+
+    bool BTree::remove( boost::shared_ptr<Node> x, const Key& k ) throw( os::IoException,FileCorruptedException ) {
+	if( !x->isLeaf() ) {
+	    // case (2) above: recurse on the child that holds the first
+	    // entry with key k, after making sure it can spare a key
+	    int i = findChild( x, k );
+	    while( i < x->getKeyCount() && x->getKey(i) == k && !endsWith( x->getChild(i), k ) )
+		i++;
+	    boost::shared_ptr<Node> ci = latchNode( x->getChild( i ) );
+	    if( ci->getKeyCount() <= ci->getMinKeyCount() && x->getKeyCount() > 0 )
+		ci = fillChild( boost::shared_static_cast<InternalNode>(x), i, ci );
+
+	    // ci can spare a key, so nothing below it can change x
+	    releaseUnchanged( ci );
+	    return remove( ci, k );
+	}
+
+	// case (1) above: remove key k from leaf node
+	boost::shared_ptr<LeafNode> lx = boost::shared_static_cast<LeafNode>(x);
+
+	int i = lx->lowerBound( k );
+
+	if( i == lx->getKeyCount() || k != lx->getKey(i) )
+	    return false;
+
+	Node::Entry e = lx->removeEntry(i);
+	assert( e._key == k );
+
+	if( e._et == etOverflow )
+	    freeOverflowEntry( e );
+	else if( e._et == etExtent )
+	    freeExtentEntry( e );
+
+	lx->write(*_store);
+	return true;
     }
-  
-    bool BTree::remove( boost::shared_ptr<Node> x, int k ) throw( os::IoException,FileCorruptedException,NotImplementedException ) {
-	// search linearly for the key within the node's entry
-	int i;
-	for( i = 0; i < x->getKeyCount() && k > x->getEntry(i)._key; i++ )
-	    ;
-	
-	// see if we found the key, or passed the end
-	const Node::Entry& e = x->getEntry(i);
-	if( i < x->getKeyCount() && k == e._key ) {
-	    // key found
-
-	    if( x->isLeaf() ) {
-		// case (1) above: remove key k from leaf node
-		
-		// cast to a leaf node
-		boost::shared_ptr<LeafNode> lx = boost::shared_dynamic_cast<LeafNode>(x);
-		
-		Node::Entry e = lx->removeEntry(i);
-		assert( e._key == k );
-		
-		// TODO: handle deletion of fragments if entry contains fragments
-		
-		lx->write(_file);
-		return true;
-	    } else {
-		// cast to internal node
-		boost::shared_ptr<InternalNode> ix = boost::shared_dynamic_cast<InternalNode>(x);
-		
-		// NOTE: this may result in one more disk read that is necessary
-		// if we had implemented the check for (2a) first.  We would
-		// be able to avoid the read of z if y clearly has too many entries.
-		
-		// check for case 2c first.  see if predecessor node and successor
-		// node of k can be merged into one node that includes k as well.
-		boost::shared_ptr<Node> y = readNode( ix->getChild(i) );
-		boost::shared_ptr<Node> z = readNode( ix->getChild(i+1) );
-
-		bool mergeable = false;
-		switch( y->getNodeType() ) {
-		case ntLeafNode:
-		    mergeable = y->getKeyCount() + z->getKeyCount() + 1 <= LEAF_ENTRIES;
-		    break;
-		case ntInternalNode:
-		    mergeable = y->getKeyCount() + z->getKeyCount() + 1 <= INTERNAL_ENTRIES;
-		    break;
-		}
-
-		if( mergeable ) {
-		    // implement case (2c): merge y, z and k, then remove k from
-		    // that node recursively
-
-		    // remove k and the right child (at location i+1), which points to z,
-		    // from x
-		    std::pair<Node::Entry,BLOCKNO> peb = ix->removeEntryAndRightChild(i);
-
-		    // merge the y, k, and z into the node at y
-		    y->merge( peb.first, z );
-
-		    // TODO: z can now be put on the free block.
-
-		    z.reset();
-
-		    x->write(_file);
-		    y->write(_file);
-		    
-		    // recursively delete from y 
-		    return remove( y, k );
-
-		} else {
-		    // promote a node from the sub-tree that has the fewest elements
-		    Node::Entry replacement;
-		    
-		    if( y->getKeyCount() > z->getKeyCount() ) {
-			// implement case (2a): find and remove the maximum entry from the subtree at y.
-			// replace k with that entry.
-			replacement = removeMaximumEntry(y);
-		    } else {
-			// implement case (2b): find and remove the minimum entry from the subtree at z.
-			// replace k with that entry.
-			replacement = removeMinimumEntry(z);
-		    }
-
-		    Node::Entry e = ix->getEntry(i);
-		    assert( e._key == k );
-		
-		    // TODO: handle deletion of fragments if entry contains fragments
-			
-		    ix->setEntry( i, replacement );
-
-		    ix->write(_file);
-		    return true;
-		}
+
+    // true if the last entry under node bn has key k.  the nodes down the
+    // right edge of its subtree are latched for the operation, so they
+    // are let go of with the others it does not change.
+    bool BTree::endsWith( BLOCKNO bn, const Key& k ) throw(os::IoException,FileCorruptedException) {
+	boost::shared_ptr<Node> x = latchNode( bn );
+	while( !x->isLeaf() )
+	    x = latchNode( x->getChild( x->getKeyCount() ) );
+	int n = x->getKeyCount();
+	return n > 0 && x->getKey(n-1) == k;
+    }
+
+    // bring c_i[x] up to at least t keys, and return the node the search
+    // should descend into, which is a merged node when case (2b) applies
+    boost::shared_ptr<Node> BTree::fillChild( boost::shared_ptr<InternalNode> x, int i, boost::shared_ptr<Node> ci ) throw(os::IoException,FileCorruptedException) {
+	DBG( dout("bt.delete",2) << "Filling " << *ci << ", child " << i << " of " << *x << std::endl );
+
+	// case (2a) above: borrow from a sibling that can spare a key
+	boost::shared_ptr<Node> y;
+	if( i > 0 ) {
+	    // siblings are latched from left to right, so ci is let go while
+	    // y is latched.  nothing has changed it yet.
+	    ci->unlatch();
+	    y = latchNode( x->getChild(i-1) );
+	    ci->latch( lmExclusive );
+	    if( y->getKeyCount() > y->getMinKeyCount() ) {
+		borrowFromLeft( x, i, y, ci );
+		return ci;
 	    }
-	} else {
-	    // key not found
-	    if( x->isLeaf() ) {
-		return false;
-	    } else {
-		// case 3: child at i must contain the key, guarantee that
-		// c_i[x] has sufficient keys, then recursively remove
-		// k from ci
-		boost::shared_ptr<Node> ci = readNode( x->getChild(i) );
-
-		// determine if ci has enough keys
-
-		// (case 3a) if ci has the minimum count of keys, we
-		// should try to adjust it by stealing a node from a
-		// sibling. Look at left sibling first, then the right.
-		// if one of the siblings has more than the minimum
-		// key count, take an entry from it and move it up to x,
-		// an move a key from x down into ci
-
-		// (case 3b) if ci's siblings both have the minimum count,
-		// merge ci with a sibling and pull the key down from
-		// x into the newly created node
-		
-		// recurse on ci
-		return remove( ci, k );
+	}
+
+	boost::shared_ptr<Node> z;
+	if( i < x->getKeyCount() ) {
+	    z = latchNode( x->getChild(i+1) );
+	    if( z->getKeyCount() > z->getMinKeyCount() ) {
+		borrowFromRight( x, i, ci, z );
+		return ci;
 	    }
-	
 	}
 
-	// notreached
-	assert(false);
+	// case (2b) above: merge with a sibling, preferring the right one
+	if( z ) {
+	    mergeChildren( x, i, ci, z );
+	    return ci;
+	}
+	mergeChildren( x, i-1, y, ci );
+	return y;
     }
-    
-    Node::Entry BTree::removeMinimumEntry( boost::shared_ptr<Node> x ) throw( os::IoException,FileCorruptedException,NotImplementedException ) {
-	if( x->isLeaf() ) {
-	    // cast to a leaf node
-	    boost::shared_ptr<LeafNode> lx = boost::shared_dynamic_cast<LeafNode>(x);
-	    assert( lx->getKeyCount() >= 1 );
-	    Node::Entry e = lx->removeEntry(0);
-	    lx->write(_file);
-	    return e;
+
+    // move the last entry, or last key and child, of y into the front of
+    // its right sibling c_i[x].  the fences of both siblings move to the
+    // new separator.  ci's range grows, so it gets its new fences before
+    // it takes the key, which it may have to store with a shorter prefix.
+    void BTree::borrowFromLeft( boost::shared_ptr<InternalNode> x, int i, boost::shared_ptr<Node> y, boost::shared_ptr<Node> ci ) {
+	int blockSize = _header.getBlockSize();
+	if( ci->isLeaf() ) {
+	    boost::shared_ptr<LeafNode> ly = boost::shared_static_cast<LeafNode>(y);
+	    boost::shared_ptr<LeafNode> lc = boost::shared_static_cast<LeafNode>(ci);
+	    Node::Entry e = ly->removeEntry( ly->getKeyCount()-1 );
+	    Key key = _header.getKeyFormat().getSeparator( ly->getKey( ly->getKeyCount()-1 ), e._key );
+	    ly->setFences( ly->getLowFence(), key, blockSize );
+	    lc->setFences( key, lc->getHighFence(), blockSize );
+	    lc->insertEntry( 0, e );
+	    x->setKey( i-1, key );
 	} else {
-	    // could get into some trouble here. deletion of the minimum key may cause the
-	    // leaf node to have fewer entries than the minimum...  ultimately, it could
-	    // get down to 0 entries, which would totally screw us.
-
-	    // TODO:  implement node merging logic as above, where we protect against
-	    //        having nodes have too few entries by merging nodes as necessary.
-	    
-	    // read 1st child of x
-	    assert( x->getKeyCount() >= 1 );
-	    boost::shared_ptr<Node> z = readNode( x->getChild(0) );
-	    
-	    return removeMinimumEntry( z );
+	    boost::shared_ptr<InternalNode> iy = boost::shared_static_cast<InternalNode>(y);
+	    boost::shared_ptr<InternalNode> ic = boost::shared_static_cast<InternalNode>(ci);
+	    std::pair<Key,BLOCKNO> kc = iy->removeKeyAndRightChild( iy->getKeyCount()-1 );
+	    iy->setFences( iy->getLowFence(), kc.first, blockSize );
+	    ic->setFences( kc.first, ic->getHighFence(), blockSize );
+	    ic->insertKeyAndLeftChild( 0, x->getKey(i-1), kc.second );
+	    x->setKey( i-1, kc.first );
 	}
+
+	x->write(*_store);
+	y->write(*_store);
+	ci->write(*_store);
     }
-    
-    Node::Entry BTree::removeMaximumEntry( boost::shared_ptr<Node> x ) throw( os::IoException,FileCorruptedException,NotImplementedException ) {
-	if( x->isLeaf() ) {
-	    // cast to a leaf node
-	    boost::shared_ptr<LeafNode> lx = boost::shared_dynamic_cast<LeafNode>(x);
-	    assert( lx->getKeyCount() >= 1 );
-	    Node::Entry e = lx->removeEntry(lx->getKeyCount()-1);
-	    lx->write(_file);
-	    return e;
+
+    // move the first entry, or first key and child, of z onto the end of
+    // its left sibling c_i[x], as borrowFromLeft does
+    void BTree::borrowFromRight( boost::shared_ptr<InternalNode> x, int i, boost::shared_ptr<Node> ci, boost::shared_ptr<Node> z ) {
+	int blockSize = _header.getBlockSize();
+	if( ci->isLeaf() ) {
+	    boost::shared_ptr<LeafNode> lc = boost::shared_static_cast<LeafNode>(ci);
+	    boost::shared_ptr<LeafNode> lz = boost::shared_static_cast<LeafNode>(z);
+	    Node::Entry e = lz->removeEntry( 0 );
+	    Key key = _header.getKeyFormat().getSeparator( e._key, lz->getKey(0) );
+	    lc->setFences( lc->getLowFence(), key, blockSize );
+	    lc->insertEntry( lc->getKeyCount(), e );
+	    lz->setFences( key, lz->getHighFence(), blockSize );
+	    x->setKey( i, key );
 	} else {
-	    // could get into some trouble here. deletion of the minimum key may cause the
-	    // leaf node to have fewer entries than the minimum...  ultimately, it could
-	    // get down to 0 entries, which would totally screw us.
-
-	    // TODO:  implement node merging logic as above, where we protect against
-	    //        having nodes have too few entries by merging nodes as necessary.
-	    
-	    // read 1st child of x
-	    assert( x->getKeyCount() >= 1 );
-	    boost::shared_ptr<Node> z = readNode( x->getChild(x->getKeyCount()) );
-	    
-	    return removeMaximumEntry( z );
+	    boost::shared_ptr<InternalNode> ic = boost::shared_static_cast<InternalNode>(ci);
+	    boost::shared_ptr<InternalNode> iz = boost::shared_static_cast<InternalNode>(z);
+	    std::pair<Key,BLOCKNO> kc = iz->removeKeyAndLeftChild( 0 );
+	    ic->setFences( ic->getLowFence(), kc.first, blockSize );
+	    int n = ic->getKeyCount();
+	    ic->setKey( n, x->getKey(i) );
+	    ic->setChild( n+1, kc.second );
+	    ic->setKeyCount( n+1 );
+	    iz->setFences( kc.first, iz->getHighFence(), blockSize );
+	    x->setKey( i, kc.first );
+	}
+
+	x->write(*_store);
+	ci->write(*_store);
+	z->write(*_store);
+    }
+
+    // merge z, child i+1 of x, into its left sibling y, and free z
+    void BTree::mergeChildren( boost::shared_ptr<InternalNode> x, int i, boost::shared_ptr<Node> y, boost::shared_ptr<Node> z ) throw(os::IoException,FileCorruptedException) {
+	DBG( dout("bt.delete",2) << "Merging " << *z << " into " << *y << std::endl );
+
+	// y covers z's range as well before it takes z's keys, which it
+	// may have to store with a shorter prefix
+	y->setFences( y->getLowFence(), z->getHighFence(), _header.getBlockSize() );
+	y->merge( x->getKey(i), z );
+	x->removeKeyAndRightChild( i );
+
+	if( y->isLeaf() ) {
+	    // take z out of the leaf chain
+	    boost::shared_ptr<LeafNode> ly = boost::shared_static_cast<LeafNode>(y);
+	    BLOCKNO next = boost::shared_static_cast<LeafNode>(z)->getNext();
+	    ly->setNext( next );
+	    if( next != INVALID_BLOCK_NUMBER ) {
+		boost::shared_ptr<LeafNode> ln = boost::shared_static_cast<LeafNode>( latchNode( next ) );
+		ln->setPrev( ly->getBlockNumber() );
+		ln->write(*_store);
+	    }
+	}
+
+	x->write(*_store);
+	y->write(*_store);
+
+	// nothing refers to z any more.  it stays latched until the remove
+	// is over, so no cursor can step onto the freed block.
+	BLOCKNO bn = z->getBlockNumber();
+	z.reset();
+	freeBlock( bn );
+    }
+
+    // release the fragment clusters that hold the rest of the data of an
+    // overflow entry
+    void BTree::freeOverflowEntry( const Node::Entry& e ) throw(os::IoException,FileCorruptedException) {
+	assert( e._et == etOverflow );
+	assert( e._len > NODE_DATA_LEN );
+
+	const Node::OverflowEntryData& oed = *reinterpret_cast<const Node::OverflowEntryData*>(e._data);
+	int totallen = e._len - OVERFLOW_ENTRY_DATA_LEN;
+
+	BLOCKNO bn = oed._block;
+	FRAGNO  fn = oed._frag;
+
+	while( totallen > 0 ) {
+	    if( bn == INVALID_BLOCK_NUMBER || fn == INVALID_FRAG_NUMBER )
+		throw FileCorruptedException();
+
+	    // read the link to the next cluster before this one is released
+	    int len;
+	    BLOCKNO next_bn;
+	    FRAGNO next_fn;
+	    {
+		boost::shared_ptr<FragmentBlock> fb = readFragmentBlock( bn );
+		OverflowDataHeader& odh = fb->getFragment( fn );
+		len = odh._len;
+		next_bn = odh._next_block;
+		next_fn = odh._next_frag;
+	    }
+
+	    if( len <= 0 || len > totallen )
+		throw FileCorruptedException();
+
+	    // the cluster is as many fragments as writeOverflowData reserved
+	    // for a header and len bytes of data
+	    freeFragments( bn, fn, (len + sizeof(OverflowDataHeader) + (FRAG_SIZE-1)) / FRAG_SIZE );
+
+	    totallen -= len;
+	    bn = next_bn;
+	    fn = next_fn;
 	}
     }
 }
@@ -17,6 +17,22 @@ public:
     }
 };
 
+// at the smallest blocks, data of these lengths is kept in the node, in
+// overflow fragments and in an extent
+static const int lengths[] = { 2, 100, 600 };
+
+// insert copies more entries under each of count keys, in the given order.
+// copy j of a key has data of a length from lengths, filled with 'a'+j.
+static void insertCopies( bt::BTree& bt, const int* indices, int count, int copies ) {
+    for( int j = 0; j < copies; j++ ) {
+	int len = lengths[ j % 3 ];
+	memset( sz, 'a'+j, len-1 );
+	sz[len-1] = 0;
+	for( int i = 0; i < count; i++ )
+	    bt.insert( indices[i], sz, len );
+    }
+}
+
 int main( void ) {
     try {
 	int i, j;
@@ -24,7 +40,8 @@ int main( void ) {
 	
 	std::cout << "Opening test.dat" << std::endl;
 	bt::BTree bt;
-	bt.create( std::string( "test.dat" ) );
+	// use the smallest blocks, so 26 keys still make a tree several levels deep
+	bt.create( std::string( "test.dat" ), bt::MIN_BLOCK_SIZE );
 
 	std::vector< std::pair<int,std::string> > values;
 	values.reserve(count);
@@ -132,6 +149,69 @@ int main( void ) {
 	end = os::getTicks();
 
 	std::cout << "retrieval took " << (end-start) << "ms." << std::endl;
+
+	//
+	// test reuse of freed blocks: delete everything that is left,
+	// insert it all again, and the file must not have grown
+	//
+
+	bt::BLOCKNO blocks = bt.getBlockCount();
+
+	for( i = 0; i < count; i++ )
+	    bt.remove( i );
+	bt.dump();
+
+	for( i = 0; i < count; i++ ) {
+	    std::pair<int,std::string> data = values[ indices[i] ];
+	    bt.insert( data.first, data.second.c_str(), data.second.length()+1 );
+	}
+
+	std::cout << "blocks before=" << blocks << ", after=" << bt.getBlockCount() << std::endl;
+	if( bt.getBlockCount() > blocks )
+	    throw TestException( "freed blocks were not reused" );
+
+	//
+	// test repeated keys: each key goes in several more times, so runs
+	// of equal keys are split across leaves, then every entry is removed
+	// in the order it was inserted.  each entry's fragments or extent
+	// must be freed, so doing it all again must not grow the file.
+	//
+
+	static const int copies = 8;
+
+	std::cout << "testing repeated keys." << std::endl;
+
+	for( int pass = 0; pass < 2; pass++ ) {
+	    insertCopies( bt, indices, count, copies );
+
+	    for( i = 0; i < count; i++ ) {
+		if( !bt.search( i, sz ) || sz != values[i].second )
+		    throw TestException( "search did not find the first of repeated keys" );
+		if( !bt.remove( i ) )
+		    throw TestException( "remove failed to find expected item" );
+
+		for( j = 0; j < copies; j++ ) {
+		    if( !bt.search( i, sz ) || sz[0] != 'a'+j || (int) strlen(sz)+1 != lengths[ j % 3 ] )
+			throw TestException( "search did not find the next of repeated keys" );
+		    if( !bt.remove( i ) )
+			throw TestException( "remove failed to find repeated key" );
+		}
+
+		if( bt.search( i, sz ) || bt.remove( i ) )
+		    throw TestException( "repeated key was left after removing every copy" );
+	    }
+
+	    std::cout << "pass " << pass << ": blocks before=" << blocks << ", after=" << bt.getBlockCount() << std::endl;
+	    if( pass == 0 )
+		blocks = bt.getBlockCount();
+	    else if( bt.getBlockCount() > blocks )
+		throw TestException( "blocks of repeated keys were not freed" );
+
+	    for( i = 0; i < count; i++ ) {
+		std::pair<int,std::string> data = values[ indices[i] ];
+		bt.insert( data.first, data.second.c_str(), data.second.length()+1 );
+	    }
+	}
 	    
     } catch( std::exception& x ) {
 	std::cout << "Error: " << x.what() << std::endl;
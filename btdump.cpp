@@ -6,24 +6,15 @@
 namespace bt {
 
     void BTree::dump() {
-	dump(_root);
-	std::cout << std::endl;
-    }
-    
-    void BTree::dump( boost::shared_ptr<Node> x ) {
-	bool isLeaf = x->isLeaf();
-	int i;
-	for( i = 0; i < x->getKeyCount(); i++ ) {
-	    if( !isLeaf ) {
-		boost::shared_ptr<Node> c = readNode( x->getChild(i) );
-		dump(c);
-	    }
-	    std::cout << x->getEntry(i)._key << ":" << x->getEntry(i)._data << " ";
-	}
-	if( !isLeaf ) {
-	    boost::shared_ptr<Node> c = readNode( x->getChild(i) );
-	    dump(c);
+	// walk the leaf chain in key order
+	Cursor c( *this );
+	std::vector<char> data;
+	for( bool ok = c.first(); ok; ok = c.next() ) {
+	    data.resize( c.getLength()+1 );
+	    c.getData( &data[0] );
+	    std::cout << c.getKey() << ":" << &data[0] << " ";
 	}
+	std::cout << std::endl;
     }
     
 }
@@ -0,0 +1,203 @@
+#include "stdinc.h"
+#include "os.h"
+#include "dbg.h"
+#include "bt.h"
+
+/*
+
+  Values too large for a single cluster of fragments are stored in an
+  extent, a run of whole consecutive blocks, and the entry records only
+  the first block and the length of the run.  Each value is then written
+  and read back with one sequential I/O, instead of one per cluster.
+
+  Extents never pass through the block store.  Their blocks are only
+  ever reused by other extents, so the store never holds a copy of one.
+  With a log, what is written to an extent is logged like a block, but
+  held back from the file until its operation commits, since the blocks
+  it lands in may still be in use in the tree as it was before.
+
+  Freed extents are kept on their own list, starting at the header's
+  _free_extent, with the list links in the first block of each extent.
+  A freed extent is merged with the free extents right before and
+  after it, so free space does not break up into runs too short to
+  reuse.  An extent is allocated from the first free extent that is
+  large enough.  A larger one gives up its tail, so its first block and its
+  place on the list stay where they are.  Only when no free extent
+  fits is the file extended.
+
+*/
+
+namespace bt {
+
+    // read and check the first block of the free extent at bn
+    void BTree::readFreeExtent( BLOCKNO bn, FreeExtent& fe ) throw(os::IoException,FileCorruptedException) {
+	readFile( blockOffset( bn, _header.getBlockSize() ), &fe, sizeof(fe) );
+
+	if( fe._magic != FREE_EXTENT_MAGIC_VALUE || fe._blockno != bn )
+	    throw FileCorruptedException();
+
+	if( fe._blocks <= 0 || bn + fe._blocks > _header.getBlockCount() )
+	    throw FileCorruptedException();
+    }
+
+    void BTree::writeFreeExtent( const FreeExtent& fe ) throw(os::IoException) {
+	os::File::IoVec iov;
+	iov._data = &fe;
+	iov._len = sizeof(fe);
+	writeFile( blockOffset( fe._blockno, _header.getBlockSize() ), &iov, 1 );
+    }
+
+    // values longer than this do not fit in one cluster of fragments
+    int BTree::getExtentThreshold() const {
+	return OVERFLOW_ENTRY_DATA_LEN + _header.getFragsPerBlock() * FRAG_SIZE - sizeof(OverflowDataHeader);
+    }
+
+    BLOCKNO BTree::allocateExtent( int blocks ) throw(os::IoException,FileCorruptedException) {
+	assert( blocks > 0 );
+
+	// first fit.  a list can never be longer than the file, so a longer
+	// walk means the list is broken.
+	BLOCKNO prev = INVALID_BLOCK_NUMBER;
+	FreeExtent pfe;
+	BLOCKNO bn = _header.getFreeExtent();
+	for( BLOCKNO n = 0; bn != INVALID_BLOCK_NUMBER; n++ ) {
+	    if( n >= _header.getBlockCount() )
+		throw FileCorruptedException();
+
+	    FreeExtent fe;
+	    readFreeExtent( bn, fe );
+
+	    if( fe._blocks > blocks ) {
+		// take the tail of the free extent
+		fe._blocks -= blocks;
+		writeFreeExtent( fe );
+		DBG( dout("bt.extent",2) << "Reusing " << blocks << " blocks at " << bn + fe._blocks << std::endl );
+		return bn + fe._blocks;
+	    }
+
+	    if( fe._blocks == blocks ) {
+		// take the whole free extent off the list
+		if( prev == INVALID_BLOCK_NUMBER ) {
+		    _header.setFreeExtent( fe._next_block );
+		} else {
+		    pfe._next_block = fe._next_block;
+		    writeFreeExtent( pfe );
+		}
+		DBG( dout("bt.extent",2) << "Reusing " << blocks << " blocks at " << bn << std::endl );
+		return bn;
+	    }
+
+	    prev = bn;
+	    pfe = fe;
+	    bn = fe._next_block;
+	}
+
+	// nothing fits, so extend the file.  block numbers are handed out
+	// in order, so the run is consecutive.
+	bn = _header.allocateBlockNumber();
+	for( int i = 1; i < blocks; i++ )
+	    _header.allocateBlockNumber();
+
+	DBG( dout("bt.extent",2) << "Allocated " << blocks << " blocks at " << bn << std::endl );
+	return bn;
+    }
+
+    void BTree::freeExtent( BLOCKNO bn, int blocks ) throw(os::IoException,FileCorruptedException) {
+	DBG( dout("bt.extent",2) << "Freeing " << blocks << " blocks at " << bn << std::endl );
+
+	// take the free extents that end where this one starts, or start
+	// where it ends, off the list and absorb them
+	BLOCKNO start = bn;
+	BLOCKNO end = bn + blocks;
+	BLOCKNO prev = INVALID_BLOCK_NUMBER;
+	FreeExtent pfe;
+	BLOCKNO cur = _header.getFreeExtent();
+	for( BLOCKNO n = 0; cur != INVALID_BLOCK_NUMBER; n++ ) {
+	    if( n >= _header.getBlockCount() )
+		throw FileCorruptedException();
+
+	    FreeExtent fe;
+	    readFreeExtent( cur, fe );
+	    BLOCKNO next = fe._next_block;
+
+	    if( cur + fe._blocks == start || cur == end ) {
+		if( prev == INVALID_BLOCK_NUMBER ) {
+		    _header.setFreeExtent( next );
+		} else {
+		    pfe._next_block = next;
+		    writeFreeExtent( pfe );
+		}
+		if( cur < bn )
+		    bn = cur;
+		blocks += fe._blocks;
+	    } else {
+		prev = cur;
+		pfe = fe;
+	    }
+	    cur = next;
+	}
+
+	FreeExtent fe;
+	fe._magic = FREE_EXTENT_MAGIC_VALUE;
+	fe._blockno = bn;
+	fe._next_block = _header.getFreeExtent();
+	fe._blocks = blocks;
+	writeFreeExtent( fe );
+
+	_header.setFreeExtent( bn );
+    }
+
+    void BTree::writeExtentEntry( Node::Entry& e, const Key& key, const char* data, int len ) throw(os::IoException,FileCorruptedException) {
+	assert( len > getExtentThreshold() );
+
+	int blockSize = _header.getBlockSize();
+	int blocks = (len + blockSize-1) / blockSize;
+	BLOCKNO bn = allocateExtent( blocks );
+
+	// the extent is written out to the end of its last block, so the
+	// file always covers every block that is allocated
+	std::vector<char> pad( blocks*blockSize - len + 1, 0 );
+	os::File::IoVec iov[2];
+	iov[0]._data = data;
+	iov[0]._len = len;
+	iov[1]._data = &pad[0];
+	iov[1]._len = pad.size() - 1;
+	writeFile( blockOffset( bn, blockSize ), iov, iov[1]._len > 0 ? 2 : 1 );
+
+	// the entry only describes where the extent is
+	e._key = key;
+	e._et  = etExtent;
+	e._len = len;
+	os::mem::clear( e._data, NODE_DATA_LEN );
+
+	Node::ExtentEntryData& eed = *reinterpret_cast<Node::ExtentEntryData*>(e._data);
+	eed._block = bn;
+	eed._blocks = blocks;
+    }
+
+    void BTree::readExtentEntry( const Node::Entry& e, char* d ) throw(os::IoException,FileCorruptedException) {
+	assert( e._et == etExtent );
+
+	int blockSize = _header.getBlockSize();
+	const Node::ExtentEntryData& eed = *reinterpret_cast<const Node::ExtentEntryData*>(e._data);
+
+	if( eed._block <= 0 || eed._blocks <= 0 || eed._block + eed._blocks > _header.getBlockCount() )
+	    throw FileCorruptedException();
+
+	if( e._len < 0 || e._len > eed._blocks * blockSize )
+	    throw FileCorruptedException();
+
+	readFile( blockOffset( eed._block, blockSize ), d, e._len );
+    }
+
+    void BTree::freeExtentEntry( const Node::Entry& e ) throw(os::IoException,FileCorruptedException) {
+	assert( e._et == etExtent );
+
+	const Node::ExtentEntryData& eed = *reinterpret_cast<const Node::ExtentEntryData*>(e._data);
+
+	if( eed._block <= 0 || eed._blocks <= 0 || eed._block + eed._blocks > _header.getBlockCount() )
+	    throw FileCorruptedException();
+
+	freeExtent( eed._block, eed._blocks );
+    }
+}
@@ -3,63 +3,93 @@
 #include "dbg.h"
 #include "bt.h"
 
-#if !( (MAX_FRAGS_PER_BLOCK+1)*FRAG_SIZE == BLOCK_SIZE )
-#error FRAG_SIZE does not evenly divide BLOCK_SIZE
-#endif
-
 namespace bt {
-    
-    FragmentBlock::FragmentBlock( BLOCKNO bn ) {
-	assert( (MAX_FRAGS_PER_BLOCK+1)*FRAG_SIZE == BLOCK_SIZE );
-	assert( sizeof(Data) == BLOCK_SIZE );
-	_data = boost::shared_ptr<Data>( new Data( bn ) );
+
+    static const int MAP_WORD_BITS = 32;
+
+    static inline int getMapWords( int frags ) {
+	return (frags + MAP_WORD_BITS-1) / MAP_WORD_BITS;
     }
 
-    FragmentBlock::FragmentBlock( boost::shared_ptr<Data> pData ) {
-	assert( sizeof(Data) == BLOCK_SIZE );
-	_data = pData;
+    // index of the first bit at or after from that is set, or clear when
+    // set is false, or n if there is none before bit n.  whole words are
+    // skipped at a time, and the bit within a word is found with a count
+    // of trailing zeros.
+    static int findBit( const unsigned int* map, int from, int n, bool set ) {
+	while( from < n ) {
+	    unsigned int w = map[ from / MAP_WORD_BITS ];
+	    if( !set )
+		w = ~w;
+	    w >>= from % MAP_WORD_BITS;
+	    if( w != 0 )
+		return std::min( n, from + os::bits::countTrailingZeros( w ) );
+	    from = (from / MAP_WORD_BITS + 1) * MAP_WORD_BITS;
+	}
+	return n;
     }
 
-    FragmentBlock::Data::Data() {
+    // set or clear count bits starting at bit from, a word at a time
+    static void setBits( unsigned int* map, int from, int count, bool set ) {
+	while( count > 0 ) {
+	    int bit = from % MAP_WORD_BITS;
+	    int len = std::min( count, MAP_WORD_BITS - bit );
+	    unsigned int mask = (len == MAP_WORD_BITS) ? ~0u : ((1u << len) - 1) << bit;
+	    if( set ) {
+		assert( (map[ from / MAP_WORD_BITS ] & mask) == 0 );
+		map[ from / MAP_WORD_BITS ] |= mask;
+	    } else {
+		assert( (map[ from / MAP_WORD_BITS ] & mask) == mask );
+		map[ from / MAP_WORD_BITS ] &= ~mask;
+	    }
+	    from += len;
+	    count -= len;
+	}
     }
     
-    FragmentBlock::Data::Data( BLOCKNO bn ) {
-	_magic = FRAGMENT_MAGIC_VALUE;
-	_blockno = bn;
-	_next_block = INVALID_BLOCK_NUMBER;
-	for( int i = 0; i < MAX_FRAGS_PER_BLOCK; i++ ) {
-	    _used[i] = false;
-	    os::mem::clear( _frag + i, sizeof(Fragment) );
-	}
-	
-	os::mem::clear( _padding, sizeof(_padding) );
+    FragmentBlock::FragmentBlock( BlockStore* store, BLOCKNO bn, Data* pData ) {
+	_data = pData;
+	_store = store;
+	_pinned = bn;
     }
 
-    void* FragmentBlock::Data::operator new( unsigned int len ) {
-	assert( len == BLOCK_SIZE );
-	return new char[len];
+    FragmentBlock::~FragmentBlock() {
+	_store->unpin( _pinned );
     }
-    
-    void* FragmentBlock::Data::operator new( unsigned int len, char* buf ) {
-	// len is ignored.
-	return buf;
+
+    int FragmentBlock::getHeaderFragments( int frags ) {
+	// the fixed header plus the used bitmap, rounded up to a whole
+	// number of fragments
+	return (sizeof(Data) + getMapWords(frags)*sizeof(unsigned int) + FRAG_SIZE-1) / FRAG_SIZE;
     }
 
-    void FragmentBlock::Data::operator delete( void* pv ) {
-	delete[] reinterpret_cast<char*>(pv);
+    int FragmentBlock::getCapacity( int blockSize ) {
+	assert( blockSize % FRAG_SIZE == 0 );
+	int frags = blockSize / FRAG_SIZE;
+	while( getHeaderFragments(frags) + frags > blockSize / FRAG_SIZE )
+	    frags--;
+	return frags;
     }
-    
-    void FragmentBlock::Data::operator delete( void* pv, char* buf ) {
-	assert( pv == (void*) buf );
-	delete[] reinterpret_cast<char*>(pv);
+
+    FragmentBlock::Data* FragmentBlock::format( char* buf, BLOCKNO bn, int blockSize ) {
+	os::mem::clear( buf, blockSize );
+	return new(buf) Data( bn, getCapacity(blockSize) );
+    }
+
+    FragmentBlock::Data::Data() {
     }
-	
     
-    void FragmentBlock::write( os::File file ) throw(os::IoException) {
-	DBG( dout("bt",2) << "Writing " << *this << " to disk" << std::endl );
-	os::File::POS fp = _data->getBlockNumber() * (os::File::POS) BLOCK_SIZE;
-	file.seek( fp, os::File::SeekAbsolute );
-	file.write( _data.get(), BLOCK_SIZE );
+    FragmentBlock::Data::Data( BLOCKNO bn, int frags ) {
+	_magic = FRAGMENT_MAGIC_VALUE;
+	_blockno = bn;
+	_next_block = INVALID_BLOCK_NUMBER;
+	_frags = frags;
+	for( int i = 0; i < getMapWords(_frags); i++ )
+	    usedMap()[i] = 0;
+    }
+
+    void FragmentBlock::write( BlockStore& store ) {
+	DBG( dout("bt",2) << "Marking " << *this << " dirty" << std::endl );
+	store.markDirty( _data->getBlockNumber() );
     }
 
 
@@ -71,10 +101,8 @@ namespace bt {
 	    throw FragmentReservationException();
 	}
 
-	for( int i = 0; i < count; i++ ) {
-	    assert( psl.first + i < MAX_FRAGS_PER_BLOCK );
-	    _used[ psl.first + i ] = true;
-	}
+	assert( psl.first + count <= _frags );
+	setBits( usedMap(), psl.first, count, true );
 
 	return psl.first;
     }
@@ -82,20 +110,30 @@ namespace bt {
     FRAGNO FragmentBlock::reserveFragments( int count ) {
 	return _data->reserveFragments(count);
     }
+
+    void FragmentBlock::Data::releaseFragments( FRAGNO fn, int count ) {
+	assert( fn >= 0 && fn + count <= _frags );
+	setBits( usedMap(), fn, count, false );
+    }
+
+    void FragmentBlock::releaseFragments( FRAGNO fn, int count ) {
+	_data->releaseFragments(fn, count);
+    }
     
     std::pair<FRAGNO,int> FragmentBlock::Data::getMaxFragmentCluster() {
-	std::pair<FRAGNO,int> psl(INVALID_BLOCK_NUMBER,0);
-
-	for( int start = 0; start + psl.second < MAX_FRAGS_PER_BLOCK; start++ ) {
-	    if( _used[start] )
-		continue;
-	    int end;
-	    for( end = start+1; _used[end] == false && end < MAX_FRAGS_PER_BLOCK; end++ )
-		;
+	std::pair<FRAGNO,int> psl(INVALID_FRAG_NUMBER,0);
+	const unsigned int* map = usedMap();
+
+	// jump from each run of free fragments to the next, stopping once
+	// no run that is left could be longer than the longest so far
+	int start = findBit( map, 0, _frags, false );
+	while( start + psl.second < _frags ) {
+	    int end = findBit( map, start, _frags, true );
 	    if( end - start > psl.second ) {
 		psl.first = start;
 		psl.second = end - start;
 	    }
+	    start = findBit( map, end, _frags, false );
 	}
 
 	return psl;
@@ -6,28 +6,113 @@
 namespace bt {
 
     BTree::Header::Header() {
-	assert( sizeof(Data) == BLOCK_SIZE );
-	_data = boost::shared_ptr<Data>( new Data() );
+	_frags = 0;
+	_dirty = false;
     }
-    
+
+    void BTree::Header::format( int blockSize, const KeyFormat& kf ) throw(InvalidBlockSizeException,InvalidKeyFormatException) {
+	if( !isValidBlockSize( blockSize ) )
+	    throw InvalidBlockSizeException();
+
+	// a full node must split into two nodes that each keep at least one
+	// key
+	if( !kf.isValid() || InternalNode::getCapacity( blockSize, kf ) < 3 || LeafNode::getCapacity( blockSize, kf ) < 3 )
+	    throw InvalidKeyFormatException();
+
+	_block.assign( blockSize, 0 );
+	_frags = FragmentBlock::getCapacity( blockSize );
+	_keyFormat = kf;
+	assert( sizeof(Data) + _frags*sizeof(BLOCKNO) <= (size_t) blockSize );
+	new(&_block[0]) Data( blockSize, kf );
+	for( int i = 0; i < _frags; i++ )
+	    getData()->fragList()[i] = INVALID_BLOCK_NUMBER;
+	_dirty = true;
+    }
+
     BLOCKNO BTree::Header::allocateBlockNumber() {
-	return _data->_blocks++;
+	_dirty = true;
+	return getData()->_blocks++;
+    }
+
+    void BTree::Header::read( os::File f ) throw(os::IoException,FileCorruptedException) {
+	DBG( dout("bt",2) << "Reading header from disk" << std::endl );
+
+	// read the fixed part of the header first, to learn the block size
+	Data d( MIN_BLOCK_SIZE, KeyFormat() );
+	if( f.getSize() < (os::File::POS) sizeof(Data) )
+	    throw FileCorruptedException();
+
+	f.readAt( 0, &d, sizeof(Data) );
+
+	if( d._magic != HEADER_MAGIC_VALUE )
+	    throw FileCorruptedException();
+
+	if( d._blockno != 0 )
+	    throw FileCorruptedException();
+
+	if( d._version != FILE_FORMAT_VERSION || !isValidBlockSize( d._block_size ) )
+	    throw FileCorruptedException();
+
+	if( d._frag_size != FRAG_SIZE || d._node_data_len != NODE_DATA_LEN )
+	    throw FileCorruptedException();
+
+	// the key format must be one format() accepts
+	KeyFormat kf( (KEYTYPE) d._key_type, d._key_len );
+	if( !kf.isValid() || kf.getLength() != d._key_len )
+	    throw FileCorruptedException();
+	if( InternalNode::getCapacity( d._block_size, kf ) < 3 || LeafNode::getCapacity( d._block_size, kf ) < 3 )
+	    throw FileCorruptedException();
+
+	// the header and the root are always allocated
+	if( d._blocks < 2 )
+	    throw FileCorruptedException();
+
+	if( d._root <= 0 || d._root >= d._blocks )
+	    throw FileCorruptedException();
+
+	if( d._free_block != INVALID_BLOCK_NUMBER && (d._free_block <= 0 || d._free_block >= d._blocks) )
+	    throw FileCorruptedException();
+
+	if( d._free_extent != INVALID_BLOCK_NUMBER && (d._free_extent <= 0 || d._free_extent >= d._blocks) )
+	    throw FileCorruptedException();
+
+	if( f.getSize() < (os::File::POS) d._block_size )
+	    throw FileCorruptedException();
+
+	// then the whole block, for the fragment lists
+	_block.resize( d._block_size );
+	_frags = FragmentBlock::getCapacity( d._block_size );
+	_keyFormat = kf;
+	f.readAt( 0, &_block[0], d._block_size );
+	_dirty = false;
     }
 
     void BTree::Header::write( os::File f ) throw(os::IoException) {
 	DBG( dout("bt",2) << "Writing header to disk" << std::endl );
 	os::File::POS fp = 0;
-	f.seek( fp, os::File::SeekAbsolute );
-	f.write( _data.get(), BLOCK_SIZE );
+	f.writeAt( fp, &_block[0], _block.size() );
+	_dirty = false;
     }
-    
-    BTree::Header::Data::Data() {
+
+    void BTree::Header::log( Log& log ) {
+	DBG( dout("bt",2) << "Logging header" << std::endl );
+	log.append( 0, &_block[0], _block.size() );
+	_dirty = false;
+    }
+
+    BTree::Header::Data::Data( int blockSize, const KeyFormat& kf ) {
 	_magic = HEADER_MAGIC_VALUE;
+	_blockno = 0;
+	_version = FILE_FORMAT_VERSION;
+	_block_size = blockSize;
+	_frag_size = FRAG_SIZE;
+	_node_data_len = NODE_DATA_LEN;
+	_key_type = kf.getType();
+	_key_len = kf.getLength();
 	_blocks = 0;
 	_free_block = INVALID_BLOCK_NUMBER;
-	for( int i = 0; i < MAX_FRAGS_PER_BLOCK; i++ )
-	    _frag_list[i] = INVALID_BLOCK_NUMBER;
-	os::mem::clear( _padding, sizeof(_padding) );
+	_free_extent = INVALID_BLOCK_NUMBER;
+	_root = INVALID_BLOCK_NUMBER;
     }
 }
 
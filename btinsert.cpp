@@ -5,108 +5,141 @@
 
 namespace bt {
 
-    void BTree::insert( int key, const char* data, int len ) throw(os::IoException,FileCorruptedException) {
-	DBG( dout("bt.insert",1) << "Inserting key " << key << " data length = " << len << std::endl );
-	
-	boost::shared_ptr<Node> r = _root;
-
-	// determine if data can be inserted within a node, or if
-	// it needs to overflow;
-	Node::Entry e;
-
-	if( len <= NODE_DATA_LEN ) {
-	    e.set( key, etComplete, data, len ) ;
-	} else {
-	    writeOverflowEntry( e, key, data, len );
-	}
+    void BTree::insert( const Key& given, const char* data, int len ) throw(os::IoException,FileCorruptedException,KeyTypeException) {
+	DBG( dout("bt.insert",1) << "Inserting key " << given << " data length = " << len << std::endl );
+
+	if( _readOnly )
+	    throw os::IoException( "btree is open read-only" );
+	Key wide;
+	const Key& key = checkKey( given, wide );
+
+	Log::LSN lsn;
+	{
+	    Writer w( *this );
+
+	    // determine if data can be inserted within a node, or if
+	    // it needs to overflow;
+	    Node::Entry e;
+
+	    if( len <= NODE_DATA_LEN ) {
+		e.set( key, etComplete, data, len ) ;
+	    } else if( len <= getExtentThreshold() ) {
+		writeOverflowEntry( e, key, data, len );
+	    } else {
+		writeExtentEntry( e, key, data, len );
+	    }
 
-	( key, data );
-	
-	if( r->isFull() ) {
+	    boost::shared_ptr<Node> r = latchRoot( lmExclusive );
+	    if( r->isFull() ) {
 
-	    boost::shared_ptr<InternalNode> s = boost::shared_dynamic_cast<InternalNode>( allocateNode( ntInternalNode, _header.allocateBlockNumber() ) );
-	    _root = s;
-	    s->setChild(0,r);
+		boost::shared_ptr<InternalNode> s = boost::shared_static_cast<InternalNode>( latchNewNode( ntInternalNode ) );
+		_header.setRoot( s->getBlockNumber() );
+		s->setChild(0,r);
 
-	    splitChild( s, 0, r );
-	    insertNonFull( s, e );
+		splitChild( s, 0, r );
+		insertNonFull( s, e );
+	    } else {
+		insertNonFull( r, e );
+	    }
 
-	    // don't need to write header here since splitChild writes header changes
-	} else {
-	    insertNonFull( r, e );
+	    // commit every block this insert dirtied, and the header once
+	    // if it changed
+	    lsn = commitChanges();
 	}
+	completeChanges( lsn );
     }
 
-    void BTree::splitChild( boost::shared_ptr<InternalNode> x, int i, boost::shared_ptr<Node> y ) throw(os::IoException) {
+    void BTree::splitChild( boost::shared_ptr<InternalNode> x, int i, boost::shared_ptr<Node> y ) throw(os::IoException,FileCorruptedException) {
 	DBG( dout("bt.insert",1) << "Splitting y=" << *y << ", child of x=" << *x << std::endl );
 
-	boost::shared_ptr<Node> z( allocateNode( y->getNodeType(), _header.allocateBlockNumber() ) );
-	int nz, ny, j;
-
-	ny = y->getKeyCount() / 2;
-	nz = y->getKeyCount() - ny - 1;
+	boost::shared_ptr<Node> z( latchNewNode( y->getNodeType() ) );
+	int blockSize = _header.getBlockSize();
+	int nz, ny;
+	Key key;
+
+	if( y->isLeaf() ) {
+	    boost::shared_ptr<LeafNode> ly = boost::shared_static_cast<LeafNode>( y );
+	    boost::shared_ptr<LeafNode> lz = boost::shared_static_cast<LeafNode>( z );
+
+	    // the upper half of the entries move to z.  the separator in x
+	    // is the shortest key that still sorts after every entry left
+	    // in y, which is often only the start of the first key in z.
+	    ny = (y->getKeyCount() + 1) / 2;
+	    nz = y->getKeyCount() - ny;
+
+	    key = _header.getKeyFormat().getSeparator( ly->getKey(ny-1), ly->getKey(ny) );
+	    z->setFences( key, y->getHighFence(), blockSize );
+	    ly->copyTo( ny, nz, *lz, 0 );
+
+	    // link z into the leaf chain, between y and its right sibling
+	    lz->setPrev( ly->getBlockNumber() );
+	    lz->setNext( ly->getNext() );
+	    if( ly->getNext() != INVALID_BLOCK_NUMBER ) {
+		boost::shared_ptr<Node> n = latchNode( ly->getNext() );
+		if( !n->isLeaf() )
+		    throw FileCorruptedException();
+		boost::shared_ptr<LeafNode> next = boost::shared_static_cast<LeafNode>( n );
+		next->setPrev( lz->getBlockNumber() );
+		next->write(*_store);
+	    }
+	    ly->setNext( lz->getBlockNumber() );
+	} else {
+	    boost::shared_ptr<InternalNode> iy = boost::shared_static_cast<InternalNode>( y );
+	    boost::shared_ptr<InternalNode> iz = boost::shared_static_cast<InternalNode>( z );
 
-	assert( nz + ny + 1 == y->getKeyCount() );
+	    // the median key moves up into x, and the keys and children
+	    // above it move to z
+	    ny = y->getKeyCount() / 2;
+	    nz = y->getKeyCount() - ny - 1;
 
-	bool isLeaf = (y->getNodeType() == ntLeafNode );
-	for( j = 0; j < nz; j++ ) 
-	    z->setEntry( j, y->getEntry( ny+j+1 ) ) ;
-	
-	if( !isLeaf ) 
-	    for( j = 0; j < nz+1; j++ ) 
-		z->setChild( j, y->getChild( ny+j+1 ) );
+	    key = iy->getKey( ny );
+	    z->setFences( key, y->getHighFence(), blockSize );
+	    iy->copyTo( ny+1, nz, *iz, 0 );
+	}
 
 	z->setKeyCount( nz );
 	y->setKeyCount( ny );
 
-	for( j = x->getKeyCount(); j > i; j-- )
-	    x->setChild( j+1, x->getChild( j ) );
-	x->setChild(i+1, z );
-	
-	for( j = x->getKeyCount()-1; j >= i; j-- )
-	    x->setEntry( j+1, x->getEntry(j) );
-	x->setEntry(i, y->getEntry(ny) );
+	// z covers the keys from the separator on, and y the keys before it,
+	// so each may share a longer prefix than y did
+	y->setFences( y->getLowFence(), key, blockSize );
 
-	x->setKeyCount( x->getKeyCount() + 1 );
+	// z goes in to the right of y, with the separator between them
+	x->insertKeyAndRightChild( i, key, z->getBlockNumber() );
 
-	x->write(_file);
-	z->write(_file);
-	y->write(_file);
-	_header.write(_file);
+	x->write(*_store);
+	z->write(*_store);
+	y->write(*_store);
     }
 
     void BTree::insertNonFull( boost::shared_ptr<Node> x, Node::Entry& e ) throw(os::IoException,FileCorruptedException) {
-	int i = x->getKeyCount()-1;
-	bool isLeaf = (x->getNodeType() == ntLeafNode );
-
-	if( isLeaf ) {
-	    while( i >= 0 && e._key < x->getEntry(i)._key ) {
-		x->setEntry(i+1,x->getEntry(i));
-		i--;
-	    }
-	    x->setEntry(i+1,e);
-	    x->setKeyCount( x->getKeyCount() + 1 );
-	    x->write( _file );
+	if( x->isLeaf() ) {
+	    // entries with equal keys stay in the order they were inserted
+	    boost::shared_ptr<LeafNode> lx = boost::shared_static_cast<LeafNode>( x );
+	    lx->insertEntry( lx->upperBound( e._key ), e );
+	    x->write( *_store );
 	} else {
-	    while( i >= 0 && e._key < x->getEntry(i)._key ) {
-		i--;
-	    }
-	    i++;
-	    boost::shared_ptr<Node> n = readNode( x->getChild(i) );
+	    // the entry goes after any with an equal key, so under the last
+	    // child that covers it
+	    int i = findLastChild( x, e._key );
+	    boost::shared_ptr<Node> n = latchNode( x->getChild(i) );
 	    if( n->isFull() ) {
-		boost::shared_ptr<InternalNode> xi = boost::shared_dynamic_cast<InternalNode>(x);
+		boost::shared_ptr<InternalNode> xi = boost::shared_static_cast<InternalNode>(x);
 		splitChild( xi, i, n );
-		if( e._key > xi->getEntry(i)._key ) {
+		if( e._key >= xi->getKey(i) ) {
 		    i++;
-		    n = readNode( xi->getChild(i) );
+		    n = latchNode( xi->getChild(i) );
 		}
 	    }
+
+	    // n is not full, so nothing below it can change x
+	    releaseUnchanged( n );
 	    insertNonFull( n, e );
 	}
     }
 
 
-    void BTree::writeOverflowEntry( Node::Entry& e, int key, const char* data, int len ) {
+    void BTree::writeOverflowEntry( Node::Entry& e, const Key& key, const char* data, int len ) {
 	assert( len > NODE_DATA_LEN );
 	assert( NODE_DATA_LEN == sizeof(Node::OverflowEntryData) );
 
@@ -137,9 +170,9 @@ namespace bt {
 	// save the remaining data into an overflow block.  the blocknumber and
 	// frag number where the data is saved is returned in bn and fn, which
 	// are then set into the oed structure through the bn and fn references
-	int written = writeOverflowData( bn, fn, data, len );
+	len -= writeOverflowData( bn, fn, data, len );
 
-	assert( len == written );
+	assert( len == 0 );
     }
 
 
@@ -182,12 +215,13 @@ namespace bt {
 
 	// if more data to write, then we must chain to another overflow block
 	if( dataleft > 0 ) {
-	    dataleft = writeOverflowData( odh._next_block, odh._next_frag, data+datalen, dataleft );
+	    dataleft -= writeOverflowData( odh._next_block, odh._next_frag, data+datalen, dataleft );
+	    assert( dataleft == 0 );
 	}
 	
 	// save the fragment block to the file
-	fb->write(_file);
+	fb->write(*_store);
 
-	return datalen + dataleft;
+	return len - dataleft;
     }
 }
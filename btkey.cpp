@@ -0,0 +1,190 @@
+#include "stdinc.h"
+#include "os.h"
+#include "dbg.h"
+#include "bt.h"
+
+namespace bt {
+
+    //-----------------------------------------------------------------------------
+    // Key class
+    //
+
+    Key::Key( int k ) {
+	unsigned int u = (unsigned int) k ^ 0x80000000u;
+	for( int i = sizeof(u)-1; i >= 0; i-- ) {
+	    _bytes[i] = (unsigned char) u;
+	    u >>= 8;
+	}
+	_type = ktInt;
+	_len = sizeof(u);
+    }
+
+    Key::Key( int64_t k ) {
+	uint64_t u = (uint64_t) k ^ (((uint64_t) 1) << 63);
+	for( int i = sizeof(u)-1; i >= 0; i-- ) {
+	    _bytes[i] = (unsigned char) u;
+	    u >>= 8;
+	}
+	_type = ktInt64;
+	_len = sizeof(u);
+    }
+
+    Key::Key( const char* sz ) throw(KeyTypeException) {
+	_type = ktBytes;
+	_len = 0;
+	while( sz[_len] != 0 ) {
+	    if( _len == MAX_KEY_LEN )
+		throw KeyTypeException();
+	    _bytes[_len] = sz[_len];
+	    _len++;
+	}
+    }
+
+    Key::Key( const std::string& s ) throw(KeyTypeException) {
+	if( s.length() > (size_t) MAX_KEY_LEN )
+	    throw KeyTypeException();
+	_type = ktBytes;
+	_len = s.length();
+	os::mem::copy( _bytes, s.data(), _len );
+    }
+
+    Key::Key( const void* data, int len ) throw(KeyTypeException) {
+	if( len < 0 || len > MAX_KEY_LEN )
+	    throw KeyTypeException();
+	_type = ktBytes;
+	_len = len;
+	os::mem::copy( _bytes, data, len );
+    }
+
+    int Key::toInt() const {
+	assert( _len == sizeof(int) );
+	unsigned int u = 0;
+	for( int i = 0; i < (int) sizeof(u); i++ )
+	    u = (u << 8) | _bytes[i];
+	return (int) (u ^ 0x80000000u);
+    }
+
+    int64_t Key::toInt64() const {
+	assert( _len == sizeof(int64_t) );
+	uint64_t u = 0;
+	for( int i = 0; i < (int) sizeof(u); i++ )
+	    u = (u << 8) | _bytes[i];
+	return (int64_t) (u ^ (((uint64_t) 1) << 63));
+    }
+
+    std::string Key::toString() const {
+	return std::string( reinterpret_cast<const char*>( _bytes ), _len );
+    }
+
+    int Key::compare( const Key& k ) const {
+	int c = os::mem::compare( _bytes, k._bytes, std::min( _len, k._len ) );
+	if( c != 0 )
+	    return c;
+	return _len - k._len;
+    }
+
+    int Key::getCommonPrefix( const Key& k ) const {
+	int n = std::min( _len, k._len );
+	int i = 0;
+	while( i < n && _bytes[i] == k._bytes[i] )
+	    i++;
+	return i;
+    }
+
+    // an integer key is shown as its value.  a byte string that is all
+    // printable is shown as it is, any other in hex.
+    std::ostream& operator << ( std::ostream& os, const Key& k ) {
+	switch( k.getType() ) {
+	case ktInt:
+	    return os << k.toInt();
+	case ktInt64:
+	    return os << k.toInt64();
+	default:
+	    break;
+	}
+
+	int i;
+	for( i = 0; i < k.getLength(); i++ ) {
+	    if( !isprint( k.getBytes()[i] ) )
+		break;
+	}
+	if( i == k.getLength() )
+	    return os << k.toString();
+
+	std::ios::fmtflags flags = os.flags();
+	os << "0x" << std::hex << std::setfill('0');
+	for( i = 0; i < k.getLength(); i++ )
+	    os << std::setw(2) << (int) k.getBytes()[i];
+	os.flags( flags );
+	return os << std::setfill(' ');
+    }
+
+
+    //-----------------------------------------------------------------------------
+    // KeyFormat class
+    //
+
+    KeyFormat::KeyFormat( KEYTYPE kt, int len ) {
+	_type = kt;
+	switch( kt ) {
+	case ktInt:
+	    _len = sizeof(int);
+	    break;
+	case ktInt64:
+	    _len = sizeof(int64_t);
+	    break;
+	default:
+	    _len = len;
+	    break;
+	}
+    }
+
+    bool KeyFormat::isValid() const {
+	switch( _type ) {
+	case ktInt:
+	case ktInt64:
+	    return true;
+	case ktBytes:
+	    return _len > 0 && _len <= MAX_KEY_LEN;
+	default:
+	    return false;
+	}
+    }
+
+    bool KeyFormat::fits( const Key& k ) const {
+	if( _type == ktBytes )
+	    return k.getLength() <= _len;
+	return k.getLength() == _len;
+    }
+
+    bool KeyFormat::allowsPrefix( int prefixLen ) const {
+	if( _type == ktBytes )
+	    return prefixLen >= 0 && prefixLen < _len;
+	int width = _len - prefixLen;
+	return width == 1 || width == 2 || width == 4 || width == _len;
+    }
+
+    int KeyFormat::getPrefixLength( const Fence& lo, const Fence& hi ) const {
+	if( !lo._bounded || !hi._bounded || lo._key > hi._key )
+	    return 0;
+	if( _type == ktBytes )
+	    return std::min( lo._key.getCommonPrefix( hi._key ), _len-1 );
+
+	// no key in the node is further from lo than hi is
+	uint64_t range;
+	if( _type == ktInt )
+	    range = (unsigned int) hi._key.toInt() - (unsigned int) lo._key.toInt();
+	else
+	    range = (uint64_t) hi._key.toInt64() - (uint64_t) lo._key.toInt64();
+	int width = range <= 0xFF ? 1 : range <= 0xFFFF ? 2 : range <= 0xFFFFFFFFu ? 4 : 8;
+	return _len - std::min( width, _len );
+    }
+
+    Key KeyFormat::getSeparator( const Key& a, const Key& b ) const {
+	// b is not a prefix of a, or it would sort first, so the byte
+	// where they differ is in b.  a ends before it, or is lower there.
+	if( _type != ktBytes || a >= b )
+	    return b;
+	return Key( b.getBytes(), a.getCommonPrefix( b ) + 1 );
+    }
+}
@@ -0,0 +1,120 @@
+#include "stdinc.h"
+#include "os.h"
+#include "dbg.h"
+#include "bt.h"
+
+/*
+
+  Any number of threads can search and scan a tree while one thread
+  changes it.  Every node is latched while it is used, shared to read it
+  and exclusive to change it, and a thread going down the tree latches
+  the child before it lets go of the parent, so it never sees a node
+  that is in the middle of being split or merged.
+
+  The root has no parent, so _rootLatch stands in for one: a thread holds
+  it while it reads which block is the root and latches that block.
+
+  A search usually latches nothing.  Each latch has a version that moves
+  on when the latch is locked exclusive and again when it is unlocked, so
+  a search can read a node without latching it, and trust what it read
+  only if the version has not moved in the meantime; otherwise it starts
+  over.  This way searches do not write to the memory the latches of the
+  upper levels of the tree live in, which every thread touches.  A search
+  that keeps running into writers latches its way down like the other
+  readers, and one that finds an entry whose data is not in the leaf
+  latches the leaf before it reads the data (see BTree::searchOptimistic).
+
+  A reader only holds the latch of the node it is in, and of the child it
+  is waiting for.  Once it reaches a leaf, it keeps it latched while it
+  copies out the value, including any part of it in fragments or an
+  extent.  Neither can be freed or reused before the entry that refers to
+  them is removed, which needs the leaf latched exclusive, so fragment
+  blocks and extents are read without latches of their own.
+
+  Only one operation changes the tree at a time, under _writeMutex.
+  Because insert splits full nodes and remove fills minimal ones on the
+  way down, the child it descends into can never change its parent.  So
+  at each step the writer lets go of every node it has latched but not
+  changed, and with the root, _rootLatch.  The nodes it has changed stay
+  latched until its changes are committed to the log, so readers see all
+  of an operation or none of it.  The write mutex is released before the
+  log is forced, so a thread waiting for its changes to reach the disk
+  does not hold up the next writer, and their syncs are shared by the
+  group commit.  Readers can see an operation before it is durable.
+
+  Latches are only ever waited for from the top of the tree down, and
+  along a level of the tree from left to right, so threads cannot wait
+  for each other in a cycle.  A writer that needs a node's left sibling
+  lets go of the node first, which is safe since it has not changed it
+  yet.  A cursor moving left only tries the latch of the leaf to its
+  left, and if it is taken, finds its place again from the root.
+
+*/
+
+namespace bt {
+
+    // latch the root.  a writer keeps _rootLatch until it lets go of the
+    // root, so no reader can find the root while it is split or replaced.
+    boost::shared_ptr<Node> BTree::latchRoot( LATCHMODE lm ) throw(os::IoException,FileCorruptedException) {
+	if( lm == lmExclusive ) {
+	    _rootLatch.lockExclusive();
+	    _rootLatched = true;
+	    return latchNode( _header.getRoot() );
+	}
+
+	os::SharedLock lock( _rootLatch );
+	return readNode( _header.getRoot(), lm );
+    }
+
+    // latch a node exclusive for the operation in progress.  a node it
+    // already holds is returned as it is, since a latch cannot be taken
+    // twice.
+    boost::shared_ptr<Node> BTree::latchNode( BLOCKNO bn ) throw(os::IoException,FileCorruptedException) {
+	for( int i = 0; i < (int) _latched.size(); i++ ) {
+	    if( _latched[i]->getBlockNumber() == bn )
+		return _latched[i];
+	}
+
+	boost::shared_ptr<Node> x = readNode( bn, lmExclusive );
+	_latched.push_back( x );
+	return x;
+    }
+
+    boost::shared_ptr<Node> BTree::latchNewNode( NODETYPE nt ) throw(os::IoException,FileCorruptedException) {
+	boost::shared_ptr<Node> x = allocateNode( nt, allocateBlock() );
+	_latched.push_back( x );
+	return x;
+    }
+
+    // let go of the nodes the operation has latched but not changed,
+    // except keep, the node it is about to descend into
+    void BTree::releaseUnchanged( boost::shared_ptr<Node> keep ) {
+	std::vector< boost::shared_ptr<Node> >::iterator pos = _latched.begin();
+	while( pos != _latched.end() ) {
+	    boost::shared_ptr<Node> x = *pos;
+	    if( x == keep || x->isChanged() ) {
+		++pos;
+		continue;
+	    }
+
+	    if( _rootLatched && x->getBlockNumber() == _header.getRoot() ) {
+		_rootLatch.unlockExclusive();
+		_rootLatched = false;
+	    }
+	    x->unlatch();
+	    pos = _latched.erase( pos );
+	}
+    }
+
+    // the operation is over, or has failed: let go of everything
+    void BTree::releaseLatches() {
+	for( int i = 0; i < (int) _latched.size(); i++ )
+	    _latched[i]->unlatch();
+	_latched.clear();
+
+	if( _rootLatched ) {
+	    _rootLatch.unlockExclusive();
+	    _rootLatched = false;
+	}
+    }
+}
@@ -0,0 +1,223 @@
+#include "stdinc.h"
+#include "os.h"
+#include "dbg.h"
+#include "bt.h"
+
+namespace bt {
+
+    BulkLoader::BulkLoader( BTree& tree, int fillPercent ) throw(os::IoException,FileCorruptedException,TreeNotEmptyException) : _tree(tree), _fillPercent(fillPercent) {
+	assert( fillPercent > 0 && fillPercent <= 100 );
+
+	// the loader is the tree's only writer until it finishes, and no
+	// reader can find the root before then
+	_tree._writeMutex.lock();
+	_tree._rootLatch.lockExclusive();
+
+	// the tree must be empty.  its root is left as it is until the load
+	// finishes, so the blocks committed along the way are not reachable
+	// from it, and a crash part way through leaves the tree empty.
+	try {
+	    boost::shared_ptr<Node> root = _tree.readNode( _tree._header.getRoot(), lmShared );
+	    if( !root->isLeaf() || root->getKeyCount() != 0 )
+		throw TreeNotEmptyException();
+	    _root = root->getBlockNumber();
+	    _leaf = boost::shared_static_cast<LeafNode>(
+		_tree.allocateNode( ntLeafNode, _tree._header.allocateBlockNumber() ) );
+	} catch( ... ) {
+	    _tree._rootLatch.unlockExclusive();
+	    _tree._writeMutex.unlock();
+	    throw;
+	}
+
+	int blockSize = _tree._header.getBlockSize();
+	const KeyFormat& kf = _tree._header.getKeyFormat();
+	_internalTarget = std::max( 1, InternalNode::getCapacity( blockSize, kf ) * fillPercent / 100 );
+
+	_empty = true;
+
+	// the loaded nodes are always appended to the file rather than taken
+	// from the free block chain, so they go out in sequential runs
+	_flushed = _tree._header.getBlockCount();
+
+	DBG( dout("bt.load",1) << "Bulk loading at least " << getLeafTarget( 0 ) << " entries per leaf, "
+			       << _internalTarget << " keys per internal node" << std::endl );
+    }
+
+    BulkLoader::~BulkLoader() {
+	try {
+	    finish();
+	} catch( std::exception& x ) {
+	    DBG( dout("bt.load",1) << "Error finishing bulk load: " << x.what() << std::endl );
+	} catch( ... ) {
+	    DBG( dout("bt.load",1) << "Error finishing bulk load" << std::endl );
+	}
+    }
+
+    // the entries a leaf is filled with while its keys share a prefix of
+    // prefixLen bytes
+    int BulkLoader::getLeafTarget( int prefixLen ) const {
+	int capacity = LeafNode::getCapacity( _tree._header.getBlockSize(), _tree._header.getKeyFormat(), prefixLen );
+	return std::max( 1, capacity * _fillPercent / 100 );
+    }
+
+    void BulkLoader::add( const Key& given, const char* data, int len ) throw(os::IoException,FileCorruptedException,KeyOrderException,KeyTypeException) {
+	assert( _leaf );
+
+	Key wide;
+	const Key& key = _tree.checkKey( given, wide );
+	if( !_empty && key <= _lastKey )
+	    throw KeyOrderException();
+	_empty = false;
+	_lastKey = key;
+
+	Node::Entry e;
+	if( len <= NODE_DATA_LEN ) {
+	    e.set( key, etComplete, data, len ) ;
+	} else if( len <= _tree.getExtentThreshold() ) {
+	    _tree.writeOverflowEntry( e, key, data, len );
+	} else {
+	    _tree.writeExtentEntry( e, key, data, len );
+	}
+
+	// until the next leaf is started, the high fence of the leaf being
+	// filled is its last key, so it has the prefix its keys share so far
+	const KeyFormat& kf = _tree._header.getKeyFormat();
+	Fence hi( key );
+	while( _leaf->getKeyCount() >= getLeafTarget( kf.getPrefixLength( _leaf->getLowFence(), hi ) ) )
+	    nextLeaf( hi );
+	_leaf->setFences( _leaf->getLowFence(), hi, _tree._header.getBlockSize() );
+
+	_leaf->setEntry( _leaf->getKeyCount(), e );
+	_leaf->setKeyCount( _leaf->getKeyCount() + 1 );
+	_leaf->write( *_tree._store );
+    }
+
+    // finish the leaf being filled, start the next one, and give the level
+    // above the separator between them.  hi is the first key of the next
+    // leaf, or unbounded at the end of the load.  the separator may leave
+    // the leaf a shorter prefix than it was filled with, and room for
+    // fewer entries, so it keeps as many as it has room for under the
+    // separator after them, and the rest move on to the next leaf.
+    void BulkLoader::nextLeaf( const Fence& hi ) throw(os::IoException) {
+	int blockSize = _tree._header.getBlockSize();
+	const KeyFormat& kf = _tree._header.getKeyFormat();
+	Fence lo = _leaf->getLowFence();
+	int n = _leaf->getKeyCount();
+
+	// a separator earlier in the leaf is closer to lo, so it shares a
+	// prefix at least as long with it.  at worst the leaf keeps as
+	// many entries as it has room for without a prefix.
+	int j = hi._bounded ? n : n-1;
+	Key sep;
+	for( ;; ) {
+	    sep = j == n ? kf.getSeparator( _leaf->getKey( n-1 ), hi._key ) : kf.getSeparator( _leaf->getKey( j-1 ), _leaf->getKey( j ) );
+	    if( j <= LeafNode::getCapacity( blockSize, kf, kf.getPrefixLength( lo, sep ) ) )
+		break;
+	    j--;
+	}
+
+	// the entries that move share at least the prefix they had in the
+	// leaf, so they fit in the next one
+	boost::shared_ptr<LeafNode> next = boost::shared_static_cast<LeafNode>(
+	    _tree.allocateNode( ntLeafNode, _tree._header.allocateBlockNumber() ) );
+	next->setFences( sep, j < n ? Fence( _leaf->getKey( n-1 ) ) : Fence(), blockSize );
+	_leaf->copyTo( j, n-j, *next, 0 );
+	next->setKeyCount( n-j );
+	next->setPrev( _leaf->getBlockNumber() );
+	_leaf->setKeyCount( j );
+	_leaf->setFences( lo, sep, blockSize );
+	_leaf->setNext( next->getBlockNumber() );
+	_leaf->write( *_tree._store );
+	next->write( *_tree._store );
+
+	addChild( 0, sep, next->getBlockNumber(), _leaf->getBlockNumber() );
+	_leaf = next;
+
+	// write out the finished blocks now and then, so they go to the
+	// file in long sequential runs
+	if( _tree._header.getBlockCount() - _flushed >= BULK_FLUSH_BLOCKS ) {
+	    _tree.completeChanges( _tree.commitChanges(), true );
+	    _flushed = _tree._header.getBlockCount();
+	}
+    }
+
+    // add child bn, with separator key, to the rightmost node at the given
+    // level of internal nodes.  left is the node to the left of bn, which
+    // becomes the first child if the level does not exist yet.
+    void BulkLoader::addChild( int level, const Key& key, BLOCKNO bn, BLOCKNO left ) throw(os::IoException) {
+	if( level == (int) _levels.size() ) {
+	    boost::shared_ptr<InternalNode> p = boost::shared_static_cast<InternalNode>(
+		_tree.allocateNode( ntInternalNode, _tree._header.allocateBlockNumber() ) );
+	    p->setChild( 0, left );
+	    _levels.push_back( p );
+	}
+
+	boost::shared_ptr<InternalNode> p = _levels[level];
+	int n = p->getKeyCount();
+
+	if( n == _internalTarget ) {
+	    // start the next node on this level with bn as its first child.
+	    // the separator moves up to the level above.
+	    int blockSize = _tree._header.getBlockSize();
+	    boost::shared_ptr<InternalNode> q = boost::shared_static_cast<InternalNode>(
+		_tree.allocateNode( ntInternalNode, _tree._header.allocateBlockNumber() ) );
+	    q->setFences( key, Fence(), blockSize );
+	    q->setChild( 0, bn );
+	    q->write( *_tree._store );
+	    p->setFences( p->getLowFence(), key, blockSize );
+	    p->write( *_tree._store );
+	    _levels[level] = q;
+
+	    addChild( level+1, key, q->getBlockNumber(), p->getBlockNumber() );
+	} else {
+	    p->setKey( n, key );
+	    p->setChild( n+1, bn );
+	    p->setKeyCount( n+1 );
+	    p->write( *_tree._store );
+	}
+    }
+
+    void BulkLoader::finish() throw(os::IoException) {
+	if( !_leaf )
+	    return;
+
+	// the last leaf is unbounded above, so has no prefix.  the entries
+	// it was filled with beyond what it has room for without one move
+	// on to leaves of their own.
+	int blockSize = _tree._header.getBlockSize();
+	while( _leaf->getKeyCount() > LeafNode::getCapacity( blockSize, _tree._header.getKeyFormat() ) )
+	    nextLeaf( Fence() );
+	_leaf->setFences( _leaf->getLowFence(), Fence(), blockSize );
+	_leaf->write( *_tree._store );
+
+	// the root is the single node on the top level
+	boost::shared_ptr<Node> root;
+	if( _levels.empty() )
+	    root = _leaf;
+	else
+	    root = _levels.back();
+
+	DBG( dout("bt.load",1) << "Bulk load finished: root=" << *root
+			       << ", height=" << _levels.size()+1 << std::endl );
+
+	_tree._header.setRoot( root->getBlockNumber() );
+
+	root.reset();
+	_leaf.reset();
+	_levels.clear();
+	_tree.freeBlock( _root );
+	_tree._rootLatch.unlockExclusive();
+
+	// the changes are committed before the write mutex is let go, even
+	// if that fails, but forced after
+	Log::LSN lsn;
+	try {
+	    lsn = _tree.commitChanges();
+	} catch( ... ) {
+	    _tree._writeMutex.unlock();
+	    throw;
+	}
+	_tree._writeMutex.unlock();
+	_tree.completeChanges( lsn );
+    }
+}
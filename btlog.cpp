@@ -0,0 +1,253 @@
+#include "stdinc.h"
+#include "os.h"
+#include "dbg.h"
+#include "bt.h"
+
+/*
+
+  The log is a start record followed by groups of write records, each
+  group ending with a commit record:
+
+    start(epoch) write* commit write* commit ...
+
+  A write record holds the new contents of part of the tree file: a
+  whole block from the block store, the header, or part of an extent.
+  The records are replayed in the order they were written, so a later
+  record for the same part of the file always wins, and replaying the
+  same log twice leaves the same file.
+
+  A group is only appended once its operation is finished, so a commit
+  record is never followed by part of a group that is still being built.
+  What recovery finds after the last commit record is a group that was
+  being written when the system went down, and it is ignored.
+
+*/
+
+namespace bt {
+
+    Log::Log() {
+	_epoch = 0;
+	_base = 0;
+	_end = 0;
+	_synced = 0;
+	_syncing = false;
+    }
+
+    void Log::create( std::string fname ) throw(os::IoException) {
+	_file.open( fname,
+		    os::File::CreateOrTruncate,
+		    os::File::ReadWrite,
+		    os::File::ShareNone,
+		    os::File::Sequential );
+
+	// the epoch only has to differ from the one in whatever log the
+	// file might have held before
+	start( os::getTicks() );
+    }
+
+    void Log::start( unsigned int epoch ) throw(os::IoException) {
+	_epoch = epoch;
+	_group.clear();
+	_file.setSize( 0 );
+
+	addRecord( lrStart, 0, NULL, 0 );
+	_file.writeAt( 0, &_group[0], _group.size() );
+	_file.sync();
+
+	_base = _end;
+	_end = _base + _group.size();
+	_synced = _end;
+	_group.clear();
+    }
+
+    void Log::reset() throw(os::IoException) {
+	os::Lock lock( _mutex );
+	assert( _group.empty() );
+
+	// a sync led by a thread that has not yet seen the checkpoint may
+	// still be running
+	while( _syncing )
+	    _synced_cond.wait( _mutex );
+
+	DBG( dout("bt.log",2) << "Checkpoint: log emptied at " << _end << std::endl );
+	start( _epoch + 1 );
+    }
+
+    unsigned int Log::checksum( const Record& r, const char* data ) {
+	// FNV-1a over the record, with the checksum itself taken as zero,
+	// and the data that follows it
+	Record h = r;
+	h._sum = 0;
+
+	unsigned int sum = 2166136261u;
+	const unsigned char* p = reinterpret_cast<const unsigned char*>( &h );
+	for( size_t i = 0; i < sizeof(h); i++ )
+	    sum = (sum ^ p[i]) * 16777619u;
+
+	p = reinterpret_cast<const unsigned char*>( data );
+	for( int i = 0; i < r._len; i++ )
+	    sum = (sum ^ p[i]) * 16777619u;
+
+	return sum;
+    }
+
+    void Log::addRecord( RECORDTYPE type, os::File::POS pos, const void* data, int len ) {
+	Record r;
+	os::mem::clear( &r, sizeof(r) );
+	r._magic = LOG_MAGIC_VALUE;
+	r._epoch = _epoch;
+	r._type = type;
+	r._pos = pos;
+	r._len = len;
+	r._sum = checksum( r, static_cast<const char*>( data ) );
+
+	size_t at = _group.size();
+	_group.resize( at + sizeof(r) + len );
+	os::mem::copy( &_group[at], &r, sizeof(r) );
+	if( len > 0 )
+	    os::mem::copy( &_group[at + sizeof(r)], data, len );
+    }
+
+    void Log::append( os::File::POS pos, const void* data, int len ) {
+	assert( pos >= 0 && len > 0 );
+	addRecord( lrWrite, pos, data, len );
+    }
+
+    Log::LSN Log::commit() throw(os::IoException) {
+	assert( !_group.empty() );
+	addRecord( lrCommit, 0, NULL, 0 );
+
+	os::Lock lock( _mutex );
+	DBG( dout("bt.log",3) << "Writing " << _group.size() << " bytes to the log at " << _end << std::endl );
+	_file.writeAt( _end - _base, &_group[0], _group.size() );
+	_end += _group.size();
+	_group.clear();
+	return _end;
+    }
+
+    void Log::force( LSN lsn ) throw(os::IoException) {
+	os::Lock lock( _mutex );
+	while( _synced < lsn ) {
+	    if( _syncing ) {
+		// the leader's sync may have started before lsn was written,
+		// so look again once it finishes
+		_synced_cond.wait( _mutex );
+		continue;
+	    }
+
+	    // lead a sync of everything written so far.  other threads can
+	    // write their groups while it runs.
+	    _syncing = true;
+	    LSN end = _end;
+	    _mutex.unlock();
+	    try {
+		_file.sync();
+	    } catch( os::IoException& ) {
+		_mutex.lock();
+		_syncing = false;
+		_synced_cond.signalAll();
+		throw;
+	    }
+	    _mutex.lock();
+
+	    DBG( dout("bt.log",3) << "Log synced to " << end << std::endl );
+	    _syncing = false;
+	    _synced = end;
+	    _synced_cond.signalAll();
+	}
+    }
+
+    Log::LSN Log::getEnd() {
+	os::Lock lock( _mutex );
+	return _end;
+    }
+
+    Log::LSN Log::getSize() {
+	os::Lock lock( _mutex );
+	return _end - _base;
+    }
+
+    // read the record at offset at, and its data.  returns false if there
+    // is no whole, valid record there in the given epoch.
+    bool Log::readRecord( os::File f, LSN at, LSN size, unsigned int epoch, Record& r, std::vector<char>& data ) throw(os::IoException) {
+	if( at + (LSN) sizeof(r) > size )
+	    return false;
+
+	f.readAt( at, &r, sizeof(r) );
+	if( r._magic != LOG_MAGIC_VALUE || r._epoch != epoch || r._len < 0 || at + (LSN) sizeof(r) + r._len > size )
+	    return false;
+
+	data.resize( r._len + 1 );
+	if( r._len > 0 )
+	    f.readAt( at + sizeof(r), &data[0], r._len );
+
+	return r._sum == checksum( r, &data[0] );
+    }
+
+    int Log::recover( std::string fname, bool replay ) throw(os::IoException) {
+	os::File f;
+	try {
+	    f.open( fname + LOG_SUFFIX,
+		    os::File::Open,
+		    replay ? os::File::ReadWrite : os::File::ReadOnly,
+		    replay ? os::File::ShareNone : os::File::ShareWrite,
+		    os::File::Sequential );
+	} catch( os::FileNotFoundException& ) {
+	    return 0;
+	}
+
+	LSN size = f.getSize();
+	Record r;
+	std::vector<char> data;
+
+	// anything but a start record at the head of the log means the
+	// log was being emptied, and holds nothing to replay
+	if( size == 0 )
+	    return 0;
+
+	f.readAt( 0, &r, std::min( size, (LSN) sizeof(r) ) );
+	unsigned int epoch = r._epoch;
+	if( !readRecord( f, 0, size, epoch, r, data ) || r._type != lrStart ) {
+	    if( replay )
+		f.setSize( 0 );
+	    return 0;
+	}
+
+	// find the end of the last complete group
+	int groups = 0;
+	LSN committed = sizeof(r);
+	for( LSN at = sizeof(r); readRecord( f, at, size, epoch, r, data ); ) {
+	    at += sizeof(r) + r._len;
+	    if( r._type == lrCommit ) {
+		committed = at;
+		groups++;
+	    }
+	}
+
+	if( !replay )
+	    return groups;
+
+	if( groups > 0 ) {
+	    DBG( dout("bt.log",1) << "Replaying " << groups << " groups from " << fname << LOG_SUFFIX << std::endl );
+
+	    os::File tree( fname,
+			   os::File::Open,
+			   os::File::ReadWrite,
+			   os::File::ShareNone,
+			   os::File::Random );
+
+	    for( LSN at = sizeof(r); at < committed; at += sizeof(r) + r._len ) {
+		readRecord( f, at, size, epoch, r, data );
+		if( r._type == lrWrite )
+		    tree.writeAt( r._pos, &data[0], r._len );
+	    }
+
+	    // the tree file must be safe before the log is emptied
+	    tree.sync();
+	}
+
+	f.setSize( 0 );
+	f.sync();
+	return groups;
+    }
+}
@@ -0,0 +1,142 @@
+#include "stdinc.h"
+#include "os.h"
+#include "dbg.h"
+#include "bt.h"
+
+namespace bt {
+
+    MappedStore::MappedStore() {
+	_writable = false;
+	_size = 0;
+    }
+
+    MappedStore::~MappedStore() {
+	for( std::map<BLOCKNO,Latch>::iterator pos = _latches.begin(); pos != _latches.end(); ++pos )
+	    delete pos->second._latch;
+    }
+
+    void MappedStore::attach( os::File file, bool writable, int blockSize ) throw(os::IoException) {
+	// blocks must never straddle a segment
+	assert( MAP_SEGMENT_SIZE % blockSize == 0 );
+	assert( MAP_GROW_SIZE % blockSize == 0 );
+	assert( _segments.empty() );
+	_file = file;
+	_blockSize = blockSize;
+	_writable = writable;
+	_size = _file.getSize();
+	_segments.clear();
+	_dirty.clear();
+    }
+
+    char* MappedStore::getBlock( BLOCKNO bn ) throw(os::IoException) {
+	os::File::POS fp = blockOffset( bn, _blockSize );
+	int seg = (int) (fp / MAP_SEGMENT_SIZE);
+
+	if( (int) _segments.size() <= seg )
+	    _segments.resize( seg+1 );
+
+	// segments are mapped on first use, so a sparse file does not
+	// tie up address space for the holes in it
+	if( !_segments[seg].isMapped() ) {
+	    os::File::POS start = seg * (os::File::POS) MAP_SEGMENT_SIZE;
+	    size_t len = MAP_SEGMENT_SIZE;
+
+	    // a read-only mapping cannot extend past the end of the file
+	    if( !_writable && start + len > _size )
+		len = (size_t) (_size - start);
+
+	    DBG( dout("bt.map",2) << "Mapping segment " << seg << ", length " << len << std::endl );
+	    _segments[seg] = os::FileMapping( _file, start, len, _writable );
+	}
+
+	return _segments[seg].getAddress() + (size_t) (fp % MAP_SEGMENT_SIZE);
+    }
+
+    char* MappedStore::pin( BLOCKNO bn, bool read, os::RWLock** latch ) throw(os::IoException,BufferPoolExhaustedException) {
+	assert( bn != INVALID_BLOCK_NUMBER );
+	os::Lock lock( _mutex );
+
+	os::File::POS end = blockOffset( bn+1, _blockSize );
+	if( end > _size ) {
+	    if( read || !_writable ) {
+		std::ostringstream oss;
+		oss << "block " << bn << " is past the end of the file";
+		throw os::IoException( oss.str() );
+	    }
+
+	    // extend the file to cover the new block.  the segment was mapped
+	    // at its full length, so the block's address does not change.
+	    // extents are written to the file directly, so it may already
+	    // be longer than we last saw, and must not be cut back.
+	    os::File::POS size = _file.getSize();
+	    if( size < end ) {
+		size = ((end + MAP_GROW_SIZE - 1) / MAP_GROW_SIZE) * MAP_GROW_SIZE;
+		DBG( dout("bt.map",2) << "Extending file to " << size << " bytes" << std::endl );
+		_file.setSize( size );
+	    }
+	    _size = size;
+	}
+
+	char* buf = getBlock( bn );
+
+	if( read )
+	    _stats._hits++;
+	else
+	    os::mem::clear( buf, _blockSize );
+
+	std::map<BLOCKNO,Latch>::iterator pos = _latches.find( bn );
+	if( pos == _latches.end() ) {
+	    Latch l;
+	    l._latch = new os::RWLock;
+	    l._pins = 0;
+	    pos = _latches.insert( std::make_pair( bn, l ) ).first;
+	}
+	pos->second._pins++;
+
+	if( latch )
+	    *latch = pos->second._latch;
+	return buf;
+    }
+
+    void MappedStore::unpin( BLOCKNO bn ) {
+	// blocks never leave the mapping, so only the latch is released
+	os::Lock lock( _mutex );
+	std::map<BLOCKNO,Latch>::iterator pos = _latches.find( bn );
+	assert( pos != _latches.end() && pos->second._pins > 0 );
+	if( --pos->second._pins == 0 ) {
+	    delete pos->second._latch;
+	    _latches.erase( pos );
+	}
+    }
+
+    void MappedStore::markDirty( BLOCKNO bn ) {
+	assert( _writable );
+	os::Lock lock( _mutex );
+	_dirty.insert( bn );
+    }
+
+    void MappedStore::flush() throw(os::IoException) {
+	os::Lock lock( _mutex );
+
+	// sync runs of consecutive dirty blocks with one msync each
+	std::set<BLOCKNO>::iterator pos = _dirty.begin();
+	while( pos != _dirty.end() ) {
+	    BLOCKNO first = *pos;
+	    BLOCKNO last = first;
+	    os::File::POS fp = blockOffset( first, _blockSize );
+	    int seg = (int) (fp / MAP_SEGMENT_SIZE);
+
+	    for( ++pos; pos != _dirty.end() && *pos == last+1; ++pos ) {
+		// runs cannot cross into the next segment
+		if( (int) (blockOffset( last+1, _blockSize ) / MAP_SEGMENT_SIZE) != seg )
+		    break;
+		last++;
+	    }
+
+	    DBG( dout("bt.map",2) << "Syncing blocks " << first << "-" << last << std::endl );
+	    _segments[seg].sync( (size_t) (fp % MAP_SEGMENT_SIZE), (size_t) (last - first + 1) * _blockSize );
+	    _stats._writes += last - first + 1;
+	}
+	_dirty.clear();
+    }
+}
@@ -5,45 +5,386 @@
 
 namespace bt {
 
+    //
+    // the in-node searches over integer keys are branchless binary
+    // searches over the key column of a node.  each step halves the range
+    // with a conditional move instead of a branch, so the loop never
+    // mispredicts, and its length depends only on the key count.
+    //
+
+    // below this many keys, or keys in this many bytes, the keys are
+    // counted rather than halved further
+    static const int KEY_SCAN_LEN = 16;
+    static const int KEY_SCAN_BYTES = 64;
+
+#ifdef HAVE_SSE2
+    // the count of the bits set in each 4 bit mask
+    static const int MASK_BITS[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+    static inline int countBits( int mask ) {
+	return MASK_BITS[mask & 15] + MASK_BITS[(mask >> 4) & 15] + MASK_BITS[(mask >> 8) & 15] + MASK_BITS[(mask >> 12) & 15];
+    }
+#endif
+
+    // count the keys in keys[0..n) that are <= k
+    template<class T>
+    static inline int countKeysNotAbove( const T* keys, int n, T k ) {
+	int count = 0;
+	for( int i = 0; i < n; i++ )
+	    count += (keys[i] <= k);
+	return count;
+    }
+
+    static inline int countKeysNotAbove( const int* keys, int n, int k ) {
+	int count = 0;
+	int i = 0;
+#ifdef HAVE_SSE2
+	__m128i kv = _mm_set1_epi32( k );
+	for( ; i + 4 <= n; i += 4 ) {
+	    __m128i gt = _mm_cmpgt_epi32( _mm_loadu_si128( reinterpret_cast<const __m128i*>( keys + i ) ), kv );
+	    count += 4 - MASK_BITS[ _mm_movemask_ps( _mm_castsi128_ps( gt ) ) ];
+	}
+#endif
+	for( ; i < n; i++ )
+	    count += (keys[i] <= k);
+	return count;
+    }
+
+    // SSE2 only compares signed lanes, so unsigned offsets are compared
+    // with their top bits flipped, which keeps them in the same order.
+    // a vector holds 16 byte or 8 short offsets.
+    static inline int countKeysNotAbove( const uint8_t* keys, int n, uint8_t k ) {
+	int count = 0;
+	int i = 0;
+#ifdef HAVE_SSE2
+	__m128i flip = _mm_set1_epi8( (char) 0x80 );
+	__m128i kv = _mm_set1_epi8( (char) (k ^ 0x80) );
+	for( ; i + 16 <= n; i += 16 ) {
+	    __m128i v = _mm_xor_si128( _mm_loadu_si128( reinterpret_cast<const __m128i*>( keys + i ) ), flip );
+	    count += 16 - countBits( _mm_movemask_epi8( _mm_cmpgt_epi8( v, kv ) ) );
+	}
+#endif
+	for( ; i < n; i++ )
+	    count += (keys[i] <= k);
+	return count;
+    }
+
+    static inline int countKeysNotAbove( const uint16_t* keys, int n, uint16_t k ) {
+	int count = 0;
+	int i = 0;
+#ifdef HAVE_SSE2
+	__m128i flip = _mm_set1_epi16( (short) 0x8000 );
+	__m128i kv = _mm_set1_epi16( (short) (k ^ 0x8000) );
+	for( ; i + 8 <= n; i += 8 ) {
+	    __m128i v = _mm_xor_si128( _mm_loadu_si128( reinterpret_cast<const __m128i*>( keys + i ) ), flip );
+	    count += 8 - countBits( _mm_movemask_epi8( _mm_cmpgt_epi16( v, kv ) ) ) / 2;
+	}
+#endif
+	for( ; i < n; i++ )
+	    count += (keys[i] <= k);
+	return count;
+    }
+
+    // index of the first of the n sorted keys that is > k
+    template<class T>
+    static inline int keyUpperBound( const T* keys, int n, T k ) {
+	// every key before base is <= k, and every key from base+n on is > k
+	const int scan = std::max( KEY_SCAN_LEN, KEY_SCAN_BYTES / (int) sizeof(T) );
+	const T* base = keys;
+	while( n > scan ) {
+	    int half = n / 2;
+	    base = (base[half] <= k) ? base + half : base;
+	    n -= half;
+	}
+	return (int) (base - keys) + countKeysNotAbove( base, n, k );
+    }
+
+    // index of the first of the n sorted keys that is >= k.  no key is
+    // below the smallest value, otherwise the first key >= k is the first
+    // key > k-1.
+    template<class T>
+    static inline int keyLowerBound( const T* keys, int n, T k ) {
+	if( k == std::numeric_limits<T>::min() )
+	    return 0;
+	return keyUpperBound( keys, n, k-1 );
+    }
+
+    //
+    // an integer key of a node with a prefix is its offset from the low
+    // fence, in a slot of 1, 2 or 4 bytes.  the offsets are searched as
+    // they are, with the key searched for turned into an offset too.
+    //
+
+    // the integer of len bytes at p, stored as a Key stores it
+    static inline int64_t loadInt( const char* p, int len ) {
+	uint64_t u = 0;
+	for( int i = 0; i < len; i++ )
+	    u = (u << 8) | (unsigned char) p[i];
+	if( len == sizeof(int) )
+	    return (int) (unsigned int) (u ^ 0x80000000u);
+	return (int64_t) (u ^ (((uint64_t) 1) << 63));
+    }
+
+    static inline uint64_t loadOffset( const char* slot, int width ) {
+	switch( width ) {
+	case 1:
+	    return *reinterpret_cast<const uint8_t*>( slot );
+	case 2:
+	    return *reinterpret_cast<const uint16_t*>( slot );
+	default:
+	    return *reinterpret_cast<const uint32_t*>( slot );
+	}
+    }
+
+    static inline void storeOffset( char* slot, int width, uint64_t d ) {
+	switch( width ) {
+	case 1:
+	    assert( d <= 0xFF );
+	    *reinterpret_cast<uint8_t*>( slot ) = (uint8_t) d;
+	    break;
+	case 2:
+	    assert( d <= 0xFFFF );
+	    *reinterpret_cast<uint16_t*>( slot ) = (uint16_t) d;
+	    break;
+	default:
+	    assert( d <= 0xFFFFFFFFu );
+	    *reinterpret_cast<uint32_t*>( slot ) = (uint32_t) d;
+	    break;
+	}
+    }
+
+    // index of the first of the n offsets from base that is > k, or >= k
+    // if lower is set.  a k below base is below every key, and one whose
+    // offset does not fit in a slot is above every key.
+    static int offsetBound( int64_t base, const char* slots, int width, int n, int64_t k, bool lower ) {
+	if( k < base || (lower && k == base) )
+	    return 0;
+
+	// the first key >= k is the first key > k-1
+	uint64_t d = (uint64_t) k - (uint64_t) base - (lower ? 1 : 0);
+	switch( width ) {
+	case 1:
+	    return d > 0xFF ? n : keyUpperBound( reinterpret_cast<const uint8_t*>( slots ), n, (uint8_t) d );
+	case 2:
+	    return d > 0xFFFF ? n : keyUpperBound( reinterpret_cast<const uint16_t*>( slots ), n, (uint16_t) d );
+	default:
+	    return d > 0xFFFFFFFFu ? n : keyUpperBound( reinterpret_cast<const uint32_t*>( slots ), n, (uint32_t) d );
+	}
+    }
+
+    //
+    // byte string keys are slots of a length byte and the bytes after the
+    // node's prefix, compared as Key::compare does.  the length is trusted
+    // no further than the slot, since a search may read a node while it
+    // changes.
+    //
+
+    static inline int compareSlot( const char* slot, int width, const unsigned char* bytes, int len ) {
+	int slen = std::min( (int) (unsigned char) slot[0], width-1 );
+	int c = os::mem::compare( slot+1, bytes, std::min( slen, len ) );
+	if( c != 0 )
+	    return c;
+	return slen - len;
+    }
+
+    // index of the first of the n sorted slots that is > k, or >= k if
+    // lower is set.  the slots hold keys that start with the plen bytes
+    // at prefix, so k is only compared with them if it starts with the
+    // prefix too, and then only the rest of it.
+    static int slotBound( const char* prefix, int plen, const char* slots, int width, int n, const Key& k, bool lower ) {
+	int c = os::mem::compare( k.getBytes(), prefix, std::min( plen, k.getLength() ) );
+	if( c < 0 || (c == 0 && k.getLength() < plen) )
+	    return 0;
+	if( c > 0 )
+	    return n;
+
+	const unsigned char* bytes = k.getBytes() + plen;
+	int len = k.getLength() - plen;
+	int lo = 0;
+	while( n > 0 ) {
+	    int half = n / 2;
+	    c = compareSlot( slots + (lo+half)*width, width, bytes, len );
+	    if( c < 0 || (c == 0 && !lower) ) {
+		lo += half + 1;
+		n -= half + 1;
+	    } else {
+		n = half;
+	    }
+	}
+	return lo;
+    }
+
+    // the searches on a column of n keys of type kt
+    static inline int keyUpperBound( KEYTYPE kt, int width, const char* prefix, int plen, const char* keys, int n, const Key& k ) {
+	switch( kt ) {
+	case ktInt:
+	    if( plen > 0 )
+		return offsetBound( loadInt( prefix, sizeof(int) ), keys, width, n, k.toInt(), false );
+	    return keyUpperBound( reinterpret_cast<const int*>( keys ), n, k.toInt() );
+	case ktInt64:
+	    if( plen > 0 )
+		return offsetBound( loadInt( prefix, sizeof(int64_t) ), keys, width, n, k.toInt64(), false );
+	    return keyUpperBound( reinterpret_cast<const int64_t*>( keys ), n, k.toInt64() );
+	default:
+	    return slotBound( prefix, plen, keys, width, n, k, false );
+	}
+    }
+
+    static inline int keyLowerBound( KEYTYPE kt, int width, const char* prefix, int plen, const char* keys, int n, const Key& k ) {
+	switch( kt ) {
+	case ktInt:
+	    if( plen > 0 )
+		return offsetBound( loadInt( prefix, sizeof(int) ), keys, width, n, k.toInt(), true );
+	    return keyLowerBound( reinterpret_cast<const int*>( keys ), n, k.toInt() );
+	case ktInt64:
+	    if( plen > 0 )
+		return offsetBound( loadInt( prefix, sizeof(int64_t) ), keys, width, n, k.toInt64(), true );
+	    return keyLowerBound( reinterpret_cast<const int64_t*>( keys ), n, k.toInt64() );
+	default:
+	    return slotBound( prefix, plen, keys, width, n, k, true );
+	}
+    }
+
+    // the length byte of a fence slot that holds no key
+    static const int UNBOUNDED_FENCE = 0xFF;
+
     
     //-----------------------------------------------------------------------------
     // Node class
     //
     
-    Node::Node() {
+    Node::Node( BlockStore* store, BLOCKNO bn, Data* pData ) {
+	_data = pData;
+	_store = store;
+	_pinned = bn;
+	_latch = NULL;
+	_latchMode = lmNone;
+	_changed = false;
+    }
+
+    Node::~Node() {
+	unlatch();
+	_store->unpin( _pinned );
+    }
+
+    void Node::latch( LATCHMODE lm ) {
+	assert( _latch && _latchMode == lmNone );
+	if( lm == lmShared )
+	    _latch->lockShared();
+	else if( lm == lmExclusive )
+	    _latch->lockExclusive();
+	_latchMode = lm;
+    }
+
+    // only a shared latch can be tried
+    bool Node::tryLatch( LATCHMODE lm ) {
+	assert( _latch && _latchMode == lmNone && lm == lmShared );
+	if( !_latch->tryLockShared() )
+	    return false;
+	_latchMode = lm;
+	return true;
+    }
+
+    void Node::unlatch() {
+	if( _latchMode == lmShared )
+	    _latch->unlockShared();
+	else if( _latchMode == lmExclusive )
+	    _latch->unlockExclusive();
+	_latchMode = lmNone;
     }
 
     Node::Data::Data() {
 	assert( _magic == NODE_MAGIC_VALUE );
     }
     
-    Node::Data::Data( BLOCKNO bn ) {
+    // a new node has no prefix, and is unbounded until its fences are set
+    Node::Data::Data( BLOCKNO bn, int max, const KeyFormat& kf ) {
 	_magic = NODE_MAGIC_VALUE;
 	_n = 0;
+	_max = max;
+	_base = max;
 	_blockno = bn;
+	_keyType = kf.getType();
+	_keyLen = kf.getLength();
+	_prefixLen = 0;
+	_keyWidth = kf.getWidth();
     }
-    
-    void* Node::Data::operator new( unsigned int len ) {
-	assert( len == BLOCK_SIZE );
-	return new char[len];
+
+    Fence Node::Data::loadFence( const char* slot ) const {
+	int len = (unsigned char) slot[0];
+	if( len == UNBOUNDED_FENCE )
+	    return Fence();
+	switch( _keyType ) {
+	case ktInt:
+	    return Fence( Key( (int) loadInt( slot+1, sizeof(int) ) ) );
+	case ktInt64:
+	    return Fence( Key( (int64_t) loadInt( slot+1, sizeof(int64_t) ) ) );
+	default:
+	    return Fence( Key( slot+1, std::min( len, _keyLen ) ) );
+	}
     }
-    
-    void* Node::Data::operator new( unsigned int len, char* buf ) {
-	// len is ignored.
-	return buf;
+
+    void Node::Data::storeFence( char* slot, const Fence& f ) const {
+	os::mem::clear( slot, getFenceWidth() );
+	if( !f._bounded ) {
+	    slot[0] = (char) UNBOUNDED_FENCE;
+	} else {
+	    slot[0] = (char) f._key.getLength();
+	    os::mem::copy( slot+1, f._key.getBytes(), f._key.getLength() );
+	}
     }
 
-    void Node::Data::operator delete( void* pv ) {
-	delete[] reinterpret_cast<char*>(pv);
+    Key Node::Data::loadKey( const char* prefix, const char* slot ) const {
+	switch( _keyType ) {
+	case ktInt:
+	    if( _prefixLen > 0 )
+		return Key( (int) (loadInt( prefix, _keyLen ) + loadOffset( slot, _keyWidth )) );
+	    return Key( *reinterpret_cast<const int*>( slot ) );
+	case ktInt64:
+	    if( _prefixLen > 0 )
+		return Key( (int64_t) (loadInt( prefix, _keyLen ) + loadOffset( slot, _keyWidth )) );
+	    return Key( *reinterpret_cast<const int64_t*>( slot ) );
+	default:
+	    {
+		unsigned char bytes[MAX_KEY_LEN];
+		int len = std::min( std::min( (int) (unsigned char) slot[0], _keyWidth-1 ), _keyLen-_prefixLen );
+		os::mem::copy( bytes, prefix, _prefixLen );
+		os::mem::copy( bytes + _prefixLen, slot+1, len );
+		return Key( bytes, _prefixLen + len );
+	    }
+	}
     }
-    
-    void Node::Data::operator delete( void* pv, char* buf ) {
-	assert( pv == (void*) buf );
-	delete[] reinterpret_cast<char*>(pv);
+
+    void Node::Data::storeKey( const char* prefix, char* slot, const Key& k ) const {
+	switch( _keyType ) {
+	case ktInt:
+	    if( _prefixLen > 0 )
+		storeOffset( slot, _keyWidth, (uint64_t) k.toInt() - loadInt( prefix, _keyLen ) );
+	    else
+		*reinterpret_cast<int*>( slot ) = k.toInt();
+	    break;
+	case ktInt64:
+	    if( _prefixLen > 0 )
+		storeOffset( slot, _keyWidth, (uint64_t) k.toInt64() - loadInt( prefix, _keyLen ) );
+	    else
+		*reinterpret_cast<int64_t*>( slot ) = k.toInt64();
+	    break;
+	default:
+	    {
+		// the rest of the slot is cleared, so the block only depends
+		// on the keys in it
+		int len = k.getLength() - _prefixLen;
+		assert( len >= 0 && len < _keyWidth );
+		assert( os::mem::compare( k.getBytes(), prefix, _prefixLen ) == 0 );
+		slot[0] = (char) len;
+		os::mem::copy( slot+1, k.getBytes() + _prefixLen, len );
+		os::mem::clear( slot+1+len, _keyWidth-1-len );
+	    }
+	    break;
+	}
     }
-	
+    
     Node::Entry::Entry() {
-	_key = 0;
 	_et = etComplete;
 	_len = 0;
     }
@@ -52,14 +393,14 @@ namespace bt {
 	_key = e._key;
 	_et  = e._et;
 	_len = e._len;
-	os::mem::copy( _data, e._data, sizeof(NODE_DATA_LEN) );
+	os::mem::copy( _data, e._data, NODE_DATA_LEN );
     }
 	
-    Node::Entry::Entry( int key, ENTRYTYPE et, const char* data, int len ) {
+    Node::Entry::Entry( const Key& key, ENTRYTYPE et, const char* data, int len ) {
 	set(key,et,data,len);
     }
 
-    void Node::Entry::set( int key, ENTRYTYPE et, const char* data, int len ) {
+    void Node::Entry::set( const Key& key, ENTRYTYPE et, const char* data, int len ) {
 	assert( len <= NODE_DATA_LEN );
 	if( data == NULL )
 	    len = 0;
@@ -79,19 +420,62 @@ namespace bt {
 	return *this;
     }
     
-    void Node::write( os::File f ) throw(os::IoException) {
-	DBG( dout("bt",2) << "Writing " << *this << " to disk" << std::endl );
-	os::File::POS fp = _data->getBlockNumber() * (os::File::POS) BLOCK_SIZE;
-	f.seek( fp, os::File::SeekAbsolute );
-	f.write( _data.get(), BLOCK_SIZE );
+    void Node::write( BlockStore& store ) {
+	DBG( dout("bt",2) << "Marking " << *this << " dirty" << std::endl );
+	assert( _latchMode == lmExclusive );
+	store.markDirty( _data->getBlockNumber() );
+	_changed = true;
     }
     
+    bool Node::peekHeader( const char* buf, BLOCKNO bn, int blockSize, const KeyFormat& kf, NODETYPE& nt, int& n, int& plen ) {
+	// each field is read once, and only the copies are checked and used.
+	// the key format cannot change while the block holds node bn, but
+	// the prefix can.
+	const Data* d = reinterpret_cast<const Data*>( buf );
+	if( d->getMagic() != NODE_MAGIC_VALUE || d->getBlockNumber() != bn || !d->hasKeyFormat( kf ) )
+	    return false;
+
+	nt = d->getType();
+	n = d->getKeyCount();
+	plen = d->getPrefixLength();
+	int max = d->getMaxKeyCount();
+	if( !kf.allowsPrefix( plen ) )
+	    return false;
+	if( nt == ntInternalNode )
+	    return max == InternalNode::getCapacity( blockSize, kf, plen ) && n >= 0 && n <= max;
+	if( nt == ntLeafNode )
+	    return max == LeafNode::getCapacity( blockSize, kf, plen ) && n >= 0 && n <= max;
+	return false;
+    }
+
     void Node::setChild( int n, boost::shared_ptr<Node> c ) {
 	setChild( n, c->getBlockNumber() );
     }
 
-    void Node::setKeyCount( int n ) {
-	_data->setKeyCount(n);
+    Fence Node::getLowFence() {
+	if( isLeaf() )
+	    return static_cast<LeafNode*>( this )->getLowFence();
+	return static_cast<InternalNode*>( this )->getLowFence();
+    }
+
+    Fence Node::getHighFence() {
+	if( isLeaf() )
+	    return static_cast<LeafNode*>( this )->getHighFence();
+	return static_cast<InternalNode*>( this )->getHighFence();
+    }
+
+    void Node::setFences( const Fence& lo, const Fence& hi, int blockSize ) {
+	if( isLeaf() )
+	    static_cast<LeafNode*>( this )->setFences( lo, hi, blockSize );
+	else
+	    static_cast<InternalNode*>( this )->setFences( lo, hi, blockSize );
+    }
+
+    void Node::merge( const Key& key, boost::shared_ptr<Node> z ) {
+	if( isLeaf() )
+	    static_cast<LeafNode*>( this )->merge( key, z );
+	else
+	    static_cast<InternalNode*>( this )->merge( key, z );
     }
 
     std::ostream& operator << ( std::ostream& os, const Node& n ) {
@@ -102,195 +486,404 @@ namespace bt {
     // InternalNode class
     //
     
-    InternalNode::InternalNode( BLOCKNO bn ) {
-	assert( sizeof(Data) == BLOCK_SIZE );
-	_data = boost::shared_ptr<Data>( new Data( bn ) );
+    InternalNode::InternalNode( BlockStore* store, BLOCKNO bn, Node::Data* pData ) : Node(store,bn,pData) {
+	assert( sizeof(Data) == sizeof(Node::Data) );
+    }
+
+    int InternalNode::getCapacity( int blockSize, const KeyFormat& kf, int prefixLen ) {
+	return (blockSize - sizeof(Data) - Data::getFenceSize(kf) - sizeof(BLOCKNO)) / (kf.getWidth(prefixLen) + sizeof(BLOCKNO));
     }
 
-    InternalNode::InternalNode( BLOCKNO bn, boost::shared_ptr<Node::Data> pData ) {
-	assert( sizeof(Data) == BLOCK_SIZE );
-	_data = boost::shared_static_cast<Data>( pData );
+    Node::Data* InternalNode::format( char* buf, BLOCKNO bn, int blockSize, const KeyFormat& kf ) {
+	// clear the whole block, so the unused tail is not left with whatever
+	// the buffer held before
+	os::mem::clear( buf, blockSize );
+	return new(buf) Data( bn, getCapacity(blockSize,kf), kf );
     }
     
-    InternalNode::Data::Data( BLOCKNO bn ) : Node::Data(bn) {
+    InternalNode::Data::Data( BLOCKNO bn, int max, const KeyFormat& kf ) : Node::Data(bn,max,kf) {
 	_type = ntInternalNode;
-	os::mem::clear( _entries, sizeof(_entries) );
-	for( int i = 0; i < INTERNAL_ENTRIES+1; i++ )
-	    _children[i] = INVALID_BLOCK_NUMBER;
-#if INTERNAL_NODE_PADDING > 0	
-	os::mem::clear( _padding, sizeof(_padding) );
-#endif
+	storeFence( fences(), Fence() );
+	storeFence( fences() + getFenceWidth(), Fence() );
+	for( int i = 0; i < _max+1; i++ )
+	    children()[i] = INVALID_BLOCK_NUMBER;
     }
 
-    std::pair<Node::Entry,BLOCKNO> InternalNode::Data::removeEntryAndRightChild( int n ) {
-	std::pair<Entry,BLOCKNO> peb = std::make_pair( _entries[n], _children[n+1] );
-	
-	if( n < _n-1 ) {
-	    // must shift entries down
-	    os::mem::move( _entries + (n), _entries+(n+1), (_n - (n+1)) * sizeof(Entry) );
-	    os::mem::clear( _entries + (_n-1), sizeof(Entry) );
-
-	    // shift children down as well
-	    os::mem::move( _children + (n+1), _children+(n+2), (_n - (n+2)) * sizeof(BLOCKNO) );
-	    os::mem::clear( _children + (_n), sizeof(BLOCKNO) );
+    void InternalNode::Data::setFences( const Fence& lo, const Fence& hi, int blockSize ) {
+	int plen = getKeyFormat().getPrefixLength( lo, hi );
+	if( plen == _prefixLen && os::mem::compare( lo._key.getBytes(), prefix(), getFrameLength() ) == 0 ) {
+	    storeFence( fences(), lo );
+	    storeFence( fences() + getFenceWidth(), hi );
+	    return;
 	}
+
+	// the node is laid out again for the new prefix, or the new low
+	// fence its integer keys are offsets from, and its keys and
+	// children copied back from the node as it was
+	std::vector<char> copy( blockSize );
+	os::mem::copy( &copy[0], this, blockSize );
+	Data& old = *reinterpret_cast<Data*>( &copy[0] );
+
+	KeyFormat kf = getKeyFormat();
+	_prefixLen = plen;
+	_keyWidth = kf.getWidth( plen );
+	_max = InternalNode::getCapacity( blockSize, kf, plen );
+	assert( _n <= _max );
+
+	os::mem::clear( fences(), blockSize - sizeof(Data) );
+	storeFence( fences(), lo );
+	storeFence( fences() + getFenceWidth(), hi );
+	for( int i = 0; i < _max+1; i++ )
+	    children()[i] = (i <= _n) ? old.getChild(i) : INVALID_BLOCK_NUMBER;
+	for( int i = 0; i < _n; i++ )
+	    setKey( i, old.getKey(i) );
+    }
+
+    int InternalNode::Data::findChild( const Key& k ) {
+	return keyLowerBound( _keyType, _keyWidth, prefix(), _prefixLen, keys(), _n, k );
+    }
+
+    int InternalNode::Data::findLastChild( const Key& k ) {
+	return keyUpperBound( _keyType, _keyWidth, prefix(), _prefixLen, keys(), _n, k );
+    }
+
+    // findChild on a node that is not latched.  the layout is worked out
+    // from kf, max, plen and n as checked by the caller, not read again
+    // from the block, which a writer may be changing.
+    BLOCKNO InternalNode::Data::peekChild( const char* buf, const KeyFormat& kf, int max, int plen, int n, const Key& k ) {
+	const char* pf = buf + sizeof(Data);
+	const BLOCKNO* pc = reinterpret_cast<const BLOCKNO*>( pf + getFenceSize(kf) );
+	const char* pk = reinterpret_cast<const char*>( pc + (max+1) );
+	return pc[ keyLowerBound( kf.getType(), kf.getWidth(plen), pf+1, plen, pk, n, k ) ];
+    }
+
+    std::pair<Key,BLOCKNO> InternalNode::Data::removeKeyAndRightChild( int n ) {
+	char* pk = keys();
+	BLOCKNO* pc = children();
+	int w = _keyWidth;
+	std::pair<Key,BLOCKNO> pkb = std::make_pair( getKey(n), pc[n+1] );
+	
+	// shift the keys after n, and the children after n+1, down one slot
+	os::mem::move( pk + (n)*w, pk+(n+1)*w, (_n - (n+1)) * w );
+	os::mem::move( pc + (n+1), pc+(n+2), (_n - (n+1)) * sizeof(BLOCKNO) );
+	os::mem::clear( pk + (_n-1)*w, w );
+	pc[_n] = INVALID_BLOCK_NUMBER;
 	_n--;
 	
-	return peb;
+	return pkb;
     }
-    
-    std::string InternalNode::getNodeTypeName() const {
-	return std::string("InternalNode");
+
+    std::pair<Key,BLOCKNO> InternalNode::Data::removeKeyAndLeftChild( int n ) {
+	char* pk = keys();
+	BLOCKNO* pc = children();
+	int w = _keyWidth;
+	std::pair<Key,BLOCKNO> pkb = std::make_pair( getKey(n), pc[n] );
+
+	// shift the keys and children after n down one slot
+	os::mem::move( pk + (n)*w, pk+(n+1)*w, (_n - (n+1)) * w );
+	os::mem::move( pc + (n), pc+(n+1), (_n - n) * sizeof(BLOCKNO) );
+	os::mem::clear( pk + (_n-1)*w, w );
+	pc[_n] = INVALID_BLOCK_NUMBER;
+	_n--;
+
+	return pkb;
     }
 
-    void InternalNode::setKeyCount( int n ) {
-	assert( n <= INTERNAL_ENTRIES );
-	_data->setKeyCount( n );
+    void InternalNode::Data::insertKeyAndLeftChild( int n, const Key& k, BLOCKNO c ) {
+	char* pk = keys();
+	BLOCKNO* pc = children();
+	int w = _keyWidth;
+
+	// shift the keys and children from n on up one slot
+	os::mem::move( pk + (n+1)*w, pk+(n)*w, (_n - n) * w );
+	os::mem::move( pc + (n+1), pc+(n), (_n + 1 - n) * sizeof(BLOCKNO) );
+	setKey( n, k );
+	pc[n] = c;
+	_n++;
     }
 
-    BLOCKNO InternalNode::getChild( int n ) {
-	assert( n < INTERNAL_ENTRIES + 1 );
-	return getData()->getChild(n) ;
+    void InternalNode::Data::insertKeyAndRightChild( int n, const Key& k, BLOCKNO c ) {
+	char* pk = keys();
+	BLOCKNO* pc = children();
+	int w = _keyWidth;
+
+	// shift the keys from n on, and the children after n, up one slot
+	os::mem::move( pk + (n+1)*w, pk+(n)*w, (_n - n) * w );
+	os::mem::move( pc + (n+2), pc+(n+1), (_n - n) * sizeof(BLOCKNO) );
+	setKey( n, k );
+	pc[n+1] = c;
+	_n++;
     }
-    
-    void InternalNode::setChild( int n, boost::shared_ptr<Node> c ) {
-	assert( n < INTERNAL_ENTRIES + 1 );
-	getData()->setChild(n,c->getBlockNumber() );
+
+    void InternalNode::Data::copyTo( int from, int count, Data& to, int at ) {
+	os::mem::copy( to.children() + at, children() + from, (count+1) * sizeof(BLOCKNO) );
+
+	// the key slots are only copied as they are between nodes that
+	// store their keys the same way
+	if( to._prefixLen != _prefixLen || os::mem::compare( to.prefix(), prefix(), getFrameLength() ) != 0 ) {
+	    for( int i = 0; i < count; i++ )
+		to.setKey( at+i, getKey( from+i ) );
+	    return;
+	}
+	os::mem::copy( to.keys() + at*_keyWidth, keys() + from*_keyWidth, count * _keyWidth );
     }
     
-    void InternalNode::setChild( int n, BLOCKNO c ) {
-	assert( n < INTERNAL_ENTRIES + 1 );
-	getData()->setChild(n,c);
+    std::string InternalNode::getNodeTypeName() const {
+	return std::string("InternalNode");
+    }
+
+    std::pair<Key,BLOCKNO> InternalNode::removeKeyAndRightChild( int n ) {
+	assert( n < getKeyCount() );
+	return getData()->removeKeyAndRightChild(n);
     }
     
-    void InternalNode::setEntry( int n, const Entry& e ) {
-	assert( n < INTERNAL_ENTRIES );
-	getData()->setEntry(n,e);
+    std::pair<Key,BLOCKNO> InternalNode::removeKeyAndLeftChild( int n ) {
+	assert( n < getKeyCount() );
+	return getData()->removeKeyAndLeftChild(n);
     }
     
-    const Node::Entry& InternalNode::getEntry( int n ) {
-	assert( n < INTERNAL_ENTRIES );
-	return getData()->getEntry(n);
+    void InternalNode::insertKeyAndLeftChild( int n, const Key& k, BLOCKNO c ) {
+	assert( n <= getKeyCount() && getKeyCount() < getMaxKeyCount() );
+	getData()->insertKeyAndLeftChild(n, k, c);
     }
     
-    bool InternalNode::isFull() {
-	return getData()->getKeyCount() == INTERNAL_ENTRIES;
+    void InternalNode::insertKeyAndRightChild( int n, const Key& k, BLOCKNO c ) {
+	assert( n <= getKeyCount() && getKeyCount() < getMaxKeyCount() );
+	getData()->insertKeyAndRightChild(n, k, c);
     }
 
-    std::pair<Node::Entry,BLOCKNO> InternalNode::removeEntryAndRightChild( int n ) {
-	assert( n < INTERNAL_ENTRIES );
-	return getData()->removeEntryAndRightChild(n);
+    void InternalNode::copyTo( int from, int count, InternalNode& to, int at ) {
+	assert( from >= 0 && from + count <= getKeyCount() );
+	assert( at >= 0 && at + count <= to.getMaxKeyCount() );
+	getData()->copyTo( from, count, *to.getData(), at );
     }
     
-    void InternalNode::merge( const Node::Entry& e, boost::shared_ptr<Node> z ) {
+    void InternalNode::merge( const Key& key, boost::shared_ptr<Node> z ) {
 	assert( z->getNodeType() == ntInternalNode );
-	assert( (getKeyCount() + z->getKeyCount() + 1) <= INTERNAL_ENTRIES );
+	assert( (getKeyCount() + z->getKeyCount() + 1) <= getMaxKeyCount() );
 	
-	boost::shared_ptr<InternalNode> node = boost::shared_dynamic_cast<InternalNode>(z);
-
-	// tack the entry e onto the end of our list of entries, and increment the count
-	setEntry( getKeyCount(), e );
-	setKeyCount( getKeyCount()+1 );
-
-	// go through all of the other node's entries and children and add them to our own list
-	int i;
-	for( i = 0; i < node->getKeyCount(); i++ ) {
-	    setEntry( getKeyCount(), node->getEntry(i) );
-	    setChild( getKeyCount(), node->getChild(i) );
-	    setKeyCount( getKeyCount()+1 );
-	}
-	setChild( getKeyCount()+1, node->getChild(i) );
+	InternalNode& node = static_cast<InternalNode&>( *z );
+
+	// the separator comes down from the parent to sit between our last
+	// child and the other node's first child, which come over with the
+	// rest of its keys and children
+	int n = getKeyCount();
+	setKey( n, key );
+	node.copyTo( 0, node.getKeyCount(), *this, n+1 );
+	setKeyCount( n+1+node.getKeyCount() );
     }
     
     //-----------------------------------------------------------------------------
     // LeafNode class
     //
     
-    LeafNode::LeafNode( BLOCKNO bn ) {
-	assert( sizeof(Data) == BLOCK_SIZE );
-	_data = boost::shared_ptr<Data>( new Data(bn) );
+    LeafNode::LeafNode( BlockStore* store, BLOCKNO bn, Node::Data* pData ) : Node(store,bn,pData) {
     }
 
-    LeafNode::LeafNode( BLOCKNO bn, boost::shared_ptr<Node::Data> pData ) {
-	assert( sizeof(Data) == BLOCK_SIZE );
-	_data = boost::shared_static_cast<Data>( pData );
+    int LeafNode::getCapacity( int blockSize, const KeyFormat& kf, int prefixLen ) {
+	int room = blockSize - sizeof(Data) - Data::getFenceSize(kf);
+	int size = Data::getEntrySize( kf, prefixLen );
+	int width = kf.getWidth( prefixLen );
+	int max = room / size;
+
+	// padding the key column may leave no room for the last entry
+	if( Data::getKeyColumnSize( max, width ) + max * (size - width) > room )
+	    max--;
+	return max;
+    }
+
+    Node::Data* LeafNode::format( char* buf, BLOCKNO bn, int blockSize, const KeyFormat& kf ) {
+	os::mem::clear( buf, blockSize );
+	return new(buf) Data( bn, getCapacity(blockSize,kf), kf );
     }
     
-    LeafNode::Data::Data( BLOCKNO bn ) : Node::Data(bn) {
+    LeafNode::Data::Data( BLOCKNO bn, int max, const KeyFormat& kf ) : Node::Data(bn,max,kf) {
 	_type = ntLeafNode;
-	os::mem::clear( _entries, sizeof(_entries) );
-#if LEAF_NODE_PADDING > 0	
-	os::mem::clear( _padding, sizeof(_padding) );
-#endif
+	_prev = INVALID_BLOCK_NUMBER;
+	_next = INVALID_BLOCK_NUMBER;
+	storeFence( fences(), Fence() );
+	storeFence( fences() + getFenceWidth(), Fence() );
     }
 
-    Node::Entry LeafNode::Data::removeEntry( int n ) {
-	Entry e = _entries[n];
-	if( n < _n-1 ) {
-	    // must shift entries down
-	    os::mem::move( _entries + (n), _entries+(n+1), (_n - (n+1)) * sizeof(Entry) );
-	    os::mem::clear( _entries + (_n-1), sizeof(Entry) );
+    void LeafNode::Data::setFences( const Fence& lo, const Fence& hi, int blockSize ) {
+	int plen = getKeyFormat().getPrefixLength( lo, hi );
+	if( plen == _prefixLen && os::mem::compare( lo._key.getBytes(), prefix(), getFrameLength() ) == 0 ) {
+	    storeFence( fences(), lo );
+	    storeFence( fences() + getFenceWidth(), hi );
+	    return;
 	}
+
+	// the leaf is laid out again for the new prefix, or the new low
+	// fence its integer keys are offsets from, and its entries
+	// copied back from the leaf as it was
+	std::vector<char> copy( blockSize );
+	os::mem::copy( &copy[0], this, blockSize );
+	Data& old = *reinterpret_cast<Data*>( &copy[0] );
+
+	KeyFormat kf = getKeyFormat();
+	_prefixLen = plen;
+	_keyWidth = kf.getWidth( plen );
+	_max = LeafNode::getCapacity( blockSize, kf, plen );
+	assert( _n <= _max );
+
+	os::mem::clear( fences(), blockSize - sizeof(Data) );
+	storeFence( fences(), lo );
+	storeFence( fences() + getFenceWidth(), hi );
+	for( int i = 0; i < _n; i++ )
+	    setEntry( i, old.getEntry(i) );
+    }
+
+    void LeafNode::Data::setEntry( int n, const Entry& e ) {
+	storeKey( prefix(), keys() + n*_keyWidth, e._key );
+	infos()[n]._et = e._et;
+	infos()[n]._len = e._len;
+	os::mem::copy( payloads() + n*NODE_DATA_LEN, e._data, NODE_DATA_LEN );
+    }
+
+    Node::Entry LeafNode::Data::getEntry( int n ) {
+	Entry e;
+	e._key = getKey(n);
+	e._et = infos()[n]._et;
+	e._len = infos()[n]._len;
+	os::mem::copy( e._data, payloads() + n*NODE_DATA_LEN, NODE_DATA_LEN );
+	return e;
+    }
+
+    // move count entries from index from to index to, column by column
+    void LeafNode::Data::moveEntries( int to, int from, int count ) {
+	os::mem::move( keys() + to*_keyWidth, keys() + from*_keyWidth, count * _keyWidth );
+	os::mem::move( infos() + to, infos() + from, count * sizeof(EntryInfo) );
+	os::mem::move( payloads() + to*NODE_DATA_LEN, payloads() + from*NODE_DATA_LEN, count * NODE_DATA_LEN );
+    }
+
+    int LeafNode::Data::lowerBound( const Key& k ) {
+	return keyLowerBound( _keyType, _keyWidth, prefix(), _prefixLen, keys(), _n, k );
+    }
+
+    int LeafNode::Data::upperBound( const Key& k ) {
+	return keyUpperBound( _keyType, _keyWidth, prefix(), _prefixLen, keys(), _n, k );
+    }
+
+    // lowerBound and getEntry on a leaf that is not latched, laid out by
+    // kf, max, plen and n as checked by the caller.  the key found is
+    // equal to k, so it is not read back from the block.
+    bool LeafNode::Data::peekEntry( const char* buf, const KeyFormat& kf, int max, int plen, int n, const Key& k, Entry& e, BLOCKNO& next ) {
+	KEYTYPE kt = kf.getType();
+	int w = kf.getWidth(plen);
+	const char* pf = buf + sizeof(Data);
+	const char* pk = pf + getFenceSize(kf);
+	const EntryInfo* pi = reinterpret_cast<const EntryInfo*>( pk + getKeyColumnSize( max, w ) );
+	const char* pd = reinterpret_cast<const char*>( pi + max );
+
+	// the key at i is >= k, so it is k unless it is also > k.  past
+	// the last key, k can only be in the next leaf if it is the high
+	// fence, which the next leaf's keys start from.
+	next = INVALID_BLOCK_NUMBER;
+	int i = keyLowerBound( kt, w, pf+1, plen, pk, n, k );
+	if( i == n ) {
+	    const char* hi = pf + kf.getFenceWidth();
+	    if( (unsigned char) hi[0] == k.getLength() && os::mem::compare( hi+1, k.getBytes(), k.getLength() ) == 0 )
+		next = reinterpret_cast<const Data*>( buf )->getNext();
+	    return false;
+	}
+	if( keyUpperBound( kt, w, pf+1, plen, pk + i*w, 1, k ) == 0 )
+	    return false;
+
+	e._key = k;
+	e._et = pi[i]._et;
+	e._len = pi[i]._len;
+	os::mem::copy( e._data, pd + i*NODE_DATA_LEN, NODE_DATA_LEN );
+	return true;
+    }
+
+    void LeafNode::Data::insertEntry( int n, const Entry& e ) {
+	moveEntries( n+1, n, _n - n );
+	setEntry( n, e );
+	_n++;
+    }
+
+    Node::Entry LeafNode::Data::removeEntry( int n ) {
+	Entry e = getEntry(n);
+	moveEntries( n, n+1, _n - (n+1) );
 	_n--;
+
+	// clear the slot that was vacated at the end
+	os::mem::clear( keys() + _n*_keyWidth, _keyWidth );
+	infos()[_n]._et = etComplete;
+	infos()[_n]._len = 0;
+	os::mem::clear( payloads() + _n*NODE_DATA_LEN, NODE_DATA_LEN );
 	return e;
     }
 
+    void LeafNode::Data::copyTo( int from, int count, Data& to, int at ) {
+	// the key slots are only copied as they are between leaves that
+	// store their keys the same way
+	if( to._prefixLen != _prefixLen || os::mem::compare( to.prefix(), prefix(), getFrameLength() ) != 0 ) {
+	    for( int i = 0; i < count; i++ )
+		to.setEntry( at+i, getEntry( from+i ) );
+	    return;
+	}
+	os::mem::copy( to.keys() + at*_keyWidth, keys() + from*_keyWidth, count * _keyWidth );
+	os::mem::copy( to.infos() + at, infos() + from, count * sizeof(EntryInfo) );
+	os::mem::copy( to.payloads() + at*NODE_DATA_LEN, payloads() + from*NODE_DATA_LEN, count * NODE_DATA_LEN );
+    }
 
     std::string LeafNode::getNodeTypeName() const {
 	return std::string("LeafNode");
     }
 
-    void LeafNode::setKeyCount( int n ) {
-	assert( n <= LEAF_ENTRIES );
-	_data->setKeyCount(n);
+    void LeafNode::setEntry( int n, const Entry& e ) {
+	assert( n < getMaxKeyCount() );
+	getData()->setEntry(n,e);
     }
-
-    BLOCKNO LeafNode::getChild( int n ) {
-	assert( false );
-	return INVALID_BLOCK_NUMBER;
+    
+    Node::Entry LeafNode::getEntry( int n ) {
+	assert( n < getMaxKeyCount() );
+	return getData()->getEntry(n);
     }
     
-    void LeafNode::setChild( int n, boost::shared_ptr<Node> c ) {
-	assert( false );
+    ENTRYTYPE LeafNode::getEntryType( int n ) {
+	assert( n < getMaxKeyCount() );
+	return getData()->getEntryType(n);
     }
     
-    void LeafNode::setChild( int n, BLOCKNO c ) {
-	assert( false );
+    int LeafNode::getLength( int n ) {
+	assert( n < getMaxKeyCount() );
+	return getData()->getLength(n);
     }
     
-    void LeafNode::setEntry( int n, const Entry& e ) {
-	assert( n < LEAF_ENTRIES );
-	getData()->setEntry(n,e);
+    const char* LeafNode::getEntryData( int n ) {
+	assert( n < getMaxKeyCount() );
+	return getData()->getEntryData(n);
     }
     
-    const Node::Entry& LeafNode::getEntry( int n ) {
-	assert( n < LEAF_ENTRIES );
-	return getData()->getEntry(n);
+    void LeafNode::insertEntry( int n, const Entry& e ) {
+	assert( n <= getKeyCount() && getKeyCount() < getMaxKeyCount() );
+	getData()->insertEntry(n,e);
     }
     
     Node::Entry LeafNode::removeEntry( int n ) {
-	assert( n < LEAF_ENTRIES );
+	assert( n < getMaxKeyCount() );
 	return getData()->removeEntry(n);
     }
     
-    bool LeafNode::isFull() {
-	return getData()->getKeyCount() == LEAF_ENTRIES;
+    void LeafNode::copyTo( int from, int count, LeafNode& to, int at ) {
+	assert( from >= 0 && from + count <= getKeyCount() );
+	assert( at >= 0 && at + count <= to.getMaxKeyCount() );
+	getData()->copyTo( from, count, *to.getData(), at );
     }
 
-    void LeafNode::merge( const Node::Entry& e, boost::shared_ptr<Node> z ) {
+    void LeafNode::merge( const Key& key, boost::shared_ptr<Node> z ) {
 	assert( z->getNodeType() == ntLeafNode );
-	assert( (getKeyCount() + z->getKeyCount() + 1) <= LEAF_ENTRIES );
+	assert( (getKeyCount() + z->getKeyCount()) <= getMaxKeyCount() );
 	
-	boost::shared_ptr<LeafNode> leaf = boost::shared_dynamic_cast<LeafNode>(z);
+	LeafNode& leaf = static_cast<LeafNode&>( *z );
 
-	// tack the entry e onto the end of our list of entries, and increment the count
-	setEntry( getKeyCount(), e );
-	setKeyCount( getKeyCount()+1 );
-
-	// go through all of the other leaf node's entries and add them to our own list
-	for( int i = 0; i < leaf->getKeyCount(); i++ ) {
-	    setEntry( getKeyCount(), leaf->getEntry(i) );
-	    setKeyCount( getKeyCount()+1 );
-	}
+	// the separator is only a copy of a key, so there is nothing to
+	// bring down from the parent.  the other leaf's entries are
+	// appended to our own.
+	int n = getKeyCount();
+	leaf.copyTo( 0, leaf.getKeyCount(), *this, n );
+	setKeyCount( n+leaf.getKeyCount() );
     }
 }
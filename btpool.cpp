@@ -0,0 +1,393 @@
+#include "stdinc.h"
+#include "os.h"
+#include "dbg.h"
+#include "bt.h"
+
+namespace bt {
+
+    BlockStore::BlockStore() {
+	_stats._hits = 0;
+	_stats._misses = 0;
+	_stats._evictions = 0;
+	_stats._writes = 0;
+	_blockSize = 0;
+    }
+
+    BlockStore::~BlockStore() {
+    }
+
+    std::ostream& operator << ( std::ostream& os, const BlockStore::Stats& s ) {
+	return os << "hits=" << s._hits
+		  << ", misses=" << s._misses
+		  << ", evictions=" << s._evictions
+		  << ", writes=" << s._writes ;
+    }
+
+
+    BufferPool::BufferPool( int frames ) {
+	assert( frames > 0 );
+
+	Frame f;
+	f._blockno = INVALID_BLOCK_NUMBER;
+	f._buf = NULL;
+	f._latch = NULL;
+	f._pins = 0;
+	f._dirty = false;
+	f._referenced = false;
+	f._io = false;
+	_frames.assign( frames, f );
+
+	// twice as many slots as frames keeps collisions rare, and the
+	// slots are never reallocated, even if the pool grows
+	int slots = 1;
+	while( slots < 2*frames )
+	    slots *= 2;
+	_slots.reset( new Slot[slots] );
+	for( int i = 0; i < slots; i++ ) {
+	    _slots[i]._blockno = INVALID_BLOCK_NUMBER;
+	    _slots[i]._buf = NULL;
+	    _slots[i]._latch = NULL;
+	}
+	_slotMask = slots - 1;
+
+	_log = NULL;
+	_used = 0;
+	_hand = 0;
+    }
+
+    BufferPool::~BufferPool() {
+	for( int i = 0; i < (int) _frames.size(); i++ ) {
+	    delete[] _frames[i]._buf;
+	    delete _frames[i]._latch;
+	}
+    }
+
+    void BufferPool::attach( os::File file, bool writable, int blockSize ) throw(os::IoException) {
+	assert( _map.empty() && _used == 0 );
+	_file = file;
+	_blockSize = blockSize;
+    }
+
+    char* BufferPool::pin( BLOCKNO bn, bool read, os::RWLock** latch ) throw(os::IoException,BufferPoolExhaustedException) {
+	assert( bn != INVALID_BLOCK_NUMBER );
+	os::Lock lock( _mutex );
+
+	for( ;; ) {
+	    std::map<BLOCKNO,int>::iterator pos = _map.find( bn );
+	    if( pos != _map.end() ) {
+		int i = pos->second;
+		Frame& f = _frames[i];
+		if( f._io ) {
+		    // another thread is reading the block in, or writing it
+		    // back, and holds the frame's latch until it is done.  the
+		    // pin keeps the frame from being given another block while
+		    // this thread waits for it.
+		    f._pins++;
+		    waitForFrame( i );
+		    _frames[i]._pins--;
+		    continue;
+		}
+
+		f._pins++;
+		f._referenced = true;
+		if( read ) {
+		    _stats._hits++;
+		} else {
+		    // block is being re-initialized by the caller
+		    os::mem::clear( f._buf, _blockSize );
+		}
+
+		// another block may have taken the slot since this one was read in
+		if( getSlot( bn )._blockno != bn )
+		    setSlot( f );
+
+		if( latch )
+		    *latch = f._latch;
+		return f._buf;
+	    }
+
+	    int i = findVictim();
+	    if( _frames[i]._dirty ) {
+		// the block may have been pinned again, or bn read in, while
+		// it was written back, so look again
+		writeBack( i );
+		continue;
+	    }
+
+	    return load( i, bn, read, latch );
+	}
+    }
+
+    // give frame i, which is clean and unpinned, block bn.  the frame's
+    // latch is held exclusive until the block is in the buffer, and the
+    // mutex is let go of while it is read, so threads pinning other blocks
+    // go on and threads pinning bn wait on the latch.
+    char* BufferPool::load( int i, BLOCKNO bn, bool read, os::RWLock** latch ) throw(os::IoException) {
+	Frame& f = _frames[i];
+	if( f._blockno != INVALID_BLOCK_NUMBER ) {
+	    DBG( dout("bt.pool",3) << "Evicting block " << f._blockno << std::endl );
+	    _map.erase( f._blockno );
+	    _stats._evictions++;
+	}
+
+	if( f._buf == NULL ) {
+	    f._buf = new char[_blockSize];
+	    f._latch = new os::RWLock;
+	}
+
+	// a reader peeking at the block the frame held before sees the latch
+	// version move, and then another block, or none, in the buffer
+	char* buf = f._buf;
+	os::RWLock* l = f._latch;
+	l->lockExclusive();
+
+	f._blockno = bn;
+	f._pins = 1;
+	f._dirty = false;
+	f._referenced = true;
+	f._io = read;
+	_map.insert( std::make_pair( bn, i ) );
+
+	if( read ) {
+	    _stats._misses++;
+
+	    os::File::POS fp = blockOffset( bn, _blockSize );
+	    _mutex.unlock();
+	    try {
+		_file.readAt( fp, buf, _blockSize );
+	    } catch( os::IoException& ) {
+		_mutex.lock();
+		os::mem::clear( buf, _blockSize );
+		Frame& g = _frames[i];
+		_map.erase( bn );
+		g._blockno = INVALID_BLOCK_NUMBER;
+		g._pins--;
+		g._io = false;
+		l->unlockExclusive();
+		throw;
+	    }
+	    _mutex.lock();
+	    _frames[i]._io = false;
+	} else {
+	    os::mem::clear( buf, _blockSize );
+	}
+
+	setSlot( _frames[i] );
+	l->unlockExclusive();
+
+	if( latch )
+	    *latch = l;
+	return buf;
+    }
+
+    // wait, with the mutex let go of, for the thread doing I/O on frame i
+    // to unlock its latch.  _frames may grow meanwhile, so the caller finds
+    // the frame by its index again.
+    void BufferPool::waitForFrame( int i ) {
+	os::RWLock* l = _frames[i]._latch;
+	_mutex.unlock();
+	l->lockShared();
+	l->unlockShared();
+	_mutex.lock();
+    }
+
+    void BufferPool::unpin( BLOCKNO bn ) {
+	os::Lock lock( _mutex );
+	std::map<BLOCKNO,int>::iterator pos = _map.find( bn );
+	assert( pos != _map.end() );
+	Frame& f = _frames[pos->second];
+	assert( f._pins > 0 );
+	f._pins--;
+    }
+
+    void BufferPool::markDirty( BLOCKNO bn ) {
+	os::Lock lock( _mutex );
+	std::map<BLOCKNO,int>::iterator pos = _map.find( bn );
+	assert( pos != _map.end() );
+	Frame& f = _frames[pos->second];
+	assert( f._pins > 0 );
+	f._dirty = true;
+	_dirty.insert( bn );
+	if( _log )
+	    _unlogged.insert( bn );
+    }
+
+    // point the slot of f's block at f.  only called with the mutex held,
+    // so each slot has one writer at a time.
+    void BufferPool::setSlot( Frame& f ) {
+	Slot& s = getSlot( f._blockno );
+	s._version.begin();
+	s._blockno = f._blockno;
+	s._buf = f._buf;
+	s._latch = f._latch;
+	s._version.end();
+    }
+
+    char* BufferPool::peek( BLOCKNO bn, os::RWLock** latch ) {
+	Slot& s = getSlot( bn );
+	long v = s._version.read();
+	if( !os::Version::isStable( v ) )
+	    return NULL;
+
+	BLOCKNO blockno = s._blockno;
+	char* buf = s._buf;
+	os::RWLock* l = s._latch;
+	if( !s._version.validate( v ) || blockno != bn )
+	    return NULL;
+
+	*latch = l;
+	return buf;
+    }
+
+    bool BufferPool::setLog( Log* log ) {
+	_log = log;
+	return true;
+    }
+
+    Log::LSN BufferPool::commitChanges() throw(os::IoException) {
+	assert( _log );
+
+	// the frames cannot be evicted until the group is written, so a
+	// thread pinning a block meanwhile must wait for it
+	os::Lock lock( _mutex );
+	for( std::set<BLOCKNO>::iterator pos = _unlogged.begin(); pos != _unlogged.end(); ++pos ) {
+	    std::map<BLOCKNO,int>::iterator frame = _map.find( *pos );
+	    assert( frame != _map.end() );
+	    _log->append( blockOffset( *pos, _blockSize ), _frames[frame->second]._buf, _blockSize );
+	}
+	_unlogged.clear();
+
+	if( _log->isGroupEmpty() )
+	    return 0;
+	return _log->commit();
+    }
+
+    void BufferPool::flush() throw(os::IoException) {
+	os::Lock lock( _mutex );
+
+	// with a log, only blocks that are already in it can be written
+	if( _log ) {
+	    assert( _unlogged.empty() );
+	    _log->force( _log->getEnd() );
+	}
+
+	// only the blocks dirtied since the last flush are visited.  the
+	// set is ordered by block number, so they go out in file order,
+	// and each run of consecutive dirty blocks is written with a single
+	// vectored write.
+	std::vector<os::File::IoVec> iov;
+	std::set<BLOCKNO>::iterator pos = _dirty.begin();
+	while( pos != _dirty.end() ) {
+	    BLOCKNO first = *pos;
+	    BLOCKNO next = first;
+	    iov.clear();
+	    for( ; pos != _dirty.end() && *pos == next; ++pos, ++next ) {
+		std::map<BLOCKNO,int>::iterator frame = _map.find( next );
+		assert( frame != _map.end() );
+		Frame& f = _frames[frame->second];
+		assert( f._dirty );
+		os::File::IoVec v;
+		v._data = f._buf;
+		v._len = _blockSize;
+		iov.push_back( v );
+		f._dirty = false;
+	    }
+
+	    DBG( dout("bt.pool",2) << "Writing blocks " << first << "-" << (next-1) << " to disk" << std::endl );
+	    _file.writeAtV( blockOffset( first, _blockSize ), &iov[0], iov.size() );
+	    _stats._writes += iov.size();
+	    _dirty.erase( _dirty.begin(), pos );
+	}
+    }
+
+    // write dirty frame i, which is unpinned, back to the file.  forcing
+    // the log and writing can take a while, so the mutex is let go of; the
+    // frame's latch is held exclusive instead, and threads that pin the
+    // block meanwhile wait on it.
+    void BufferPool::writeBack( int i ) throw(os::IoException) {
+	Frame& f = _frames[i];
+	BLOCKNO bn = f._blockno;
+	char* buf = f._buf;
+	os::RWLock* l = f._latch;
+	l->lockExclusive();
+	f._io = true;
+
+	_mutex.unlock();
+	try {
+	    if( _log )
+		_log->force( _log->getEnd() );
+	    DBG( dout("bt.pool",2) << "Writing block " << bn << " to disk" << std::endl );
+	    _file.writeAt( blockOffset( bn, _blockSize ), buf, _blockSize );
+	} catch( os::IoException& ) {
+	    _mutex.lock();
+	    _frames[i]._io = false;
+	    l->unlockExclusive();
+	    throw;
+	}
+	_mutex.lock();
+
+	Frame& g = _frames[i];
+	g._io = false;
+	g._dirty = false;
+	_dirty.erase( bn );
+	_stats._writes++;
+	l->unlockExclusive();
+    }
+
+    // choose a frame to give another block.  a dirty one must be written
+    // back by the caller before it is used.
+    int BufferPool::findVictim() throw(BufferPoolExhaustedException) {
+	// use up frames that have never held a block before evicting anything
+	if( _used < (int) _frames.size() )
+	    return _used++;
+
+	// two full turns of the clock are enough to clear every reference
+	// bit and come back around to an unpinned frame, if there is one.
+	int n = _frames.size();
+	bool unlogged = false;
+	bool busy = false;
+	for( int sweep = 0; sweep < 2*n; sweep++ ) {
+	    int i = _hand;
+	    Frame& f = _frames[i];
+	    _hand = (_hand + 1) % n;
+
+	    if( f._pins > 0 )
+		continue;
+
+	    // another thread is writing it back
+	    if( f._io ) {
+		busy = true;
+		continue;
+	    }
+
+	    // the operation in progress has not committed this change yet
+	    if( f._dirty && _log && _unlogged.count( f._blockno ) ) {
+		unlogged = true;
+		continue;
+	    }
+
+	    if( f._referenced ) {
+		f._referenced = false;
+		continue;
+	    }
+
+	    return i;
+	}
+
+	if( unlogged || busy ) {
+	    DBG( dout("bt.pool",2) << "Growing pool past " << n << " frames" << std::endl );
+	    Frame f;
+	    f._blockno = INVALID_BLOCK_NUMBER;
+	    f._buf = NULL;
+	    f._latch = NULL;
+	    f._pins = 0;
+	    f._dirty = false;
+	    f._referenced = false;
+	    f._io = false;
+	    _frames.push_back( f );
+	    return _used++;
+	}
+
+	throw BufferPoolExhaustedException();
+    }
+}
@@ -4,15 +4,47 @@
 #include "bt.h"
 
 namespace bt {
-    boost::shared_ptr<Node> BTree::readNode( BLOCKNO bn ) throw(os::IoException,FileCorruptedException) {
-	char* buf = new char[BLOCK_SIZE];
+    // wrap the pinned node at bn, which the wrapper unpins when it goes.
+    // the wrapper and its reference count come from the Slab.
+    boost::shared_ptr<Node> BTree::makeNode( BLOCKNO bn, Node::Data* pData ) {
+	try {
+	    if( pData->getType() == ntInternalNode )
+		return boost::allocate_shared<InternalNode>( SlabAllocator<InternalNode>(), _store.get(), bn, pData );
+	    return boost::allocate_shared<LeafNode>( SlabAllocator<LeafNode>(), _store.get(), bn, pData );
+	} catch( ... ) {
+	    _store->unpin( bn );
+	    throw;
+	}
+    }
+
+    boost::shared_ptr<FragmentBlock> BTree::makeFragmentBlock( BLOCKNO bn, FragmentBlock::Data* pData ) {
+	try {
+	    return boost::allocate_shared<FragmentBlock>( SlabAllocator<FragmentBlock>(), _store.get(), bn, pData );
+	} catch( ... ) {
+	    _store->unpin( bn );
+	    throw;
+	}
+    }
+
+    // read and latch the node at bn.  if wait is false and the latch is
+    // not free, the node is released again and NULL returned.
+    boost::shared_ptr<Node> BTree::readNode( BLOCKNO bn, LATCHMODE lm, bool wait ) throw(os::IoException,FileCorruptedException) {
+	os::RWLock* latch;
+	char* buf = _store->pin( bn, true, &latch );
 
-	os::File::POS fp = bn * (os::File::POS) BLOCK_SIZE;
-	
-	_file.seek( fp, os::File::SeekAbsolute );
-	_file.read( buf, BLOCK_SIZE );
+	// not constructed in place, since that would look at the block
+	// before it is latched
+	Node::Data* pData = reinterpret_cast<Node::Data*>( buf );
+	boost::shared_ptr<Node> x = makeNode( bn, pData );
 
-	boost::shared_ptr<Node::Data> pData( new(buf) Node::Data() );
+	// the block is only checked once it is latched, so no writer can be
+	// part way through changing it.  if it is not a valid node, x lets
+	// go of the latch on the way out.
+	x->setLatch( latch );
+	if( wait )
+	    x->latch( lm );
+	else if( !x->tryLatch( lm ) )
+	    return boost::shared_ptr<Node>();
 
 	if( pData->getMagic() != NODE_MAGIC_VALUE )
 	    throw FileCorruptedException();
@@ -20,22 +52,37 @@ namespace bt {
 	if( pData->getBlockNumber() != bn ) 
 	    throw FileCorruptedException();
 
-	if( pData->getType() == ntInternalNode ) {
-	    return boost::shared_ptr<Node>( new InternalNode(bn,pData) );
-	} else {
-	    return boost::shared_ptr<Node>( new LeafNode(bn,pData) );
+	// the node's keys and capacity must match the geometry of the file
+	const KeyFormat& kf = _header.getKeyFormat();
+	if( !pData->hasKeyFormat( kf ) )
+	    throw FileCorruptedException();
+
+	int max, base;
+	int plen = pData->getPrefixLength();
+	switch( pData->getType() ) {
+	case ntInternalNode:
+	    max = InternalNode::getCapacity( _header.getBlockSize(), kf, plen );
+	    base = InternalNode::getCapacity( _header.getBlockSize(), kf );
+	    break;
+	case ntLeafNode:
+	    max = LeafNode::getCapacity( _header.getBlockSize(), kf, plen );
+	    base = LeafNode::getCapacity( _header.getBlockSize(), kf );
+	    break;
+	default:
+	    throw FileCorruptedException();
 	}
+
+	if( pData->getMaxKeyCount() != max || pData->getBaseKeyCount() != base || pData->getKeyCount() < 0 || pData->getKeyCount() > max )
+	    throw FileCorruptedException();
+
+	return x;
     }
     
     boost::shared_ptr<FragmentBlock> BTree::readFragmentBlock( BLOCKNO bn ) throw(os::IoException,FileCorruptedException) {
-	char* buf = new char[BLOCK_SIZE];
+	char* buf = _store->pin( bn );
 
-	os::File::POS fp = bn * (os::File::POS) BLOCK_SIZE;
-	
-	_file.seek( fp, os::File::SeekAbsolute );
-	_file.read( buf, BLOCK_SIZE );
-
-	boost::shared_ptr<FragmentBlock::Data> pData( new(buf) FragmentBlock::Data() );
+	FragmentBlock::Data* pData = new(buf) FragmentBlock::Data();
+	boost::shared_ptr<FragmentBlock> fb = makeFragmentBlock( bn, pData );
 
 	if( pData->getMagic() != FRAGMENT_MAGIC_VALUE )
 	    throw FileCorruptedException();
@@ -43,6 +90,9 @@ namespace bt {
 	if( pData->getBlockNumber() != bn ) 
 	    throw FileCorruptedException();
 
-	return boost::shared_ptr<FragmentBlock>( new FragmentBlock(pData) );
+	if( pData->getFragmentCount() != _header.getFragsPerBlock() )
+	    throw FileCorruptedException();
+
+	return fb;
     }
 }
@@ -4,29 +4,204 @@
 #include "bt.h"
 
 namespace bt {
-    bool BTree::search( int key, char* data ) throw(os::IoException,FileCorruptedException) {
-	return search( _root, key, data );
+
+    // how many times a search starts over from the root when writers get
+    // in its way, before it latches its way down instead
+    static const int OPTIMISTIC_RETRIES = 4;
+
+    bool BTree::search( const Key& given, char* data ) throw(os::IoException,FileCorruptedException,KeyTypeException) {
+	Key wide;
+	const Key& key = checkKey( given, wide );
+
+	bool found;
+	for( int i = 0; i < OPTIMISTIC_RETRIES; i++ ) {
+	    if( searchOptimistic( key, data, found ) )
+		return found;
+	    os::Lock lock( _searchMutex );
+	    _searchStats._retries++;
+	}
+
+	{
+	    os::Lock lock( _searchMutex );
+	    _searchStats._fallbacks++;
+	}
+	return search( latchRoot( lmShared ), key, data );
+    }
+
+    BTree::SearchStats BTree::getSearchStats() {
+	os::Lock lock( _searchMutex );
+	return _searchStats;
+    }
+
+    std::ostream& operator << ( std::ostream& os, const BTree::SearchStats& s ) {
+	return os << "retries=" << s._retries
+		  << ", fallbacks=" << s._fallbacks ;
     }
 
-    bool BTree::search( boost::shared_ptr<Node> x, int k, char* d ) throw(os::IoException,FileCorruptedException) {
-	int i;
-	for( i = 0; i < x->getKeyCount() && k > x->getEntry(i)._key; i++ )
-	    ;
-	const Node::Entry& e = x->getEntry(i);
-	if( i < x->getKeyCount() && k == e._key ) {
+    // search without latching the internal nodes, or the leaf if the
+    // entry's data is in it.  each node's latch version is read before
+    // the node is used, and the node is only trusted once the version is
+    // found unchanged.  the version of the parent is checked again after
+    // the child's is read, so the child was still the parent's child
+    // then, and cannot have been freed.  returns false if the search
+    // must start over.
+    bool BTree::searchOptimistic( const Key& k, char* d, bool& found ) throw(os::IoException,FileCorruptedException) {
+	int blockSize = _header.getBlockSize();
+	const KeyFormat& kf = _header.getKeyFormat();
+
+	// the root's block number is guarded by _rootLatch
+	const os::Version* parent = &_rootLatch.getVersion();
+	long pv = parent->read();
+	if( !os::Version::isStable( pv ) )
+	    return false;
+	BLOCKNO bn = _header.getRoot();
+
+	// a block that is not in memory is pinned while it is used, and
+	// until its child has been checked against it.  the pin is held by a
+	// node wrapped around the block, which is never latched nor trusted
+	// to hold a node until the block has been checked.
+	boost::shared_ptr<Node> pinned, parentPinned;
+
+	for( ;; ) {
+	    os::RWLock* latch;
+	    const char* buf = _store->peek( bn, &latch );
+	    if( buf == NULL ) {
+		char* p = _store->pin( bn, true, &latch );
+		pinned = makeNode( bn, reinterpret_cast<Node::Data*>( p ) );
+		buf = p;
+	    }
+
+	    const os::Version& version = latch->getVersion();
+	    long v = version.read();
+	    if( !os::Version::isStable( v ) || !parent->validate( pv ) )
+		return false;
+	    parentPinned = pinned;
+	    pinned.reset();
+
+	    NODETYPE nt;
+	    int n, plen;
+	    if( !Node::peekHeader( buf, bn, blockSize, kf, nt, n, plen ) )
+		return false;
+
+	    if( nt == ntInternalNode ) {
+		BLOCKNO child = InternalNode::peekChild( buf, blockSize, kf, plen, n, k );
+		if( !version.validate( v ) )
+		    return false;
+		parent = &version;
+		pv = v;
+		bn = child;
+		continue;
+	    }
+
+	    Node::Entry e;
+	    BLOCKNO next;
+	    found = LeafNode::peekEntry( buf, blockSize, kf, plen, n, k, e, next );
+	    if( !version.validate( v ) )
+		return false;
+	    if( !found && next == INVALID_BLOCK_NUMBER )
+		return true;
+
+	    // the next leaf can only be freed by merging it into this one,
+	    // which changes this leaf, so it is checked against this leaf
+	    // as a child is against its parent
+	    if( !found ) {
+		parent = &version;
+		pv = v;
+		bn = next;
+		continue;
+	    }
 
 	    if( e._et == etComplete ) {
+		if( e._len < 0 || e._len > NODE_DATA_LEN )
+		    return false;
 		os::mem::copy( d, e._data, e._len );
-	    } else {
-		readOverflowEntry( e, d );
+		return true;
 	    }
-	    
+
+	    // the rest of the data is in fragments or an extent, which are
+	    // only safe to read with the leaf latched.  the latch is only
+	    // good if the leaf did not change before it was taken.
+	    boost::shared_ptr<Node> x;
+	    try {
+		x = readNode( bn, lmShared );
+	    } catch( FileCorruptedException& ) {
+		if( version.validate( v ) )
+		    throw;
+		return false;
+	    }
+	    if( !version.validate( v ) )
+		return false;
+
+	    found = search( x, k, d );
 	    return true;
 	}
-	if( x->isLeaf() )
+    }
+
+    bool BTree::search( boost::shared_ptr<Node> x, const Key& k, char* d ) throw(os::IoException,FileCorruptedException) {
+	// internal nodes only route the search, every entry is in a leaf.
+	// each child is latched before its parent is let go.
+	while( !x->isLeaf() )
+	    x = readNode( x->getChild( findChild( x, k ) ), lmShared );
+
+	// the first entry with key k starts the next leaf if it is not in
+	// this one, and k is the separator between them
+	boost::shared_ptr<LeafNode> lx = boost::shared_static_cast<LeafNode>( x );
+	int i = lx->lowerBound( k );
+	while( i == lx->getKeyCount() && lx->getNext() != INVALID_BLOCK_NUMBER ) {
+	    Fence hi = lx->getHighFence();
+	    if( !hi._bounded || hi._key != k )
+		break;
+	    x = readNode( lx->getNext(), lmShared );
+	    if( !x->isLeaf() )
+		throw FileCorruptedException();
+	    lx = boost::shared_static_cast<LeafNode>( x );
+	    i = lx->lowerBound( k );
+	}
+	if( i == lx->getKeyCount() || k != lx->getKey(i) )
 	    return false;
-	boost::shared_ptr<Node> n = readNode( x->getChild(i) );
-	return search( n, k, d );
+
+	Node::Entry e = lx->getEntry(i);
+	switch( e._et ) {
+	case etComplete:
+	    os::mem::copy( d, e._data, e._len );
+	    break;
+	case etOverflow:
+	    readOverflowEntry( e, d );
+	    break;
+	case etExtent:
+	    readExtentEntry( e, d );
+	    break;
+	default:
+	    throw FileCorruptedException();
+	}
+	    
+	return true;
+    }
+
+    // find the first or the last child of internal node x whose subtree
+    // covers key k.  see InternalNode::findChild.
+    int BTree::findChild( boost::shared_ptr<Node> x, const Key& k ) {
+	assert( !x->isLeaf() );
+	return boost::shared_static_cast<InternalNode>( x )->findChild( k );
+    }
+
+    int BTree::findLastChild( boost::shared_ptr<Node> x, const Key& k ) {
+	assert( !x->isLeaf() );
+	return boost::shared_static_cast<InternalNode>( x )->findLastChild( k );
+    }
+
+    // every key passed to the tree must be of its key format, except that
+    // a tree of int64 keys also takes int keys.  the key to use is
+    // returned: k itself, or k widened to an int64 in wide.
+    const Key& BTree::checkKey( const Key& k, Key& wide ) throw(KeyTypeException) {
+	const KeyFormat& kf = _header.getKeyFormat();
+	if( kf.fits( k ) )
+	    return k;
+	if( kf.getType() == ktInt64 && k.getType() == ktInt ) {
+	    wide = Key( (int64_t) k.toInt() );
+	    return wide;
+	}
+	throw KeyTypeException();
     }
 
     // read data from an overflow entry and the chained fragments into
@@ -0,0 +1,87 @@
+#include "stdinc.h"
+#include "os.h"
+#include "dbg.h"
+#include "bt.h"
+
+namespace bt {
+
+    // the free chunks of one thread, a list for each size.  a free chunk
+    // holds the pointer to the next chunk on its list.
+    struct SlabCache {
+	void*	_free[SLAB_CLASSES];
+	int	_count[SLAB_CLASSES];
+    };
+
+    // called when a thread exits, to give its free chunks back to the heap
+    static void releaseSlabCache( void* p ) {
+	SlabCache* c = static_cast<SlabCache*>( p );
+	for( int i = 0; i < SLAB_CLASSES; i++ ) {
+	    while( c->_free[i] != NULL ) {
+		void* next = *static_cast<void**>( c->_free[i] );
+		::operator delete( c->_free[i] );
+		c->_free[i] = next;
+	    }
+	}
+	delete c;
+    }
+
+    static SlabCache& getSlabCache() {
+	// never destroyed, so chunks can still be freed while other static
+	// objects are destroyed
+	static os::ThreadLocal* caches = new os::ThreadLocal( releaseSlabCache );
+
+	SlabCache* c = static_cast<SlabCache*>( caches->get() );
+	if( c == NULL ) {
+	    c = new SlabCache;
+	    for( int i = 0; i < SLAB_CLASSES; i++ ) {
+		c->_free[i] = NULL;
+		c->_count[i] = 0;
+	    }
+	    caches->set( c );
+	}
+	return *c;
+    }
+
+    // the list a chunk of size bytes goes on, or SLAB_CLASSES if it is
+    // too large for any
+    static inline int getSlabClass( size_t size ) {
+	if( size == 0 )
+	    return 0;
+	return (int) std::min( (size - 1) / SLAB_GRAIN, (size_t) SLAB_CLASSES );
+    }
+
+    void* Slab::allocate( size_t size ) throw(std::bad_alloc) {
+	int sc = getSlabClass( size );
+	if( sc == SLAB_CLASSES )
+	    return ::operator new( size );
+
+	SlabCache& c = getSlabCache();
+	void* p = c._free[sc];
+	if( p == NULL )
+	    return ::operator new( (sc+1) * SLAB_GRAIN );
+
+	c._free[sc] = *static_cast<void**>( p );
+	c._count[sc]--;
+	return p;
+    }
+
+    void Slab::release( void* p, size_t size ) {
+	int sc = getSlabClass( size );
+	if( sc == SLAB_CLASSES ) {
+	    ::operator delete( p );
+	    return;
+	}
+
+	// a thread that frees more than it allocates, such as one that
+	// cleans up after others, does not hoard the chunks
+	SlabCache& c = getSlabCache();
+	if( c._count[sc] == SLAB_CACHED ) {
+	    ::operator delete( p );
+	    return;
+	}
+
+	*static_cast<void**>( p ) = c._free[sc];
+	c._free[sc] = p;
+	c._count[sc]++;
+    }
+}
@@ -17,16 +17,622 @@ public:
     }
 };
 
+static const int count = 2000;
+
+std::vector< std::pair<int,std::string> > values;
+int indices[count];
+
+// keep track of which items are deleted using a bitset
+std::bitset<count> deleted;
+
+
+//
+// checks that a scan returns the undeleted items in key order
+//
+class ScanChecker : public bt::ScanCallback {
+public:
+    int _last;
+
+    ScanChecker() : _last(-1) {}
+
+    virtual bool operator () ( const bt::Key& k, const char* data, int len ) {
+	int key = k.toInt();
+	if( key <= _last )
+	    throw TestException( "scan returned keys out of order" );
+	if( deleted.test( key ) )
+	    throw TestException( "scan returned deleted item" );
+	if( values[key].second != data || (int) values[key].second.length()+1 != len )
+	    throw TestException( "scan did not match correct item" );
+	_last = key;
+	return true;
+    }
+};
+
+//
+// a tree that can be abandoned as though the process died.  whatever
+// has not reached the file yet is dropped instead of being written.
+//
+class CrashingTree : public bt::BTree {
+public:
+    void crash() {
+	_store.reset( new bt::BufferPool );
+	_log.reset();
+	_file = os::File();
+    }
+
+    // crash part way through a bulk load.  the loader is left as it is,
+    // and the latches it holds on the tree are let go of.
+    void crashLoading() {
+	crash();
+	_rootLatch.unlockExclusive();
+	_writeMutex.unlock();
+    }
+};
+
+
+//
+// test retrieval of every item, deleted or not
+//
+void verify( bt::BTree& bt ) {
+    unsigned int start, end;
+	
+    start = os::getTicks();
+
+    for( int i = 0; i < count; i++ ) {
+	std::pair<int,std::string> data = values[ indices[i] ];
+
+	if( bt.search( data.first, sz ) ) {
+	    // item found
+		
+	    // was it deleted?
+	    if( deleted.test( data.first ) )
+		throw TestException( "search incorrectly returned deleted item" );
+	    if( data.second != sz )
+		throw TestException( "search did not match correct item" );
+	} else {
+	    // item not found
+		
+	    // was it deleted?
+	    if( !deleted.test( data.first ) )
+		throw TestException( "search failed to find expected item" );
+	}
+    }
+	
+    end = os::getTicks();
+
+    std::cout << "retrieval took " << (end-start) << "ms." << std::endl;
+
+    //
+    // test range scans over all of the items, and over a slice of them
+    //
+    
+    start = os::getTicks();
+
+    ScanChecker all;
+    if( bt.scan( 0, count-1, all ) != count - (int) deleted.count() )
+	throw TestException( "scan missed items" );
+
+    ScanChecker slice;
+    int n = bt.scan( count/4, count/2, slice );
+    for( int i = count/4; i <= count/2; i++ )
+	if( !deleted.test(i) )
+	    n--;
+    if( n != 0 )
+	throw TestException( "scan of a slice returned the wrong count of items" );
+
+    // walk backwards with a cursor
+    bt::Cursor c( bt );
+    int last = count;
+    for( bool ok = c.last(); ok; ok = c.prev() ) {
+	if( c.getKey().toInt() >= last )
+	    throw TestException( "cursor returned keys out of order" );
+	last = c.getKey().toInt();
+	n++;
+    }
+    if( n != count - (int) deleted.count() )
+	throw TestException( "cursor missed items" );
+	
+    end = os::getTicks();
+
+    std::cout << "scans took " << (end-start) << "ms." << std::endl;
+
+    std::cout << "block store: " << bt.getStoreStats() << std::endl;
+}
+
+//
+// build a tree with keys of format kf from keys, given in key order,
+// inserted in a shuffled order, remove every third key, and check the
+// rest are found and come back from a cursor in order, before and after
+// the tree is reopened
+//
+void testKeyFormat( const bt::KeyFormat& kf, const std::vector<bt::Key>& keys ) {
+    std::vector<int> order( keys.size() );
+    int i;
+    for( i = 0; i < (int) keys.size(); i++ )
+	order[i] = i;
+    std::random_shuffle( order.begin(), order.end() );
+
+    {
+	bt::BTree bt;
+	bt.create( std::string( "keys.dat" ), 512, kf );
+	for( i = 0; i < (int) keys.size(); i++ ) {
+	    sprintf( sz, "%d", order[i] );
+	    bt.insert( keys[order[i]], sz, strlen(sz)+1 );
+	}
+	for( i = 0; i < (int) keys.size(); i += 3 )
+	    if( !bt.remove( keys[i] ) )
+		throw TestException( "remove did not find key" );
+    }
+
+    bt::BTree bt;
+    bt.open( std::string( "keys.dat" ) );
+    for( i = 0; i < (int) keys.size(); i++ ) {
+	bool found = bt.search( keys[i], sz );
+	if( found != (i % 3 != 0) || (found && atoi(sz) != i) )
+	    throw TestException( "search did not match correct item" );
+    }
+
+    bt::Cursor c( bt );
+    bool ok;
+    for( ok = c.first(), i = 1; ok; ok = c.next(), i += (i % 3 == 2) ? 2 : 1 ) {
+	if( i >= (int) keys.size() || c.getKey() != keys[i] )
+	    throw TestException( "cursor returned keys out of order" );
+    }
+    if( i < (int) keys.size() )
+	throw TestException( "cursor missed items" );
+}
+
+//
+// collects what a scan returns
+//
+class ScanCollector : public bt::ScanCallback {
+public:
+    std::vector<std::string> _data;
+
+    virtual bool operator () ( const bt::Key& k, const char* data, int len ) {
+	_data.push_back( data );
+	return true;
+    }
+};
+
+//
+// a tree of int64 keys takes plain int keys as the same int64s
+//
+void testIntKeysOnInt64() {
+    static const int keys = 1000;
+    int i;
+
+    bt::BTree bt;
+    bt.create( std::string( "keys.dat" ), 512, bt::KeyFormat( bt::ktInt64 ) );
+    for( i = -keys/2; i < keys/2; i++ ) {
+	sprintf( sz, "%d", i );
+	bt.insert( i, sz, strlen(sz)+1 );
+    }
+
+    for( i = -keys/2; i < keys/2; i++ ) {
+	if( !bt.search( i, sz ) || atoi(sz) != i )
+	    throw TestException( "search by int did not find int64 key" );
+	if( !bt.search( (int64_t) i, sz ) || atoi(sz) != i )
+	    throw TestException( "search by int64 did not find key inserted as int" );
+    }
+
+    {
+	bt::Cursor c( bt );
+	if( !c.seek( -1 ) || c.getKey() != bt::Key( (int64_t) -1 ) )
+	    throw TestException( "seek by int did not find int64 key" );
+    }
+    ScanCollector sc;
+    if( bt.scan( -10, 9, sc ) != 20 )
+	throw TestException( "scan by int missed int64 keys" );
+    for( i = -keys/2; i < keys/2; i += 2 )
+	if( !bt.remove( i ) )
+	    throw TestException( "remove by int did not find int64 key" );
+    if( bt.search( (int64_t) -keys/2, sz ) || !bt.search( (int64_t) 1-keys/2, sz ) )
+	throw TestException( "remove by int removed the wrong key" );
+}
+
+//
+// insert runs of entries with equal keys into a tree of small blocks,
+// so that each run is split across leaves, and check that search, scan,
+// seek and remove reach every entry of a run, first to last
+//
+void testDuplicates() {
+    static const int keys = 10, copies = 40;
+    int i, j;
+
+    bt::BTree bt;
+    bt.create( std::string( "dups.dat" ), 256 );
+    for( j = 0; j < copies; j++ ) {
+	for( i = 0; i < keys; i++ ) {
+	    sprintf( sz, "%d/%d", i, j );
+	    bt.insert( i, sz, strlen(sz)+1 );
+	}
+    }
+
+    for( i = 0; i < keys; i++ ) {
+	sprintf( sz, "%d/0", i );
+	std::string first( sz );
+	if( !bt.search( i, sz ) || first != sz )
+	    throw TestException( "search did not find the first of equal keys" );
+
+	ScanCollector sc;
+	if( bt.scan( i, i, sc ) != copies )
+	    throw TestException( "scan missed equal keys" );
+	for( j = 0; j < copies; j++ ) {
+	    sprintf( sz, "%d/%d", i, j );
+	    if( sc._data[j] != sz )
+		throw TestException( "scan returned equal keys out of order" );
+	}
+
+	bt::Cursor c( bt );
+	bool ok;
+	for( ok = c.seek( i ), j = 0; ok && c.getKey() == i; ok = c.next() )
+	    j++;
+	if( j != copies )
+	    throw TestException( "cursor missed equal keys" );
+    }
+
+    int n = 0;
+    bt::Cursor c( bt );
+    for( bool ok = c.last(); ok; ok = c.prev() )
+	n++;
+    if( n != keys*copies )
+	throw TestException( "cursor missed items" );
+
+    // the earliest entries go first
+    for( j = 0; j < copies/2; j++ )
+	if( !bt.remove( 3 ) )
+	    throw TestException( "remove did not find equal key" );
+    if( !bt.search( 3, sz ) || std::string( sz ) != "3/20" )
+	throw TestException( "remove did not take the first of equal keys" );
+
+    for( i = 0; i < keys; i++ ) {
+	for( j = (i == 3) ? copies/2 : 0; j < copies; j++ )
+	    if( !bt.remove( i ) )
+		throw TestException( "remove did not find equal key" );
+	if( bt.remove( i ) || bt.search( i, sz ) )
+	    throw TestException( "equal keys left after they were removed" );
+    }
+    if( c.first() )
+	throw TestException( "cursor found items in empty tree" );
+}
+
+//
+// crash a tree part way through a bulk load that has committed some of
+// its blocks, and check that the reopened tree is empty and still works
+//
+void testCrashedLoad() {
+    static const int keys = 3000;
+    int i;
+
+    bt::BLOCKNO blocks;
+    {
+	CrashingTree bt;
+	bt.create( std::string( "crash.dat" ), bt::MIN_BLOCK_SIZE );
+	blocks = bt.getBlockCount();
+
+	// the loader goes down with the process, so it is never finished
+	// or destroyed, and the latches it holds go with the tree
+	bt::BulkLoader* loader = new bt::BulkLoader( bt, 100 );
+	for( i = 0; i < keys; i++ ) {
+	    sprintf( sz, "%d", i );
+	    loader->add( i, sz, strlen(sz)+1 );
+	}
+	if( bt.getBlockCount() - blocks <= bt::BULK_FLUSH_BLOCKS )
+	    throw TestException( "bulk load was too small to commit part way" );
+	bt.crashLoading();
+    }
+
+    bt::BTree bt;
+    bt.open( std::string( "crash.dat" ) );
+    if( bt.getBlockCount() <= blocks )
+	throw TestException( "bulk load committed nothing before the crash" );
+
+    bt::Cursor c( bt );
+    if( c.first() )
+	throw TestException( "cursor found items loaded before a crash" );
+    for( i = 0; i < keys; i += 97 )
+	if( bt.search( i, sz ) )
+	    throw TestException( "search found item loaded before a crash" );
+
+    for( i = keys-1; i >= 0; i-- ) {
+	sprintf( sz, "%d", i );
+	bt.insert( i, sz, strlen(sz)+1 );
+    }
+    int n = 0;
+    for( bool ok = c.first(); ok; ok = c.next() ) {
+	sprintf( sz, "%d", n );
+	if( c.getKey() != n || c.getLength() != (int) strlen(sz)+1 )
+	    throw TestException( "cursor did not match items inserted after a crash" );
+	n++;
+    }
+    if( n != keys )
+	throw TestException( "cursor missed items inserted after a crash" );
+}
+
+//
+// the tree testConcurrency shares between its threads, with a small pool
+// so blocks are read in and written back while the threads run
+//
+class WatchedTree : public bt::BTree {
+public:
+    WatchedTree() : bt::BTree( bt::smBuffered, 64 ) {}
+
+    // count the levels of the tree, down its left edge
+    int getHeight() {
+	int h = 1;
+	boost::shared_ptr<bt::Node> x = latchRoot( bt::lmShared );
+	for( ; !x->isLeaf(); h++ )
+	    x = readNode( x->getChild( 0 ), bt::lmShared );
+	return h;
+    }
+};
+
+static const int CONCURRENT_KEYS = 3000;
+static const int CONCURRENT_READERS = 4;
+static const int CONCURRENT_ROUNDS = 2;
+
+// only every STABLE_KEYth key stays in the tree throughout
+static const int STABLE_KEY = 50;
+
+// the value of key k, some of them too long for a leaf
+std::string concurrentValue( int k ) {
+    int len = (k % 7 == 0) ? 200 + k % 300 : 4 + k % 30;
+    char digits[16];
+    sprintf( digits, "%d", k );
+    std::string s( len, 'a' + k % 26 );
+    return s.replace( 0, strlen(digits), digits );
+}
+
+class Concurrency {
+protected:
+    os::Mutex		_mutex;
+    bool		_done;
+    std::string		_error;
+
+public:
+    WatchedTree		_tree;
+    int			_keys;		// keys are from 0 to _keys-1
+    bool		_scans;		// readers scan as well as search
+    long		_reads;
+
+    Concurrency( int keys, bool scans ) : _done(false), _keys(keys), _scans(scans), _reads(0) {}
+
+    bool isDone() {
+	os::Lock lock( _mutex );
+	return _done || !_error.empty();
+    }
+
+    void finish() {
+	os::Lock lock( _mutex );
+	_done = true;
+    }
+
+    // only the first failure is kept, and it stops the other threads
+    void fail( std::string error ) {
+	os::Lock lock( _mutex );
+	if( _error.empty() )
+	    _error = error;
+    }
+
+    std::string getError() {
+	os::Lock lock( _mutex );
+	return _error;
+    }
+
+    void addReads( long n ) {
+	os::Lock lock( _mutex );
+	_reads += n;
+    }
+};
+
+//
+// search, and scan if asked to, until the writer is done.  a stable key must always be
+// found, a scan must not pass over one, and whatever is found must have
+// its key's value.
+//
+void readConcurrently( void* p ) {
+    Concurrency& cc = *static_cast<Concurrency*>( p );
+    char data[1024];
+    unsigned int r = (unsigned int)(size_t) &data;
+    long reads = 0;
+
+    try {
+	while( !cc.isDone() ) {
+	    r = r * 1103515245 + 12345;
+	    int k = (r >> 8) % cc._keys;
+
+	    if( !cc._scans || (r >> 4) % 4 != 0 ) {
+		bool found = cc._tree.search( k, data );
+		if( !found && k % STABLE_KEY == 0 )
+		    throw TestException( "concurrent search missed a stable key" );
+		if( found && concurrentValue( k ) != data )
+		    throw TestException( "concurrent search did not match correct item" );
+	    } else {
+		int lastStable = (cc._keys-1) - (cc._keys-1) % STABLE_KEY;
+		bt::Cursor c( cc._tree );
+		int last = -1;
+		bool ok;
+		int n;
+		for( ok = c.seek( k ), n = 0; ok && n < 100; ok = c.next(), n++ ) {
+		    int key = c.getKey().toInt();
+		    if( key <= last )
+			throw TestException( "concurrent cursor returned keys out of order" );
+		    int stable = (last < 0 ? k : last+1) + STABLE_KEY-1;
+		    if( key > stable - stable % STABLE_KEY )
+			throw TestException( "concurrent cursor passed over a stable key" );
+		    if( c.getLength() > (int) sizeof(data) )
+			throw TestException( "concurrent cursor returned too long an item" );
+		    c.getData( data );
+		    if( concurrentValue( key ) != data )
+			throw TestException( "concurrent cursor did not match correct item" );
+		    last = key;
+		}
+		if( !ok && k <= lastStable && last < lastStable )
+		    throw TestException( "concurrent cursor ended before the last stable key" );
+	    }
+	    reads++;
+	}
+    } catch( std::exception& x ) {
+	cc.fail( x.what() );
+    }
+    cc.addReads( reads );
+}
+
+//
+// insert the keys that are not stable, in a shuffled order, until the
+// tree grows a level, and remove them again, until its root collapses
+// back to where it was
+//
+void writeConcurrently( void* p ) {
+    Concurrency& cc = *static_cast<Concurrency*>( p );
+    char data[1024];
+
+    try {
+	std::vector<int> keys;
+	for( int k = 0; k < cc._keys; k++ )
+	    if( k % STABLE_KEY != 0 )
+		keys.push_back( k );
+
+	int height = cc._tree.getHeight();
+	for( int round = 0; round < CONCURRENT_ROUNDS && !cc.isDone(); round++ ) {
+	    int i;
+	    std::random_shuffle( keys.begin(), keys.end() );
+	    for( i = 0; i < (int) keys.size(); i++ ) {
+		std::string value = concurrentValue( keys[i] );
+		cc._tree.insert( keys[i], value.c_str(), value.length()+1 );
+		if( !cc._tree.search( keys[i], data ) || value != data )
+		    throw TestException( "search did not find item just inserted" );
+	    }
+	    if( cc._tree.getHeight() <= height )
+		throw TestException( "concurrent inserts did not split the root" );
+
+	    std::random_shuffle( keys.begin(), keys.end() );
+	    for( i = 0; i < (int) keys.size(); i++ ) {
+		if( !cc._tree.remove( keys[i] ) )
+		    throw TestException( "remove did not find item inserted" );
+		if( cc._tree.search( keys[i], data ) )
+		    throw TestException( "search found item just removed" );
+	    }
+	    if( cc._tree.getHeight() != height )
+		throw TestException( "concurrent removes did not collapse the root" );
+	}
+    } catch( std::exception& x ) {
+	cc.fail( x.what() );
+    }
+    cc.finish();
+}
+
+//
+// fill a tree with the stable keys, and read it from several threads
+// while write changes it on this one
+//
+void runConcurrently( Concurrency& cc, void (*write)( void* ) ) {
+    int i;
+    cc._tree.create( std::string( "threads.dat" ), 512 );
+    for( i = 0; i < cc._keys; i += STABLE_KEY ) {
+	std::string value = concurrentValue( i );
+	cc._tree.insert( i, value.c_str(), value.length()+1 );
+    }
+
+    std::vector< boost::shared_ptr<os::Thread> > threads;
+    for( i = 0; i < CONCURRENT_READERS; i++ )
+	threads.push_back( boost::shared_ptr<os::Thread>( new os::Thread( readConcurrently, &cc ) ) );
+    write( &cc );
+    for( i = 0; i < (int) threads.size(); i++ )
+	threads[i]->join();
+
+    if( !cc.getError().empty() )
+	throw TestException( cc.getError() );
+    if( cc._reads == 0 )
+	throw TestException( "concurrent readers did not get to read" );
+    std::cout << cc._reads << " concurrent reads, " << cc._tree.getSearchStats() << std::endl;
+}
+
+//
+// search and scan a tree from several threads while another splits and
+// merges its nodes, and check the stable keys are all that is left
+//
+void testConcurrency() {
+    int i;
+    Concurrency cc( CONCURRENT_KEYS, true );
+    runConcurrently( cc, writeConcurrently );
+
+    bt::Cursor c( cc._tree );
+    bool ok;
+    for( ok = c.first(), i = 0; ok; ok = c.next(), i += STABLE_KEY ) {
+	if( c.getKey() != i )
+	    throw TestException( "cursor did not return the stable keys" );
+	c.getData( sz );
+	if( concurrentValue( i ) != sz )
+	    throw TestException( "cursor did not match correct item" );
+    }
+    if( i != CONCURRENT_KEYS )
+	throw TestException( "cursor missed stable keys" );
+}
+
+//
+// insert and remove the keys of a few leaves over and over, until the
+// readers searching them have had to fall back to latching their way
+// down, and for at least CONFLICT_ROUNDS
+//
+static const int CONFLICT_KEYS = 200;
+static const int CONFLICT_ROUNDS = 5;
+
+void writeConflicting( void* p ) {
+    Concurrency& cc = *static_cast<Concurrency*>( p );
+
+    try {
+	std::vector<int> keys;
+	for( int k = 0; k < cc._keys; k++ )
+	    if( k % STABLE_KEY != 0 )
+		keys.push_back( k );
+
+	for( int round = 0; !cc.isDone(); round++ ) {
+	    if( round >= CONFLICT_ROUNDS && cc._tree.getSearchStats()._fallbacks > 0 )
+		break;
+	    if( round >= 100*CONFLICT_ROUNDS )
+		throw TestException( "searches never fell back to latching" );
+
+	    int i;
+	    std::random_shuffle( keys.begin(), keys.end() );
+	    for( i = 0; i < (int) keys.size(); i++ ) {
+		std::string value = concurrentValue( keys[i] );
+		cc._tree.insert( keys[i], value.c_str(), value.length()+1 );
+	    }
+	    std::random_shuffle( keys.begin(), keys.end() );
+	    for( i = 0; i < (int) keys.size(); i++ )
+		if( !cc._tree.remove( keys[i] ) )
+		    throw TestException( "remove did not find item inserted" );
+	}
+    } catch( std::exception& x ) {
+	cc.fail( x.what() );
+    }
+    cc.finish();
+}
+
+//
+// search the leaves a writer is splitting and merging, and check the
+// searches that ran into it started over, and fell back to latching
+//
+void testSearchConflicts() {
+    Concurrency cc( CONFLICT_KEYS, false );
+    runConcurrently( cc, writeConflicting );
+
+    bt::BTree::SearchStats stats = cc._tree.getSearchStats();
+    if( stats._retries == 0 || stats._fallbacks == 0 )
+	throw TestException( "searches never ran into the writer" );
+}
+
 int main( void ) {
     try {
 	int i, j;
-	static const int count = 2000;
 	
 	std::cout << "Opening test.dat" << std::endl;
-	bt::BTree bt;
+	bt::BTree* pbt = new bt::BTree;
+	bt::BTree& bt = *pbt;
 	bt.create( std::string( "test.dat" ) );
 
-	std::vector< std::pair<int,std::string> > values;
 	values.reserve(count);
 
 	std::cout << "generating random data." << std::endl;
@@ -51,7 +657,6 @@ int main( void ) {
 	    values.push_back( std::make_pair( i, std::string(sz) ) );
 	}
 
-	int indices[count];
 	std::bitset<count> used;
 	
 	std::cout << "re-ordering insertion of data." << std::endl;
@@ -101,9 +706,6 @@ int main( void ) {
 	// test deletion of ~10% of the items
 	//
 
-	// keep track of which items are deleted using a bitset
-	std::bitset<count> deleted;
-	
 	std::cout << "beginning deletion." << std::endl;
 	
 	start = os::getTicks();
@@ -119,36 +721,158 @@ int main( void ) {
 
 	std::cout << "deletion took " << (end-start) << "ms." << std::endl;
 
-	
+
+	verify( bt );
+
+	// close the tree
+	delete pbt;
+
+
 	//
-	// test retrieval
+	// test reopening the tree, then reopening it read-only and mapped
 	//
-	
-	start = os::getTicks();
 
-	for( i = 0; i < count; i++ ) {
-	    std::pair<int,std::string> data = values[ indices[i] ];
+	std::cout << "reopening test.dat" << std::endl;
+	{
+	    bt::BTree bt;
+	    bt.open( std::string( "test.dat" ) );
+	    verify( bt );
+	}
 
-	    if( bt.search( data.first, sz ) ) {
-		// item found
-		
-		// was it deleted?
-		if( deleted.test( data.first ) )
-		    throw TestException( "search incorrectly returned deleted item" );
-		if( data.second != sz )
-		    throw TestException( "search did not match correct item" );
-	    } else {
-		// item not found
-		
-		// was it deleted?
-		if( !deleted.test( data.first ) )
-		    throw TestException( "search failed to find expected item" );
+	//
+	// test recovery: delete more items from a tree that is then
+	// abandoned, and reopen it from what is in the file and its log
+	//
+
+	std::cout << "recovering test.dat" << std::endl;
+	{
+	    CrashingTree bt;
+	    bt.open( std::string( "test.dat" ) );
+	    for( i = 0; i < count/20; i++ ) {
+		int n;
+		n = random() % values.size();
+		deleted.set(n);
+
+		bt.remove( n );
 	    }
+	    bt.crash();
 	}
+	{
+	    // a read-only tree must leave the log for a writer to replay
+	    bool refused = false;
+	    try {
+		bt::BTree bt;
+		bt.open( std::string( "test.dat" ), true );
+	    } catch( bt::RecoveryNeededException& ) {
+		refused = true;
+	    }
+	    if( !refused )
+		throw TestException( "read-only open did not refuse a log to replay" );
+	}
+	{
+	    bt::BTree bt;
+	    bt.open( std::string( "test.dat" ) );
+	    verify( bt );
+	}
+
+	std::cout << "reopening test.dat read-only, mapped" << std::endl;
+	{
+	    bt::BTree bt( bt::smMapped );
+	    bt.open( std::string( "test.dat" ), true );
+	    verify( bt );
+	}
+
+
+	//
+	// test bulk loading the remaining items into a new tree
+	//
 	
-	end = os::getTicks();
+	std::cout << "bulk loading load.dat" << std::endl;
+	{
+	    bt::BTree bt;
+	    bt.create( std::string( "load.dat" ) );
+	    
+	    start = os::getTicks();
+
+	    bt::BulkLoader loader( bt, 70 );
+	    for( i = 0; i < count; i++ )
+		if( !deleted.test( i ) )
+		    loader.add( i, values[i].second.c_str(), values[i].second.length()+1 );
+	    loader.finish();
+
+	    end = os::getTicks();
+
+	    std::cout << "bulk load took " << (end-start) << "ms." << std::endl;
+
+	    verify( bt );
+	}
+
+
+	std::cout << "testing duplicate keys." << std::endl;
+	testDuplicates();
+
+	std::cout << "crashing a bulk load." << std::endl;
+	testCrashedLoad();
+
+	std::cout << "reading while another thread writes." << std::endl;
+	testConcurrency();
 
-	std::cout << "retrieval took " << (end-start) << "ms." << std::endl;
+	std::cout << "searching leaves another thread splits." << std::endl;
+	testSearchConflicts();
+
+
+	//
+	// test the other key types: int64s on both sides of the 32-bit
+	// range, and byte strings with common prefixes
+	//
+
+	std::cout << "testing int64 and byte string keys." << std::endl;
+	{
+	    std::vector<bt::Key> keys;
+	    for( i = -count/2; i < count/2; i++ )
+		keys.push_back( bt::Key( (int64_t) i * (int64_t) 4000000007LL ) );
+	    testKeyFormat( bt::KeyFormat( bt::ktInt64 ), keys );
+	    testIntKeysOnInt64();
+
+	    // dense ids far from zero, which nodes keep as small offsets
+	    // from their low fence
+	    keys.clear();
+	    for( i = 0; i < count; i++ )
+		keys.push_back( bt::Key( (int64_t) 5000000000LL + i * 7 ) );
+	    testKeyFormat( bt::KeyFormat( bt::ktInt64 ), keys );
+
+	    // long keys that share most of their bytes, which nodes keep
+	    // once as a prefix
+	    static const char* regions[] = { "eu-west", "eu-north", "us-east" };
+	    keys.clear();
+	    for( i = 0; i < count; i++ ) {
+		sprintf( sz, "region/%s/2024-06-%02d/%08d", regions[i % 3], 1 + (i / 3) % 30, i );
+		keys.push_back( bt::Key( sz ) );
+	    }
+	    std::sort( keys.begin(), keys.end() );
+	    testKeyFormat( bt::KeyFormat( bt::ktBytes, 40 ), keys );
+
+	    keys.clear();
+	    for( i = 0; i < count; i++ ) {
+		// keys of each length, and ones that are prefixes of others
+		sprintf( sz, "tenant%02d/%0*d", i / 100, 1 + (i % 100) / 10, i % 10 );
+		keys.push_back( bt::Key( sz ) );
+	    }
+	    std::sort( keys.begin(), keys.end() );
+	    keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+	    testKeyFormat( bt::KeyFormat( bt::ktBytes, 20 ), keys );
+
+	    bool thrown = false;
+	    try {
+		bt::BTree bt;
+		bt.open( std::string( "keys.dat" ) );
+		bt.insert( bt::Key( "a key that is longer than twenty bytes" ), "x", 2 );
+	    } catch( bt::KeyTypeException& ) {
+		thrown = true;
+	    }
+	    if( !thrown )
+		throw TestException( "key too long for the tree was accepted" );
+	}
 	    
     } catch( std::exception& x ) {
 	std::cout << "Error: " << x.what() << std::endl;
@@ -49,5 +49,19 @@ namespace os {
 	_fname = fname;
 	_h = boost::shared_ptr<FileHandle>( new FileHandle(fname,om,rm,sm,am) );
     }
+
+
+    FileMapping::FileMapping() {
+    }
+
+    char* FileMapping::getAddress() const {
+	assert( _v );
+	return _v->getAddress();
+    }
+
+    size_t FileMapping::getLength() const {
+	assert( _v );
+	return _v->getLength();
+    }
 }
 
@@ -27,8 +27,11 @@ namespace os {
     };
     
     class FileHandle;
+    class FileMapping;
     
     class File {
+	friend class FileMapping;
+	
     protected:
 	std::string _fname;
 	boost::shared_ptr<FileHandle>	_h;
@@ -77,6 +80,233 @@ namespace os {
 
 	void write( void* pvData, unsigned int len ) throw(IoException);
 	void read( void* pvData, unsigned int len ) throw(IoException);
+
+	// positional I/O.  these neither use nor move the file pointer, so
+	// they cost one system call and can be issued from several threads
+	// against the same file.
+	struct IoVec {
+	    const void*		_data;
+	    unsigned int	_len;
+	};
+
+	void readAt( POS pos, void* pvData, unsigned int len ) throw(IoException);
+	void writeAt( POS pos, const void* pvData, unsigned int len ) throw(IoException);
+	void writeAtV( POS pos, const IoVec* iov, int count ) throw(IoException);
+
+	POS getSize() throw(IoException);
+	void setSize( POS size ) throw(IoException);
+
+	// wait until everything written to the file is on the disk
+	void sync() throw(IoException);
+    };
+
+
+    class MutexHandle;
+    class ConditionHandle;
+    class RWLockHandle;
+    class ThreadLocalHandle;
+    class ThreadHandle;
+
+    //
+    // Mutex and Condition are just enough to let threads wait for each
+    // other.  neither can be copied.
+    //
+    class Mutex {
+	friend class Condition;
+
+    protected:
+	boost::scoped_ptr<MutexHandle>	_h;
+
+	Mutex( const Mutex& );
+	Mutex& operator = ( const Mutex& );
+
+    public:
+	Mutex() ;
+	~Mutex() ;
+
+	void lock() ;
+	void unlock() ;
+    };
+
+    // holds a mutex for as long as it is in scope
+    class Lock {
+    protected:
+	Mutex&	_m;
+
+    public:
+	Lock( Mutex& m ) : _m(m) { _m.lock(); }
+	~Lock() { _m.unlock(); }
+    };
+
+    class Condition {
+    protected:
+	boost::scoped_ptr<ConditionHandle>	_h;
+
+	Condition( const Condition& );
+	Condition& operator = ( const Condition& );
+
+    public:
+	Condition() ;
+	~Condition() ;
+
+	// unlock m, wait to be woken, and lock m again before returning
+	void wait( Mutex& m ) ;
+	void signalAll() ;
+    };
+
+    //
+    // Version lets threads read something without locking it, and find
+    // out afterwards whether it changed while they read.  the one thread
+    // allowed to change it calls begin() and end() around each change,
+    // and the version is odd in between.  a reader calls read() before it
+    // starts, gives up if the version is odd, and trusts what it read
+    // only if validate() then finds the version unchanged.
+    //
+    class Version {
+    protected:
+	volatile long	_v;
+
+	Version( const Version& );
+	Version& operator = ( const Version& );
+
+    public:
+	Version() : _v(0) {}
+
+	static bool isStable( long v ) { return (v & 1) == 0; }
+
+	inline long read() const ;
+	inline bool validate( long v ) const ;
+	inline void begin() ;
+	inline void end() ;
+    };
+
+#ifdef WIN32
+    // volatile accesses are ordered like acquire loads and release
+    // stores, and the interlocked functions are full barriers
+    long Version::read() const { return _v; }
+    bool Version::validate( long v ) const { _ReadBarrier(); return _v == v; }
+    void Version::begin() { ::InterlockedIncrement( &_v ); }
+    void Version::end() { ::InterlockedIncrement( &_v ); }
+#else
+    long Version::read() const { return __atomic_load_n( &_v, __ATOMIC_ACQUIRE ); }
+    bool Version::validate( long v ) const {
+	// keep the reads of the data from moving past the second reading
+	__atomic_thread_fence( __ATOMIC_ACQUIRE );
+	return __atomic_load_n( &_v, __ATOMIC_RELAXED ) == v;
+    }
+    void Version::begin() { __atomic_add_fetch( &_v, 1, __ATOMIC_SEQ_CST ); }
+    void Version::end() { __atomic_add_fetch( &_v, 1, __ATOMIC_RELEASE ); }
+#endif
+
+    //
+    // RWLock is held either shared, by any number of threads, or
+    // exclusive, by one.  a thread waiting to lock it exclusive keeps new
+    // threads from locking it shared, so a steady stream of readers
+    // cannot starve it.  it cannot be locked recursively.
+    //
+    // its version moves on each time it is locked and unlocked exclusive,
+    // so a reader that never locks it can tell whether what the lock
+    // guards was changed under it.
+    //
+    class RWLock {
+    protected:
+	boost::scoped_ptr<RWLockHandle>	_h;
+	Version				_version;
+
+	RWLock( const RWLock& );
+	RWLock& operator = ( const RWLock& );
+
+    public:
+	RWLock() ;
+	~RWLock() ;
+
+	void lockShared() ;
+	bool tryLockShared() ;
+	void unlockShared() ;
+	void lockExclusive() ;
+	void unlockExclusive() ;
+
+	const Version& getVersion() const { return _version; }
+    };
+
+    // hold a RWLock shared, or exclusive, for as long as in scope
+    class SharedLock {
+    protected:
+	RWLock&	_l;
+
+    public:
+	SharedLock( RWLock& l ) : _l(l) { _l.lockShared(); }
+	~SharedLock() { _l.unlockShared(); }
+    };
+
+    class ExclusiveLock {
+    protected:
+	RWLock&	_l;
+
+    public:
+	ExclusiveLock( RWLock& l ) : _l(l) { _l.lockExclusive(); }
+	~ExclusiveLock() { _l.unlockExclusive(); }
+    };
+
+    //
+    // ThreadLocal holds a separate pointer for each thread, NULL until the
+    // thread sets it.  when a thread that set it exits, cleanup is called
+    // with its pointer.  it cannot be copied.
+    //
+    class ThreadLocal {
+    protected:
+	boost::scoped_ptr<ThreadLocalHandle>	_h;
+
+	ThreadLocal( const ThreadLocal& );
+	ThreadLocal& operator = ( const ThreadLocal& );
+
+    public:
+	ThreadLocal( void (*cleanup)( void* ) ) ;
+	~ThreadLocal() ;
+
+	void* get() ;
+	void set( void* p ) ;
+    };
+
+    //
+    // Thread calls run(arg) on a thread of its own.  join() waits for it
+    // to return, and must be called before the Thread is destroyed.  it
+    // cannot be copied.
+    //
+    class Thread {
+    protected:
+	boost::scoped_ptr<ThreadHandle>	_h;
+
+	Thread( const Thread& );
+	Thread& operator = ( const Thread& );
+
+    public:
+	Thread( void (*run)( void* ), void* arg ) throw(IoException) ;
+	~Thread() ;
+
+	void join() ;
+    };
+
+    class MappedView;
+
+    //
+    // FileMapping maps a range of a file into the address space.  Copies
+    // share the same view, which is unmapped when the last copy goes away.
+    //
+    class FileMapping {
+    protected:
+	boost::shared_ptr<MappedView>	_v;
+
+    public:
+	FileMapping() ;
+	FileMapping( File f, File::POS pos, size_t len, bool writable ) throw(IoException) ;
+
+	bool isMapped() const { return _v.get() != NULL; }
+	char* getAddress() const ;
+	size_t getLength() const ;
+
+	// start write-back of modified pages in [offset,offset+len) of the view
+	void sync( size_t offset, size_t len ) throw(IoException) ;
     };
 
     unsigned int getTicks();
@@ -106,6 +336,29 @@ namespace os {
 	    bcopy( src, dest, len );
 #endif
 	}
+
+	inline int compare( const void* a, const void* b, size_t len ) {
+	    return memcmp( a, b, len );
+	}
+    }
+
+    namespace bits {
+
+	// index of the lowest set bit of w, which must not be zero
+	inline int countTrailingZeros( unsigned int w ) {
+	    assert( w != 0 );
+#ifdef __GNUC__
+	    return __builtin_ctz( w );
+#else
+	    // isolate the lowest set bit, and look up its position with a
+	    // de Bruijn sequence
+	    static const int pos[32] = {
+		0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+		31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+	    };
+	    return pos[ ((w & (0u - w)) * 0x077CB531u) >> 27 ];
+#endif
+	}
 	
     }
 }
@@ -118,7 +371,7 @@ inline char* strcpy_n( char* d, const char* s, int len ) {
     return r;
 }
 
-#ifndef _STLPORT_VERSION
+#if defined(WIN32) && !defined(_STLPORT_VERSION)
 inline std::ostream& operator << ( std::ostream& os, os::File::POS i ) {
 	char sz[40];
 	sprintf(sz,"%I64d", i );
@@ -6,6 +6,7 @@
 #include <vector>
 #include <deque>
 #include <map>
+#include <set>
 
 #include <iostream>
 #include <iomanip>
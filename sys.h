@@ -4,25 +4,42 @@
 
 #include <winsock2.h>
 #include <windows.h>
+#include <intrin.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <conio.h>
 #include <ctype.h>
 
 typedef __int64		int64_t;
+typedef unsigned __int64	uint64_t;
 
 #endif
 
 #ifdef UNIX
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <strings.h>
 #include <ctype.h>
 #include <errno.h>
 
 #endif
+
+// SSE2 is used for comparing keys when the compiler targets it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+
+#define HAVE_SSE2
+#include <emmintrin.h>
+
+#endif
@@ -46,8 +46,9 @@ namespace os {
 	off_t offset;
 	int whence;
 
-	// don't support 64-bit files here...
-	offset = pos & 0xFFFFFFFF;
+	// off_t is 64 bits wide on LP64 systems, and on 32-bit systems when
+	// built with _FILE_OFFSET_BITS=64
+	offset = pos;
 
 	switch( sm ) {
 	case SeekAbsolute:
@@ -77,7 +78,7 @@ namespace os {
 		oss << "relative";
 		break;
 	    }
-	    oss << " position " << (int) pos ;
+	    oss << " position " << pos ;
 	    throw IoException( oss.str(), _fname, nError );
 	}
 
@@ -89,7 +90,13 @@ namespace os {
 	if( ! _h || _h->getHandle() == -1 )
 	    throw IoException( "Invalid file handle" );
 
-	POS p = 0;
+	off_t result = ::lseek( _h->getHandle(), 0, SEEK_CUR );
+	if( result == -1 ) {
+	    int nError = errno;
+	    throw IoException( "Cannot read file position", _fname, nError );
+	}
+
+	POS p = result;
 	return p;
     }
 
@@ -121,6 +128,252 @@ namespace os {
 	}
     }
 
+    void File::readAt( File::POS pos, void* pvData, unsigned int len ) throw(IoException) {
+	if( ! _h || _h->getHandle() == -1 )
+	    throw IoException( "Invalid file handle" );
+
+	char* p = static_cast<char*>(pvData);
+	while( len > 0 ) {
+	    ssize_t bytes_read = ::pread( _h->getHandle(), p, len, pos );
+	    if( bytes_read == -1 ) {
+		int nError = errno;
+		if( nError == EINTR )
+		    continue;
+		throw IoException( "read failed", _fname, nError );
+	    }
+	    if( bytes_read == 0 )
+		throw IoException( "read past end of file", _fname, 0 );
+	    p   += bytes_read;
+	    pos += bytes_read;
+	    len -= bytes_read;
+	}
+    }
+
+    void File::writeAt( File::POS pos, const void* pvData, unsigned int len ) throw(IoException) {
+	if( ! _h || _h->getHandle() == -1 )
+	    throw IoException( "Invalid file handle" );
+
+	const char* p = static_cast<const char*>(pvData);
+	while( len > 0 ) {
+	    ssize_t bytes_written = ::pwrite( _h->getHandle(), p, len, pos );
+	    if( bytes_written == -1 ) {
+		int nError = errno;
+		if( nError == EINTR )
+		    continue;
+		throw IoException( "write failed", _fname, nError );
+	    }
+	    p   += bytes_written;
+	    pos += bytes_written;
+	    len -= bytes_written;
+	}
+    }
+
+    void File::writeAtV( File::POS pos, const File::IoVec* iov, int count ) throw(IoException) {
+	if( ! _h || _h->getHandle() == -1 )
+	    throw IoException( "Invalid file handle" );
+
+	while( count > 0 ) {
+	    struct iovec v[IOV_MAX];
+	    int n = count < IOV_MAX ? count : IOV_MAX;
+	    size_t total = 0;
+	    for( int i = 0; i < n; i++ ) {
+		v[i].iov_base = const_cast<void*>(iov[i]._data);
+		v[i].iov_len  = iov[i]._len;
+		total += iov[i]._len;
+	    }
+
+	    ssize_t bytes_written = ::pwritev( _h->getHandle(), v, n, pos );
+	    if( bytes_written == -1 ) {
+		int nError = errno;
+		if( nError == EINTR )
+		    continue;
+		throw IoException( "write failed", _fname, nError );
+	    }
+
+	    if( (size_t) bytes_written < total ) {
+		// a short write; finish the remaining buffers one at a time
+		size_t skip = bytes_written;
+		for( int i = 0; i < n; i++ ) {
+		    if( skip >= iov[i]._len ) {
+			skip -= iov[i]._len;
+			continue;
+		    }
+		    writeAt( pos + bytes_written,
+			     static_cast<const char*>(iov[i]._data) + skip,
+			     iov[i]._len - skip );
+		    bytes_written += iov[i]._len - skip;
+		    skip = 0;
+		}
+	    }
+
+	    pos   += total;
+	    iov   += n;
+	    count -= n;
+	}
+    }
+
+    File::POS File::getSize() throw(IoException) {
+	if( ! _h || _h->getHandle() == -1 )
+	    throw IoException( "Invalid file handle" );
+
+	struct stat st;
+	if( ::fstat( _h->getHandle(), &st ) == -1 ) {
+	    int nError = errno;
+	    throw IoException( "stat failed", _fname, nError );
+	}
+
+	POS p = st.st_size;
+	return p;
+    }
+
+    void File::setSize( File::POS size ) throw(IoException) {
+	if( ! _h || _h->getHandle() == -1 )
+	    throw IoException( "Invalid file handle" );
+
+	if( ::ftruncate( _h->getHandle(), size ) == -1 ) {
+	    int nError = errno;
+	    throw IoException( "truncate failed", _fname, nError );
+	}
+    }
+
+    void File::sync() throw(IoException) {
+	if( ! _h || _h->getHandle() == -1 )
+	    throw IoException( "Invalid file handle" );
+
+	if( ::fsync( _h->getHandle() ) == -1 ) {
+	    int nError = errno;
+	    throw IoException( "fsync failed", _fname, nError );
+	}
+    }
+
+    MappedView::MappedView( std::string fname, int fd, File::POS pos, size_t len, bool writable ) throw(IoException) {
+	_fname = fname;
+	_len = len;
+	_addr = ::mmap( NULL,
+			len,
+			writable ? PROT_READ|PROT_WRITE : PROT_READ,
+			MAP_SHARED,
+			fd,
+			pos );
+
+	if( _addr == MAP_FAILED ) {
+	    int nError = errno;
+	    throw IoException( "mmap failed", fname, nError );
+	}
+    }
+
+    FileMapping::FileMapping( File f, File::POS pos, size_t len, bool writable ) throw(IoException) {
+	if( ! f._h || f._h->getHandle() == -1 )
+	    throw IoException( "Invalid file handle" );
+
+	_v = boost::shared_ptr<MappedView>( new MappedView(f._fname,f._h->getHandle(),pos,len,writable) );
+    }
+
+    void FileMapping::sync( size_t offset, size_t len ) throw(IoException) {
+	assert( _v );
+	assert( offset + len <= _v->getLength() );
+
+	// msync wants a page aligned address
+	size_t page = ::sysconf( _SC_PAGESIZE );
+	size_t start = offset - (offset % page);
+
+	if( ::msync( _v->getAddress() + start, len + (offset - start), MS_ASYNC ) == -1 ) {
+	    int nError = errno;
+	    throw IoException( "msync failed", _v->getFileName(), nError );
+	}
+    }
+
+    Mutex::Mutex() : _h( new MutexHandle ) {
+    }
+
+    Mutex::~Mutex() {
+    }
+
+    void Mutex::lock() {
+	::pthread_mutex_lock( &_h->_m );
+    }
+
+    void Mutex::unlock() {
+	::pthread_mutex_unlock( &_h->_m );
+    }
+
+    Condition::Condition() : _h( new ConditionHandle ) {
+    }
+
+    Condition::~Condition() {
+    }
+
+    void Condition::wait( Mutex& m ) {
+	::pthread_cond_wait( &_h->_c, &m._h->_m );
+    }
+
+    void Condition::signalAll() {
+	::pthread_cond_broadcast( &_h->_c );
+    }
+
+    RWLock::RWLock() : _h( new RWLockHandle ) {
+    }
+
+    RWLock::~RWLock() {
+    }
+
+    void RWLock::lockShared() {
+	::pthread_rwlock_rdlock( &_h->_l );
+    }
+
+    bool RWLock::tryLockShared() {
+	return ::pthread_rwlock_tryrdlock( &_h->_l ) == 0;
+    }
+
+    void RWLock::unlockShared() {
+	::pthread_rwlock_unlock( &_h->_l );
+    }
+
+    void RWLock::lockExclusive() {
+	::pthread_rwlock_wrlock( &_h->_l );
+	_version.begin();
+    }
+
+    void RWLock::unlockExclusive() {
+	_version.end();
+	::pthread_rwlock_unlock( &_h->_l );
+    }
+
+    ThreadLocal::ThreadLocal( void (*cleanup)( void* ) ) : _h( new ThreadLocalHandle( cleanup ) ) {
+    }
+
+    ThreadLocal::~ThreadLocal() {
+    }
+
+    void* ThreadLocal::get() {
+	return ::pthread_getspecific( _h->_key );
+    }
+
+    void ThreadLocal::set( void* p ) {
+	::pthread_setspecific( _h->_key, p );
+    }
+
+    static void* startThread( void* p ) {
+	ThreadHandle* h = static_cast<ThreadHandle*>(p);
+	h->_run( h->_arg );
+	return NULL;
+    }
+
+    Thread::Thread( void (*run)( void* ), void* arg ) throw(IoException) : _h( new ThreadHandle ) {
+	_h->_run = run;
+	_h->_arg = arg;
+	int nError = ::pthread_create( &_h->_t, NULL, startThread, _h.get() );
+	if( nError != 0 )
+	    throw IoException( "Cannot start thread", "thread", nError );
+    }
+
+    Thread::~Thread() {
+    }
+
+    void Thread::join() {
+	::pthread_join( _h->_t, NULL );
+    }
+
     unsigned int getTicks() {
 	struct timespec tp;
 	clock_gettime( CLOCK_HIGHRES, &tp );
@@ -22,5 +22,74 @@ namespace os {
 	operator int () { return _fd; }
 	int getHandle() { return _fd; }
     };
+
+    class MappedView {
+    protected:
+	std::string _fname;
+	void*	_addr;
+	size_t	_len;
+
+    public:
+	MappedView( std::string fname, int fd, File::POS pos, size_t len, bool writable ) throw( IoException );
+
+	~MappedView() throw() {
+	    if( _addr != MAP_FAILED ) {
+		::munmap( _addr, _len );
+		_addr = MAP_FAILED;
+	    }
+	}
+
+	char* getAddress() { return static_cast<char*>(_addr); }
+	size_t getLength() { return _len; }
+	const std::string& getFileName() { return _fname; }
+    };
+
+    class MutexHandle {
+    public:
+	pthread_mutex_t	_m;
+
+	MutexHandle() { ::pthread_mutex_init( &_m, NULL ); }
+	~MutexHandle() { ::pthread_mutex_destroy( &_m ); }
+    };
+
+    class ConditionHandle {
+    public:
+	pthread_cond_t	_c;
+
+	ConditionHandle() { ::pthread_cond_init( &_c, NULL ); }
+	~ConditionHandle() { ::pthread_cond_destroy( &_c ); }
+    };
+
+    class ThreadLocalHandle {
+    public:
+	pthread_key_t	_key;
+
+	ThreadLocalHandle( void (*cleanup)( void* ) ) { ::pthread_key_create( &_key, cleanup ); }
+	~ThreadLocalHandle() { ::pthread_key_delete( _key ); }
+    };
+
+    class ThreadHandle {
+    public:
+	pthread_t	_t;
+	void		(*_run)( void* );
+	void*		_arg;
+    };
+
+    class RWLockHandle {
+    public:
+	pthread_rwlock_t	_l;
+
+	RWLockHandle() {
+	    pthread_rwlockattr_t attr;
+	    ::pthread_rwlockattr_init( &attr );
+#ifdef __GLIBC__
+	    // glibc prefers readers unless told otherwise
+	    ::pthread_rwlockattr_setkind_np( &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+#endif
+	    ::pthread_rwlock_init( &_l, &attr );
+	    ::pthread_rwlockattr_destroy( &attr );
+	}
+	~RWLockHandle() { ::pthread_rwlock_destroy( &_l ); }
+    };
 }
 
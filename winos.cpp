@@ -104,7 +104,7 @@ namespace os {
 	    throw IoException( oss.str(), _fname, dwError );
 	}
 
-	POS p = (((POS)lDistanceToMoveHigh) << 32) & dwResult;
+	POS p = (((POS)lDistanceToMoveHigh) << 32) | dwResult;
 	return p;
     }
     
@@ -112,7 +112,17 @@ namespace os {
 	if( ! _h || _h->getHandle() == INVALID_HANDLE_VALUE )
 	    throw IoException( "Invalid file handle" );
 
-	POS p = 0;
+	// clear any previous error
+	SetLastError(NO_ERROR);
+
+	LONG lHigh = 0;
+	DWORD dwResult = ::SetFilePointer( _h->getHandle(), 0, &lHigh, FILE_CURRENT );
+
+	DWORD dwError;
+	if( (dwError = GetLastError()) != NO_ERROR )
+	    throw IoException( "Cannot read file position", _fname, dwError );
+
+	POS p = (((POS)lHigh) << 32) | dwResult;
 	return p;
     }
 
@@ -150,6 +160,233 @@ namespace os {
 	}
     }
 
+    void File::readAt( File::POS pos, void* pvData, unsigned int len ) throw(IoException) {
+	if( ! _h || _h->getHandle() == INVALID_HANDLE_VALUE )
+	    throw IoException( "Invalid file handle" );
+
+	OVERLAPPED ov;
+	ZeroMemory( &ov, sizeof(ov) );
+	ov.Offset     = (DWORD) (pos & 0xFFFFFFFF);
+	ov.OffsetHigh = (DWORD) (pos >> 32);
+
+	DWORD dwBytesRead = 0;
+	if( ! ::ReadFile( _h->getHandle(),
+			  pvData,
+			  len,
+			  &dwBytesRead,
+			  &ov ) ||
+	    dwBytesRead != len )
+	{
+	    DWORD dwError = ::GetLastError();
+	    throw IoException( "read failed", _fname, dwError );
+	}
+    }
+
+    void File::writeAt( File::POS pos, const void* pvData, unsigned int len ) throw(IoException) {
+	if( ! _h || _h->getHandle() == INVALID_HANDLE_VALUE )
+	    throw IoException( "Invalid file handle" );
+
+	OVERLAPPED ov;
+	ZeroMemory( &ov, sizeof(ov) );
+	ov.Offset     = (DWORD) (pos & 0xFFFFFFFF);
+	ov.OffsetHigh = (DWORD) (pos >> 32);
+
+	DWORD dwBytesWritten = 0;
+	if( ! ::WriteFile( _h->getHandle(),
+			   pvData,
+			   len,
+			   &dwBytesWritten,
+			   &ov ) ||
+	    dwBytesWritten != len )
+	{
+	    DWORD dwError = ::GetLastError();
+	    throw IoException( "write failed", _fname, dwError );
+	}
+    }
+
+    void File::writeAtV( File::POS pos, const File::IoVec* iov, int count ) throw(IoException) {
+	// WriteFileGather only works on unbuffered, overlapped handles, so
+	// gather the buffers here and issue a single write.
+	std::vector<char> buf;
+	for( int i = 0; i < count; i++ ) {
+	    const char* p = static_cast<const char*>(iov[i]._data);
+	    buf.insert( buf.end(), p, p + iov[i]._len );
+	}
+	if( !buf.empty() )
+	    writeAt( pos, &buf[0], buf.size() );
+    }
+
+    File::POS File::getSize() throw(IoException) {
+	if( ! _h || _h->getHandle() == INVALID_HANDLE_VALUE )
+	    throw IoException( "Invalid file handle" );
+
+	DWORD dwSizeHigh = 0;
+	DWORD dwSize = ::GetFileSize( _h->getHandle(), &dwSizeHigh );
+
+	DWORD dwError;
+	if( dwSize == INVALID_FILE_SIZE && (dwError = ::GetLastError()) != NO_ERROR )
+	    throw IoException( "stat failed", _fname, dwError );
+
+	POS p = (((POS)dwSizeHigh) << 32) | dwSize;
+	return p;
+    }
+
+    void File::setSize( File::POS size ) throw(IoException) {
+	seek( size, SeekAbsolute );
+
+	if( ! ::SetEndOfFile( _h->getHandle() ) ) {
+	    DWORD dwError = ::GetLastError();
+	    throw IoException( "truncate failed", _fname, dwError );
+	}
+    }
+
+    void File::sync() throw(IoException) {
+	if( ! ::FlushFileBuffers( _h->getHandle() ) ) {
+	    DWORD dwError = ::GetLastError();
+	    throw IoException( "FlushFileBuffers failed", _fname, dwError );
+	}
+    }
+
+    MappedView::MappedView( std::string fname, HANDLE h, File::POS pos, size_t len, bool writable ) throw(IoException) {
+	_fname = fname;
+	_hMap = NULL;
+	_addr = NULL;
+	_len = len;
+
+	// a writable mapping extends the file to cover the whole view
+	File::POS end = pos + len;
+	_hMap = ::CreateFileMapping( h,
+				     NULL,
+				     writable ? PAGE_READWRITE : PAGE_READONLY,
+				     (DWORD) (end >> 32),
+				     (DWORD) (end & 0xFFFFFFFF),
+				     NULL );
+	if( _hMap == NULL ) {
+	    DWORD dwError = ::GetLastError();
+	    throw IoException( "CreateFileMapping failed", fname, dwError );
+	}
+
+	_addr = ::MapViewOfFile( _hMap,
+				 writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+				 (DWORD) (pos >> 32),
+				 (DWORD) (pos & 0xFFFFFFFF),
+				 len );
+	if( _addr == NULL ) {
+	    DWORD dwError = ::GetLastError();
+	    ::CloseHandle( _hMap );
+	    _hMap = NULL;
+	    throw IoException( "MapViewOfFile failed", fname, dwError );
+	}
+    }
+
+    FileMapping::FileMapping( File f, File::POS pos, size_t len, bool writable ) throw(IoException) {
+	if( ! f._h || f._h->getHandle() == INVALID_HANDLE_VALUE )
+	    throw IoException( "Invalid file handle" );
+
+	_v = boost::shared_ptr<MappedView>( new MappedView(f._fname,f._h->getHandle(),pos,len,writable) );
+    }
+
+    void FileMapping::sync( size_t offset, size_t len ) throw(IoException) {
+	assert( _v );
+	assert( offset + len <= _v->getLength() );
+
+	if( ! ::FlushViewOfFile( _v->getAddress() + offset, len ) ) {
+	    DWORD dwError = ::GetLastError();
+	    throw IoException( "FlushViewOfFile failed", _v->getFileName(), dwError );
+	}
+    }
+
+    Mutex::Mutex() : _h( new MutexHandle ) {
+    }
+
+    Mutex::~Mutex() {
+    }
+
+    void Mutex::lock() {
+	::EnterCriticalSection( &_h->_cs );
+    }
+
+    void Mutex::unlock() {
+	::LeaveCriticalSection( &_h->_cs );
+    }
+
+    Condition::Condition() : _h( new ConditionHandle ) {
+    }
+
+    Condition::~Condition() {
+    }
+
+    void Condition::wait( Mutex& m ) {
+	::SleepConditionVariableCS( &_h->_cv, &m._h->_cs, INFINITE );
+    }
+
+    void Condition::signalAll() {
+	::WakeAllConditionVariable( &_h->_cv );
+    }
+
+    RWLock::RWLock() : _h( new RWLockHandle ) {
+    }
+
+    RWLock::~RWLock() {
+    }
+
+    void RWLock::lockShared() {
+	::AcquireSRWLockShared( &_h->_l );
+    }
+
+    bool RWLock::tryLockShared() {
+	return ::TryAcquireSRWLockShared( &_h->_l ) != 0;
+    }
+
+    void RWLock::unlockShared() {
+	::ReleaseSRWLockShared( &_h->_l );
+    }
+
+    void RWLock::lockExclusive() {
+	::AcquireSRWLockExclusive( &_h->_l );
+	_version.begin();
+    }
+
+    void RWLock::unlockExclusive() {
+	_version.end();
+	::ReleaseSRWLockExclusive( &_h->_l );
+    }
+
+    ThreadLocal::ThreadLocal( void (*cleanup)( void* ) ) : _h( new ThreadLocalHandle( cleanup ) ) {
+    }
+
+    ThreadLocal::~ThreadLocal() {
+    }
+
+    void* ThreadLocal::get() {
+	return ::FlsGetValue( _h->_index );
+    }
+
+    void ThreadLocal::set( void* p ) {
+	::FlsSetValue( _h->_index, p );
+    }
+
+    static DWORD WINAPI startThread( LPVOID p ) {
+	ThreadHandle* h = static_cast<ThreadHandle*>(p);
+	h->_run( h->_arg );
+	return 0;
+    }
+
+    Thread::Thread( void (*run)( void* ), void* arg ) throw(IoException) : _h( new ThreadHandle ) {
+	_h->_run = run;
+	_h->_arg = arg;
+	_h->_h = ::CreateThread( NULL, 0, startThread, _h.get(), 0, NULL );
+	if( _h->_h == NULL )
+	    throw IoException( "Cannot start thread", "thread", ::GetLastError() );
+    }
+
+    Thread::~Thread() {
+    }
+
+    void Thread::join() {
+	::WaitForSingleObject( _h->_h, INFINITE );
+    }
+
     unsigned int getTicks() {
 	return ::GetTickCount();
     }
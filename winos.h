@@ -22,5 +22,73 @@ namespace os {
 	operator HANDLE () { return _h; }
 	HANDLE getHandle() { return _h; }
     };
+
+    class MappedView {
+    protected:
+	std::string _fname;
+	HANDLE	_hMap;
+	void*	_addr;
+	size_t	_len;
+
+    public:
+	MappedView( std::string fname, HANDLE h, File::POS pos, size_t len, bool writable ) throw( IoException );
+
+	~MappedView() throw() {
+	    if( _addr != NULL ) {
+		::UnmapViewOfFile( _addr );
+		_addr = NULL;
+	    }
+	    if( _hMap != NULL ) {
+		::CloseHandle( _hMap );
+		_hMap = NULL;
+	    }
+	}
+
+	char* getAddress() { return static_cast<char*>(_addr); }
+	size_t getLength() { return _len; }
+	const std::string& getFileName() { return _fname; }
+    };
+
+    class MutexHandle {
+    public:
+	CRITICAL_SECTION	_cs;
+
+	MutexHandle() { ::InitializeCriticalSection( &_cs ); }
+	~MutexHandle() { ::DeleteCriticalSection( &_cs ); }
+    };
+
+    class ConditionHandle {
+    public:
+	CONDITION_VARIABLE	_cv;
+
+	ConditionHandle() { ::InitializeConditionVariable( &_cv ); }
+    };
+
+    class ThreadLocalHandle {
+    public:
+	DWORD		_index;
+
+	// fiber local storage, unlike thread local storage, calls back
+	// when a thread exits
+	ThreadLocalHandle( void (*cleanup)( void* ) ) { _index = ::FlsAlloc( (PFLS_CALLBACK_FUNCTION) cleanup ); }
+	~ThreadLocalHandle() { ::FlsFree( _index ); }
+    };
+
+    class ThreadHandle {
+    public:
+	HANDLE		_h;
+	void		(*_run)( void* );
+	void*		_arg;
+
+	ThreadHandle() : _h( NULL ) {}
+	~ThreadHandle() { if( _h ) ::CloseHandle( _h ); }
+    };
+
+    class RWLockHandle {
+    public:
+	SRWLOCK			_l;
+
+	RWLockHandle() { ::InitializeSRWLock( &_l ); }
+    };
 }
 